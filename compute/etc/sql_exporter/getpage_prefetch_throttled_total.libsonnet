@@ -0,0 +1,9 @@
+{
+  metric_name: 'getpage_prefetch_throttled_total',
+  type: 'counter',
+  help: 'Number of prefetch requests not issued because the prefetch buffer budget was exhausted',
+  values: [
+    'getpage_prefetch_throttled_total',
+  ],
+  query_ref: 'neon_perf_counters',
+}
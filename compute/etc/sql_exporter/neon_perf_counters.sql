@@ -11,9 +11,11 @@ SELECT d.* FROM pg_catalog.jsonb_to_record((SELECT jb FROM c)) AS d(
   getpage_sync_requests_total numeric,
   getpage_prefetch_misses_total numeric,
   getpage_prefetch_discards_total numeric,
+  getpage_prefetch_throttled_total numeric,
   getpage_prefetches_buffered numeric,
   pageserver_requests_sent_total numeric,
   pageserver_disconnects_total numeric,
   pageserver_send_flushes_total numeric,
+  pageserver_received_bytes_total numeric,
   pageserver_open_requests numeric
 );
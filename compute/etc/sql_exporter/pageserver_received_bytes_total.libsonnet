@@ -0,0 +1,9 @@
+{
+  metric_name: 'pageserver_received_bytes_total',
+  type: 'counter',
+  help: 'Number of bytes received from the pageserver',
+  values: [
+    'pageserver_received_bytes_total',
+  ],
+  query_ref: 'neon_perf_counters',
+}
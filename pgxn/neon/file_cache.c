@@ -22,13 +22,20 @@
 #include "neon_pgversioncompat.h"
 
 #include "access/parallel.h"
+#include "access/relation.h"
+#include "access/xlog.h"
+#include "catalog/objectaccess.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_database_d.h"
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "pagestore_client.h"
 #include "common/hashfn.h"
+#include "common/relpath.h"
 #include "pgstat.h"
 #include "port/pg_iovec.h"
 #include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
 #include RELFILEINFO_HDR
 #include "storage/buf_internals.h"
 #include "storage/fd.h"
@@ -36,9 +43,13 @@
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/pg_shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
 #include "utils/builtins.h"
 #include "utils/dynahash.h"
 #include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
 
 #include "hll.h"
 #include "bitmap.h"
@@ -76,6 +87,44 @@
  * table, we only enter them there to have a FileCacheEntry that we can keep
  * in the linked list. If the soft limit is raised again, we reuse the holes
  * before extending the nominal size of the file.
+ *
+ * ## Per-database shares
+ *
+ * When many databases share a compute, one database reading lots of data
+ * could evict everything the others have cached. With
+ * neon.file_cache_db_min_share, each database is guaranteed that share of
+ * the LFC (or an equal split of it, if there are too many databases for
+ * everyone to get their share). When the LFC is full, the victim is the
+ * least recently used chunk of a database that is above its guaranteed
+ * share, or of the database we're writing for. Databases can use more than
+ * their share while there's free space, but that space can be taken back.
+ *
+ * The number of chunks used by each database, and its hits and misses, are
+ * tracked in a fixed-size array in FileCacheControl, and lfc_db_hash maps
+ * databases to their slots. A slot is assigned on first use. When a database
+ * is dropped, its chunks are evicted first, and its slot is released for
+ * reuse once the last of them is gone. Backends remember the slot of their
+ * database, but check that it's still assigned to it before using it. When
+ * the array is full, the remaining databases share the last slot.
+ *
+ * ## Invalidation
+ *
+ * When a relation fork is dropped or truncated, its chunks are removed from
+ * the LFC right away, instead of waiting for them to age out of the LRU. The
+ * chunks are kept on the 'free' list, like holes but with their disk space
+ * still allocated, and are reused before holes or new space at the end of
+ * the file.
+ *
+ * If the size of the fork is known, from the relsize cache, its chunks are
+ * looked up directly. Otherwise, or if the fork is large, the invalidation is
+ * queued for the LFC invalidator background worker. It wakes up every
+ * LFC_INVALIDATOR_DELAY ms, or when the queue fills up, and removes the
+ * chunks of all queued forks in one scan of the hash table. The scan
+ * releases the lock every LFC_INVALIDATE_BATCH entries, so that it doesn't
+ * block readers for long. If the queue is full, the invalidation is skipped,
+ * and the chunks are evicted by the LRU eventually. Invalidation only ever
+ * removes pages from the cache, so it doesn't matter if it's late, or if the
+ * relfilenumber has been reused by then.
  */
 
 /* Local file storage allocation chunk.
@@ -95,6 +144,22 @@
 #define SIZE_MB_TO_CHUNKS(size) ((uint32)((size) * MB / BLCKSZ / BLOCKS_PER_CHUNK))
 #define CHUNK_BITMAP_SIZE ((BLOCKS_PER_CHUNK + 31) / 32)
 
+#define LFC_MAX_DATABASES	64
+
+/* How far into the LRU list to look for a chunk that may be evicted */
+#define LFC_VICTIM_SCAN_LIMIT	256
+
+/* Invalidations that cover more chunks than this are left to the worker */
+#define LFC_INVALIDATE_PROBE_LIMIT	1024
+/*
+ * Number of chunks to look up or scan between releasing and reacquiring
+ * lfc_lock
+ */
+#define LFC_INVALIDATE_BATCH	64
+#define LFC_MAX_PENDING_INVALIDATIONS	64
+/* Delay between scans by the invalidator worker, in ms */
+#define LFC_INVALIDATOR_DELAY	1000
+
 typedef struct FileCacheEntry
 {
 	BufferTag	key;
@@ -102,9 +167,29 @@ typedef struct FileCacheEntry
 	uint32		offset;
 	uint32		access_count;
 	uint32		bitmap[CHUNK_BITMAP_SIZE];
-	dlist_node	list_node;		/* LRU/holes list node */
+	/* pages being written by lfc_prewarmv(), see there */
+	uint32		prewarming[CHUNK_BITMAP_SIZE];
+	dlist_node	list_node;		/* LRU/holes/free list node */
 } FileCacheEntry;
 
+typedef struct FileCacheDbStats
+{
+	Oid			dboid;
+	bool		in_use;			/* slot is assigned to 'dboid' */
+	bool		dropped;		/* the database has been dropped */
+	uint32		used;			/* number of used chunks */
+	uint64		hits;
+	uint64		misses;
+	uint64		writes;
+} FileCacheDbStats;
+
+/* Entry of lfc_db_hash, which maps databases to their slot in dbs[] */
+typedef struct FileCacheDbHashEntry
+{
+	Oid			dboid;			/* hash key */
+	int			slot;
+} FileCacheDbHashEntry;
+
 typedef struct FileCacheControl
 {
 	uint64		generation;		/* generation is needed to handle correct hash
@@ -121,17 +206,36 @@ typedef struct FileCacheControl
 	dlist_head	lru;			/* double linked list for LRU replacement
 								 * algorithm */
 	dlist_head  holes;          /* double linked list of punched holes */
+	dlist_head	free;			/* double linked list of invalidated chunks */
+	uint32		n_free;			/* number of chunks in 'free' */
+	uint64		invalidated;	/* number of chunks invalidated */
 	HyperLogLogState wss_estimation; /* estimation of working set size */
+	FileCacheDbStats dbs[LFC_MAX_DATABASES + 1];	/* the last one is for
+													 * all other databases */
+
+	/*
+	 * Invalidations queued for the invalidator worker. blockNum is the first
+	 * block of the fork to invalidate.
+	 */
+	int			n_pending;
+	BufferTag	pending[LFC_MAX_PENDING_INVALIDATIONS];
+	Latch	   *invalidator_latch;
 } FileCacheControl;
 
 static HTAB *lfc_hash;
+static HTAB *lfc_db_hash;
 static int	lfc_desc = 0;
 static LWLockId lfc_lock;
 static int	lfc_max_size;
 static int	lfc_size_limit;
 static char *lfc_path;
+static bool lfc_readahead = true;
+static int	lfc_db_min_share = 0;
 static FileCacheControl *lfc_ctl;
 static shmem_startup_hook_type prev_shmem_startup_hook;
+static object_access_hook_type prev_object_access_hook;
+
+static void lfc_db_maybe_release(FileCacheDbStats *db);
 #if PG_VERSION_NUM>=150000
 static shmem_request_hook_type prev_shmem_request_hook;
 #endif
@@ -168,8 +272,16 @@ lfc_disable(char const *op)
 		lfc_ctl->size = 0;
 		lfc_ctl->used = 0;
 		lfc_ctl->limit = 0;
+		for (int i = 0; i <= LFC_MAX_DATABASES; i++)
+		{
+			lfc_ctl->dbs[i].used = 0;
+			lfc_db_maybe_release(&lfc_ctl->dbs[i]);
+		}
 		dlist_init(&lfc_ctl->lru);
 		dlist_init(&lfc_ctl->holes);
+		dlist_init(&lfc_ctl->free);
+		lfc_ctl->n_free = 0;
+		lfc_ctl->n_pending = 0;
 
 		if (lfc_desc > 0)
 		{
@@ -211,7 +323,7 @@ lfc_disable(char const *op)
 /*
  * This check is done without obtaining lfc_lock, so it is unreliable
  */
-static bool
+bool
 lfc_maybe_disabled(void)
 {
 	return !lfc_ctl || !LFC_ENABLED();
@@ -277,6 +389,19 @@ lfc_shmem_startup(void)
 		lfc_ctl->time_write = 0;
 		dlist_init(&lfc_ctl->lru);
 		dlist_init(&lfc_ctl->holes);
+		dlist_init(&lfc_ctl->free);
+		lfc_ctl->n_free = 0;
+		lfc_ctl->invalidated = 0;
+		lfc_ctl->n_pending = 0;
+		lfc_ctl->invalidator_latch = NULL;
+		memset(lfc_ctl->dbs, 0, sizeof(lfc_ctl->dbs));
+
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(FileCacheDbHashEntry);
+		lfc_db_hash = ShmemInitHash("lfc_db_hash",
+									LFC_MAX_DATABASES, LFC_MAX_DATABASES,
+									&info,
+									HASH_ELEM | HASH_BLOBS);
 
 		/* Initialize hyper-log-log structure for estimating working set size */
 		initSHLL(&lfc_ctl->wss_estimation);
@@ -306,6 +431,7 @@ lfc_shmem_request(void)
 #endif
 
 	RequestAddinShmemSpace(sizeof(FileCacheControl) + hash_estimate_size(SIZE_MB_TO_CHUNKS(lfc_max_size) + 1, sizeof(FileCacheEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(LFC_MAX_DATABASES, sizeof(FileCacheDbHashEntry)));
 	RequestNamedLWLockTranche("lfc_lock", 1);
 }
 
@@ -322,6 +448,294 @@ is_normal_backend(void)
 	return lfc_ctl && MyProc && UsedShmemSegAddr && !IsParallelWorker();
 }
 
+/*
+ * Get the statistics slot of a database, assigning one if it doesn't have
+ * one yet. Must be called with lfc_lock held in exclusive mode.
+ *
+ * This is for accesses on behalf of the database, so it also revives the
+ * slot of a database that was marked as dropped; the DROP DATABASE must have
+ * failed.
+ */
+static FileCacheDbStats *
+lfc_db_stats(Oid dboid)
+{
+	static Oid	cached_dboid = InvalidOid;
+	static int	cached_slot = -1;
+	FileCacheDbHashEntry *hentry;
+	FileCacheDbStats *db;
+	bool		found;
+	int			slot;
+
+	/* the slot we used last time might have been reassigned since */
+	if (cached_slot >= 0 && cached_slot < LFC_MAX_DATABASES &&
+		cached_dboid == dboid && lfc_ctl->dbs[cached_slot].in_use &&
+		lfc_ctl->dbs[cached_slot].dboid == dboid)
+	{
+		db = &lfc_ctl->dbs[cached_slot];
+		db->dropped = false;
+		return db;
+	}
+
+	hentry = hash_search(lfc_db_hash, &dboid, HASH_FIND, NULL);
+	if (hentry != NULL)
+		slot = hentry->slot;
+	else
+	{
+		for (slot = 0; slot < LFC_MAX_DATABASES; slot++)
+		{
+			if (!lfc_ctl->dbs[slot].in_use)
+				break;
+		}
+		if (slot < LFC_MAX_DATABASES)
+		{
+			hentry = hash_search(lfc_db_hash, &dboid, HASH_ENTER, &found);
+			Assert(!found);
+			hentry->slot = slot;
+			memset(&lfc_ctl->dbs[slot], 0, sizeof(FileCacheDbStats));
+			lfc_ctl->dbs[slot].dboid = dboid;
+			lfc_ctl->dbs[slot].in_use = true;
+		}
+	}
+
+	cached_dboid = dboid;
+	cached_slot = slot;
+	db = &lfc_ctl->dbs[slot];
+	db->dropped = false;
+	return db;
+}
+
+/*
+ * Get the statistics slot that a chunk is counted in. Unlike lfc_db_stats(),
+ * this doesn't assign slots or revive dropped databases. A database without
+ * a slot of its own is counted in the overflow slot. Must be called with
+ * lfc_lock held.
+ */
+static FileCacheDbStats *
+lfc_chunk_db_stats(FileCacheEntry *entry)
+{
+	Oid			dboid = NInfoGetDbOid(BufTagGetNRelFileInfo(entry->key));
+	FileCacheDbHashEntry *hentry;
+
+	hentry = hash_search(lfc_db_hash, &dboid, HASH_FIND, NULL);
+	return &lfc_ctl->dbs[hentry ? hentry->slot : LFC_MAX_DATABASES];
+}
+
+/*
+ * Release the slot of a dropped database, once it has no chunks left.
+ */
+static void
+lfc_db_maybe_release(FileCacheDbStats *db)
+{
+	if (db->in_use && db->dropped && db->used == 0)
+	{
+		hash_search(lfc_db_hash, &db->dboid, HASH_REMOVE, NULL);
+		memset(db, 0, sizeof(FileCacheDbStats));
+	}
+}
+
+/*
+ * Account for a chunk that's no longer cached. Must be called with lfc_lock
+ * held in exclusive mode.
+ *
+ * A database that got its own slot after some of its chunks had been counted
+ * in the overflow slot decrements its own slot for those chunks, so the
+ * counts are clamped at zero.
+ */
+static void
+lfc_db_release_chunk(FileCacheEntry *entry)
+{
+	FileCacheDbStats *db = lfc_chunk_db_stats(entry);
+
+	if (db->used > 0)
+		db->used -= 1;
+	lfc_db_maybe_release(db);
+}
+
+/*
+ * Stop guaranteeing a share of the LFC to a database that is being dropped.
+ * Its chunks are evicted first, and its slot is released once they are all
+ * gone.
+ */
+static void
+lfc_object_access_hook(ObjectAccessType access, Oid classId, Oid objectId,
+					   int subId, void *arg)
+{
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access == OAT_DROP && classId == DatabaseRelationId &&
+		lfc_ctl != NULL && LFC_ENABLED())
+	{
+		FileCacheDbHashEntry *hentry;
+
+		LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+		hentry = hash_search(lfc_db_hash, &objectId, HASH_FIND, NULL);
+		if (hentry != NULL)
+		{
+			FileCacheDbStats *db = &lfc_ctl->dbs[hentry->slot];
+
+			db->dropped = true;
+			lfc_db_maybe_release(db);
+		}
+		LWLockRelease(lfc_lock);
+	}
+}
+
+/*
+ * Choose the chunk to evict to make room for a chunk of the given database,
+ * and unlink it from the LRU list. Returns NULL if there is nothing we may
+ * evict. Must be called with lfc_lock held in exclusive mode.
+ */
+static FileCacheEntry *
+lfc_choose_victim(Oid dboid)
+{
+	FileCacheDbStats *db;
+	uint32		min_chunks;
+	int			n_active = 0;
+	int			n_scanned = 0;
+	dlist_iter	iter;
+
+	if (dlist_is_empty(&lfc_ctl->lru))
+		return NULL;
+
+	if (lfc_db_min_share == 0)
+		return dlist_container(FileCacheEntry, list_node,
+							   dlist_pop_head_node(&lfc_ctl->lru));
+
+	/*
+	 * Every database that has something cached is guaranteed its share, or
+	 * an equal split of the cache if the shares don't add up. Dropped
+	 * databases don't get a share.
+	 */
+	for (int i = 0; i <= LFC_MAX_DATABASES; i++)
+	{
+		if (lfc_ctl->dbs[i].used > 0 && !lfc_ctl->dbs[i].dropped)
+			n_active++;
+	}
+	min_chunks = Min((uint64) lfc_ctl->limit * lfc_db_min_share / 100,
+					 lfc_ctl->limit / Max(n_active, 1));
+
+	db = lfc_db_stats(dboid);
+
+	dlist_foreach(iter, &lfc_ctl->lru)
+	{
+		FileCacheEntry *victim = dlist_container(FileCacheEntry, list_node, iter.cur);
+		FileCacheDbStats *victim_db = lfc_chunk_db_stats(victim);
+
+		if (victim_db == db || victim_db->dropped ||
+			victim_db->used > min_chunks)
+		{
+			dlist_delete(&victim->list_node);
+			return victim;
+		}
+
+		if (++n_scanned >= LFC_VICTIM_SCAN_LIMIT)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Enter a dummy entry for an unused chunk to the hash table, and add it to
+ * the 'holes' or 'free' list. Must be called with lfc_lock held in exclusive
+ * mode.
+ */
+static void
+lfc_enter_unused_chunk(uint32 offset, dlist_head *list)
+{
+	FileCacheEntry *dummy;
+	BufferTag	tag;
+	uint32		hash;
+	bool		found;
+
+	memset(&tag, 0, sizeof(tag));
+	tag.blockNum = offset;
+	hash = get_hash_value(lfc_hash, &tag);
+	dummy = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_ENTER, &found);
+	CriticalAssert(!found);
+	dummy->hash = hash;
+	dummy->offset = offset;
+	dummy->access_count = 0;
+	dlist_push_tail(list, &dummy->list_node);
+}
+
+/*
+ * Remove a chunk that isn't pinned from the LRU list and the hash table, and
+ * return its offset. Must be called with lfc_lock held in exclusive mode.
+ */
+static uint32
+lfc_remove_chunk(FileCacheEntry *entry)
+{
+	uint32		offset = entry->offset;
+
+	CriticalAssert(entry->access_count == 0);
+	dlist_delete(&entry->list_node);
+	for (int i = 0; i < BLOCKS_PER_CHUNK; i++)
+	{
+		lfc_ctl->used_pages -= (entry->bitmap[i >> 5] >> (i & 31)) & 1;
+	}
+	lfc_db_release_chunk(entry);
+	hash_search_with_hash_value(lfc_hash, &entry->key, entry->hash, HASH_REMOVE, NULL);
+	lfc_ctl->used -= 1;
+
+	return offset;
+}
+
+/*
+ * Remove the pages from 'from_blkno' onwards from a chunk. Returns true if
+ * no pages remain and the chunk isn't pinned, so that it can be freed. Must
+ * be called with lfc_lock held in exclusive mode.
+ */
+static bool
+lfc_clear_chunk_pages(FileCacheEntry *entry, BlockNumber from_blkno)
+{
+	int			first = 0;
+
+	if (from_blkno > entry->key.blockNum)
+		first = from_blkno - entry->key.blockNum;
+
+	for (int i = first; i < BLOCKS_PER_CHUNK; i++)
+	{
+		uint32		bit = (uint32) 1 << (i & 31);
+
+		if (entry->bitmap[i >> 5] & bit)
+		{
+			entry->bitmap[i >> 5] &= ~bit;
+			lfc_ctl->used_pages -= 1;
+		}
+		entry->prewarming[i >> 5] &= ~bit;
+	}
+
+	/*
+	 * A pinned chunk is being read or written. It goes back to the LRU list
+	 * when it's unpinned, and is evicted from there.
+	 */
+	if (entry->access_count != 0)
+		return false;
+
+	for (int i = 0; i < CHUNK_BITMAP_SIZE; i++)
+	{
+		if (entry->bitmap[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Move a chunk to the free list. Must be called with lfc_lock held in
+ * exclusive mode.
+ */
+static void
+lfc_free_chunk(FileCacheEntry *entry)
+{
+	uint32		offset = lfc_remove_chunk(entry);
+
+	lfc_enter_unused_chunk(offset, &lfc_ctl->free);
+	lfc_ctl->n_free += 1;
+	lfc_ctl->invalidated += 1;
+}
+
 static bool
 lfc_check_limit_hook(int *newval, void **extra, GucSource source)
 {
@@ -346,6 +760,24 @@ lfc_change_limit_hook(int newval, void *extra)
 
 	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
 
+	/* Return the space of invalidated chunks to the file system first */
+	while (new_size < lfc_ctl->used + lfc_ctl->n_free &&
+		   !dlist_is_empty(&lfc_ctl->free))
+	{
+		FileCacheEntry *chunk = dlist_container(FileCacheEntry, list_node,
+												dlist_pop_head_node(&lfc_ctl->free));
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (fallocate(lfc_desc, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					  (off_t) chunk->offset * BLOCKS_PER_CHUNK * BLCKSZ,
+					  BLOCKS_PER_CHUNK * BLCKSZ) < 0)
+			neon_log(LOG, "Failed to punch hole in file: %m");
+#endif
+		/* The dummy entry of a free chunk is the same as that of a hole */
+		dlist_push_tail(&lfc_ctl->holes, &chunk->list_node);
+		lfc_ctl->n_free -= 1;
+	}
+
 	while (new_size < lfc_ctl->used && !dlist_is_empty(&lfc_ctl->lru))
 	{
 		/*
@@ -369,6 +801,7 @@ lfc_change_limit_hook(int newval, void *extra)
 		{
 			lfc_ctl->used_pages -= (victim->bitmap[i >> 5] >> (i & 31)) & 1;
 		}
+		lfc_db_release_chunk(victim);
 		hash_search_with_hash_value(lfc_hash, &victim->key, victim->hash, HASH_REMOVE, NULL);
 
 		memset(&holetag, 0, sizeof(holetag));
@@ -395,6 +828,8 @@ lfc_change_limit_hook(int newval, void *extra)
 void
 lfc_init(void)
 {
+	BackgroundWorker bgw;
+
 	/*
 	 * In order to create our shared memory area, we have to be loaded via
 	 * shared_preload_libraries.
@@ -440,11 +875,52 @@ lfc_init(void)
 							   NULL,
 							   NULL);
 
+	DefineCustomIntVariable("neon.file_cache_db_min_share",
+							"Share of the local file cache guaranteed to each database, in percent",
+							"Chunks of a database that uses less than its share "
+							"are only evicted to make room for the same database. "
+							"0 disables per-database shares.",
+							&lfc_db_min_share,
+							0,
+							0,
+							100,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("neon.file_cache_readahead",
+							 "Start reading prefetched blocks that are in the local file cache in the background",
+							 NULL,
+							 &lfc_readahead,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	if (lfc_max_size == 0)
 		return;
 
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	bgw.bgw_start_time = BgWorkerStart_PostmasterStart;
+	snprintf(bgw.bgw_library_name, BGW_MAXLEN, "neon");
+	snprintf(bgw.bgw_function_name, BGW_MAXLEN, "FileCacheInvalidatorMain");
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "LFC invalidator");
+	snprintf(bgw.bgw_type, BGW_MAXLEN, "LFC invalidator");
+	bgw.bgw_restart_time = 5;
+	bgw.bgw_notify_pid = 0;
+	bgw.bgw_main_arg = (Datum) 0;
+
+	RegisterBackgroundWorker(&bgw);
+
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = lfc_shmem_startup;
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = lfc_object_access_hook;
 #if PG_VERSION_NUM>=150000
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = lfc_shmem_request;
@@ -487,12 +963,18 @@ lfc_cache_contains(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno)
 }
 
 /*
- * Check if page is present in the cache.
- * Returns true if page is found in local cache.
+ * A range of blocks in the cache file, to pass to posix_fadvise()
  */
-int
-lfc_cache_containsv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
-					int nblocks, bits8 *bitmap)
+typedef struct
+{
+	off_t		start;			/* in blocks */
+	int			nblocks;
+} LfcReadaheadRange;
+
+static int
+lfc_cache_containsv_internal(NRelFileInfo rinfo, ForkNumber forkNum,
+							 BlockNumber blkno, int nblocks, bits8 *bitmap,
+							 LfcReadaheadRange *ranges, int *nranges)
 {
 	BufferTag	tag;
 	FileCacheEntry *entry;
@@ -534,6 +1016,27 @@ lfc_cache_containsv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 				{
 					BITMAP_SET(bitmap, i);
 					found++;
+
+					if (ranges)
+					{
+						off_t		offset = (off_t) entry->offset * BLOCKS_PER_CHUNK + chunk_offs;
+
+						/*
+						 * Extend the previous range if this block directly
+						 * follows it in the cache file. That's common, as
+						 * chunks of a relation that were loaded together
+						 * tend to be allocated next to each other.
+						 */
+						if (*nranges > 0 &&
+							ranges[*nranges - 1].start + ranges[*nranges - 1].nblocks == offset)
+							ranges[*nranges - 1].nblocks++;
+						else
+						{
+							ranges[*nranges].start = offset;
+							ranges[*nranges].nblocks = 1;
+							(*nranges)++;
+						}
+					}
 				}
 			}
 		}
@@ -577,6 +1080,61 @@ lfc_cache_containsv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 	return found;
 }
 
+/*
+ * Check if page is present in the cache.
+ * Returns true if page is found in local cache.
+ */
+int
+lfc_cache_containsv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
+					int nblocks, bits8 *bitmap)
+{
+	return lfc_cache_containsv_internal(rinfo, forkNum, blkno, nblocks, bitmap,
+										NULL, NULL);
+}
+
+/*
+ * Like lfc_cache_containsv(), but also tells the kernel that we will soon
+ * read the blocks that are present in the cache, so that it can start
+ * reading them in the background. That way a prefetch helps LFC hits too,
+ * not just the blocks that have to be fetched from the pageserver.
+ *
+ * 'nblocks' must not be larger than PG_IOV_MAX.
+ *
+ * The advice is given after releasing the lock, so the chunk might have been
+ * evicted and reused by then. That's harmless, we just read some other
+ * blocks into the kernel page cache.
+ */
+int
+lfc_prefetchv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
+			  int nblocks, bits8 *bitmap)
+{
+#ifdef USE_POSIX_FADVISE
+	LfcReadaheadRange ranges[PG_IOV_MAX];
+	int			nranges = 0;
+	int			found;
+
+	Assert(nblocks <= PG_IOV_MAX);
+
+	if (!lfc_readahead || !lfc_ensure_opened())
+		return lfc_cache_containsv(rinfo, forkNum, blkno, nblocks, bitmap);
+
+	found = lfc_cache_containsv_internal(rinfo, forkNum, blkno, nblocks, bitmap,
+										 ranges, &nranges);
+
+	for (int i = 0; i < nranges; i++)
+	{
+		/* this is only a hint, so ignore errors */
+		(void) posix_fadvise(lfc_desc, ranges[i].start * BLCKSZ,
+							 (off_t) ranges[i].nblocks * BLCKSZ,
+							 POSIX_FADV_WILLNEED);
+	}
+
+	return found;
+#else
+	return lfc_cache_containsv(rinfo, forkNum, blkno, nblocks, bitmap);
+#endif
+}
+
 /*
  * Evict a page (if present) from the local file cache
  */
@@ -618,44 +1176,322 @@ lfc_evict(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno)
 
 	/* remove the page from the cache */
 	entry->bitmap[chunk_offs >> 5] &= ~((uint32)1 << (chunk_offs & (32 - 1)));
+	entry->prewarming[chunk_offs >> 5] &= ~((uint32)1 << (chunk_offs & (32 - 1)));
+
+	if (entry->access_count == 0)
+	{
+		/*
+		 * If the chunk has no live entries, we can position the chunk to be
+		 * recycled first.
+		 */
+		if (entry->bitmap[chunk_offs >> 5] == 0)
+		{
+			bool		has_remaining_pages = false;
+
+			for (int i = 0; i < CHUNK_BITMAP_SIZE; i++)
+			{
+				if (entry->bitmap[i] != 0)
+				{
+					has_remaining_pages = true;
+					break;
+				}
+			}
+
+			/*
+			 * Put the entry at the position that is first to be reclaimed when we
+			 * have no cached pages remaining in the chunk
+			 */
+			if (!has_remaining_pages)
+			{
+				dlist_delete(&entry->list_node);
+				dlist_push_head(&lfc_ctl->lru, &entry->list_node);
+			}
+		}
+	}
+
+	/*
+	 * Done: apart from empty chunks, we don't move chunks in the LRU when
+	 * they're empty because eviction isn't usage.
+	 */
+
+	LWLockRelease(lfc_lock);
+}
+
+/*
+ * Remove the pages of a relation fork from 'from_blkno' onwards from the
+ * cache, when the fork is dropped (from_blkno == 0) or truncated. 'nblocks'
+ * is the size of the fork before that, or InvalidBlockNumber if it's not
+ * known.
+ */
+void
+lfc_invalidate(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber from_blkno,
+			   BlockNumber nblocks)
+{
+	BufferTag	tag;
+	Latch	   *latch = NULL;
+
+	if (lfc_maybe_disabled())	/* fast exit if file cache is disabled */
+		return;
+
+	CopyNRelFileInfoToBufTag(tag, rinfo);
+	tag.forkNum = forkNum;
+
+	CriticalAssert(BufTagGetRelNumber(&tag) != InvalidRelFileNumber);
+
+	if (nblocks != InvalidBlockNumber)
+	{
+		uint64		first_chunk = from_blkno & ~(BLOCKS_PER_CHUNK - 1);
+		uint64		chunkno = first_chunk;
+
+		if (from_blkno >= nblocks)
+			return;
+
+		if ((nblocks - first_chunk) / BLOCKS_PER_CHUNK <= LFC_INVALIDATE_PROBE_LIMIT)
+		{
+			/*
+			 * Look up the chunks directly. Release the lock between batches,
+			 * so that we don't block readers for too long.
+			 */
+			while (chunkno < nblocks)
+			{
+				LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+
+				if (!LFC_ENABLED())
+				{
+					LWLockRelease(lfc_lock);
+					return;
+				}
+
+				for (int i = 0; i < LFC_INVALIDATE_BATCH && chunkno < nblocks; i++)
+				{
+					FileCacheEntry *entry;
+					uint32		hash;
+
+					tag.blockNum = (BlockNumber) chunkno;
+					hash = get_hash_value(lfc_hash, &tag);
+					entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, NULL);
+					if (entry != NULL && lfc_clear_chunk_pages(entry, from_blkno))
+						lfc_free_chunk(entry);
+
+					chunkno += BLOCKS_PER_CHUNK;
+				}
+
+				LWLockRelease(lfc_lock);
+			}
+			return;
+		}
+	}
+
+	/* Leave it to the invalidator */
+	tag.blockNum = from_blkno;
+
+	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+
+	if (LFC_ENABLED())
+	{
+		int			i;
+
+		/* Merge with an earlier request for the same fork */
+		for (i = 0; i < lfc_ctl->n_pending; i++)
+		{
+			BufferTag  *pending = &lfc_ctl->pending[i];
+
+			if (pending->forkNum == tag.forkNum &&
+				RelFileInfoEquals(BufTagGetNRelFileInfo(lfc_ctl->pending[i]), rinfo))
+			{
+				pending->blockNum = Min(pending->blockNum, from_blkno);
+				break;
+			}
+		}
+
+		if (i == lfc_ctl->n_pending && lfc_ctl->n_pending < LFC_MAX_PENDING_INVALIDATIONS)
+			lfc_ctl->pending[lfc_ctl->n_pending++] = tag;
+
+		/*
+		 * The worker wakes up periodically anyway, so that invalidations can
+		 * accumulate. Only wake it up early if the queue is full.
+		 */
+		if (lfc_ctl->n_pending == LFC_MAX_PENDING_INVALIDATIONS)
+			latch = lfc_ctl->invalidator_latch;
+	}
+
+	LWLockRelease(lfc_lock);
+
+	if (latch)
+		SetLatch(latch);
+}
+
+/*
+ * Process the queued invalidations with one scan of the hash table.
+ * 'offsets' must have room for the offsets of all chunks in the cache.
+ *
+ * The lock is released every LFC_INVALIDATE_BATCH entries. A dynahash
+ * sequential scan can't be resumed after that, so each batch starts a new
+ * scan, and skips over the entries that earlier batches have looked at and
+ * kept. Skipping is cheap compared to matching the entries against the
+ * queue. Entries that are added or removed by others in between shift the
+ * position, so a few entries may be missed or visited twice, which is fine,
+ * as invalidation is best-effort anyway.
+ */
+static void
+lfc_process_pending_invalidations(uint32 *offsets)
+{
+	BufferTag	pending[LFC_MAX_PENDING_INVALIDATIONS];
+	int			n_pending;
+	int			n_removed = 0;
+	long		n_kept = 0;
+	bool		done = false;
+
+	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+
+	if (!LFC_ENABLED() || lfc_ctl->n_pending == 0)
+	{
+		LWLockRelease(lfc_lock);
+		return;
+	}
+
+	n_pending = lfc_ctl->n_pending;
+	memcpy(pending, lfc_ctl->pending, n_pending * sizeof(BufferTag));
+	lfc_ctl->n_pending = 0;
+
+	for (;;)
+	{
+		HASH_SEQ_STATUS status;
+		FileCacheEntry *entry;
+		int			n_scanned = 0;
+		int			n_batch_removed = 0;
+
+		hash_seq_init(&status, lfc_hash);
+
+		/* Skip the entries that earlier batches have kept */
+		for (long i = 0; i < n_kept; i++)
+		{
+			if (hash_seq_search(&status) == NULL)
+			{
+				done = true;
+				break;
+			}
+		}
+
+		while (!done)
+		{
+			entry = hash_seq_search(&status);
+			if (entry == NULL)
+			{
+				done = true;
+				break;
+			}
+
+			n_scanned++;
+
+			/* Skip holes and free chunks */
+			if (BufTagGetRelNumber(&entry->key) != InvalidRelFileNumber)
+			{
+				for (int i = 0; i < n_pending; i++)
+				{
+					if (entry->key.forkNum == pending[i].forkNum &&
+						entry->key.blockNum + BLOCKS_PER_CHUNK > pending[i].blockNum &&
+						RelFileInfoEquals(BufTagGetNRelFileInfo(entry->key),
+										  BufTagGetNRelFileInfo(pending[i])))
+					{
+						/*
+						 * It's OK to remove the current entry during the
+						 * scan, but we cannot enter the dummy entries for the
+						 * free chunks until it's finished.
+						 */
+						if (lfc_clear_chunk_pages(entry, pending[i].blockNum))
+							offsets[n_batch_removed++] = lfc_remove_chunk(entry);
+						break;
+					}
+				}
+			}
+
+			if (n_scanned >= LFC_INVALIDATE_BATCH)
+			{
+				hash_seq_term(&status);
+				break;
+			}
+		}
+		n_kept += n_scanned - n_batch_removed;
+
+		for (int i = 0; i < n_batch_removed; i++)
+			lfc_enter_unused_chunk(offsets[i], &lfc_ctl->free);
+		lfc_ctl->n_free += n_batch_removed;
+		lfc_ctl->invalidated += n_batch_removed;
+		n_removed += n_batch_removed;
+
+		LWLockRelease(lfc_lock);
+
+		if (done)
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+
+		LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+
+		/* The cache may have been disabled and its hash table reset */
+		if (!LFC_ENABLED())
+		{
+			LWLockRelease(lfc_lock);
+			break;
+		}
+	}
+
+	neon_log(DEBUG1, "LFC invalidator removed %d chunks of %d relation forks",
+			 n_removed, n_pending);
+}
+
+static void
+lfc_invalidator_shmem_exit(int code, Datum arg)
+{
+	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+	lfc_ctl->invalidator_latch = NULL;
+	LWLockRelease(lfc_lock);
+}
+
+/*
+ * Main function of the LFC invalidator background worker.
+ */
+void
+FileCacheInvalidatorMain(Datum main_arg)
+{
+	uint32	   *offsets;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+
+	BackgroundWorkerUnblockSignals();
+
+	offsets = palloc(sizeof(uint32) * (SIZE_MB_TO_CHUNKS(lfc_max_size) + 1));
 
-	if (entry->access_count == 0)
-	{
-		/*
-		 * If the chunk has no live entries, we can position the chunk to be
-		 * recycled first.
-		 */
-		if (entry->bitmap[chunk_offs >> 5] == 0)
-		{
-			bool		has_remaining_pages = false;
+	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+	lfc_ctl->invalidator_latch = MyLatch;
+	LWLockRelease(lfc_lock);
+	before_shmem_exit(lfc_invalidator_shmem_exit, (Datum) 0);
 
-			for (int i = 0; i < CHUNK_BITMAP_SIZE; i++)
-			{
-				if (entry->bitmap[i] != 0)
-				{
-					has_remaining_pages = true;
-					break;
-				}
-			}
+	for (;;)
+	{
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
 
-			/*
-			 * Put the entry at the position that is first to be reclaimed when we
-			 * have no cached pages remaining in the chunk
-			 */
-			if (!has_remaining_pages)
-			{
-				dlist_delete(&entry->list_node);
-				dlist_push_head(&lfc_ctl->lru, &entry->list_node);
-			}
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
 		}
-	}
 
-	/*
-	 * Done: apart from empty chunks, we don't move chunks in the LRU when
-	 * they're empty because eviction isn't usage.
-	 */
+		lfc_process_pending_invalidations(offsets);
 
-	LWLockRelease(lfc_lock);
+		/*
+		 * Let invalidations accumulate for a while, so that dropping many
+		 * relations doesn't cause a scan for each of them. lfc_invalidate()
+		 * sets the latch when the queue is full.
+		 */
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 LFC_INVALIDATOR_DELAY,
+						 WAIT_EVENT_NEON_LFC_MAINTENANCE);
+	}
 }
 
 /*
@@ -746,6 +1582,7 @@ lfc_readv_select(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 		{
 			/* Pages are not cached */
 			lfc_ctl->misses += blocks_in_chunk;
+			lfc_db_stats(NInfoGetDbOid(rinfo))->misses += blocks_in_chunk;
 			pgBufferUsage.file_cache.misses += blocks_in_chunk;
 			LWLockRelease(lfc_lock);
 
@@ -801,9 +1638,13 @@ lfc_readv_select(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 
 		if (lfc_ctl->generation == generation)
 		{
+			FileCacheDbStats *db = lfc_db_stats(NInfoGetDbOid(rinfo));
+
 			CriticalAssert(LFC_ENABLED());
 			lfc_ctl->hits += iteration_hits;
 			lfc_ctl->misses += iteration_misses;
+			db->hits += iteration_hits;
+			db->misses += iteration_misses;
 			pgBufferUsage.file_cache.hits += iteration_hits;
 			pgBufferUsage.file_cache.misses += iteration_misses;
 
@@ -835,6 +1676,121 @@ lfc_readv_select(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 	return blocks_read;
 }
 
+/*
+ * Find or allocate the entry for a chunk, for writing to it. The entry is
+ * pinned, by bumping its access count, so that it isn't evicted while the
+ * write is in progress. Returns NULL if there's no room for the chunk.
+ *
+ * Caller must hold lfc_lock in exclusive mode.
+ */
+static FileCacheEntry *
+lfc_enter_chunk(BufferTag *tag, uint32 hash, Oid dboid)
+{
+	FileCacheEntry *entry;
+	FileCacheEntry *victim;
+	bool		found;
+
+	entry = hash_search_with_hash_value(lfc_hash, tag, hash, HASH_ENTER, &found);
+
+	if (found)
+	{
+		/*
+		 * Unlink entry from LRU list to pin it for the duration of IO
+		 * operation
+		 */
+		if (entry->access_count++ == 0)
+			dlist_delete(&entry->list_node);
+	}
+	/*-----------
+	 * If the chunk wasn't already in the LFC then we have these
+	 * options, in order of preference:
+	 *
+	 * Unless there is no space available, we can:
+	 *  1. Use an entry from the `free` or `holes` list, and
+	 *  2. Create a new entry.
+	 * We can always, regardless of space in the LFC:
+	 *  3. evict an entry from LRU, subject to the per-database shares,
+	 *     and
+	 *  4. ignore the write operation (the least favorite option)
+	 */
+	else if (lfc_ctl->used < lfc_ctl->limit)
+	{
+		if (!dlist_is_empty(&lfc_ctl->free) || !dlist_is_empty(&lfc_ctl->holes))
+		{
+			/*
+			 * We can reuse an invalidated chunk, or a hole that was left
+			 * behind when the LFC was shrunk previously. Invalidated
+			 * chunks come first, because their disk space is still
+			 * allocated.
+			 */
+			bool		from_free = !dlist_is_empty(&lfc_ctl->free);
+			dlist_head *list = from_free ? &lfc_ctl->free : &lfc_ctl->holes;
+			FileCacheEntry *hole = dlist_container(FileCacheEntry, list_node,
+												   dlist_pop_head_node(list));
+			uint32 offset = hole->offset;
+			bool hole_found;
+
+			if (from_free)
+				lfc_ctl->n_free -= 1;
+
+			hash_search_with_hash_value(lfc_hash, &hole->key,
+										hole->hash, HASH_REMOVE, &hole_found);
+			CriticalAssert(hole_found);
+
+			lfc_ctl->used += 1;
+			entry->offset = offset;			/* reuse the hole */
+		}
+		else
+		{
+			lfc_ctl->used += 1;
+			entry->offset = lfc_ctl->size++;/* allocate new chunk at end
+											 * of file */
+		}
+	}
+	/*
+	 * We've already used up all allocated LFC entries.
+	 *
+	 * If we can clear an entry from the LRU, do that.
+	 * If we can't (e.g. because all other slots are being accessed, or
+	 * belong to databases below their share) then we will remove this
+	 * entry from the hash, and the caller skips the chunk, as we may not
+	 * exceed the limit.
+	 */
+	else if ((victim = lfc_choose_victim(dboid)) != NULL)
+	{
+		/* Cache overflow: evict least recently used chunk */
+		for (int i = 0; i < BLOCKS_PER_CHUNK; i++)
+		{
+			lfc_ctl->used_pages -= (victim->bitmap[i >> 5] >> (i & 31)) & 1;
+		}
+		lfc_db_release_chunk(victim);
+
+		CriticalAssert(victim->access_count == 0);
+		entry->offset = victim->offset; /* grab victim's chunk */
+		hash_search_with_hash_value(lfc_hash, &victim->key,
+									victim->hash, HASH_REMOVE, NULL);
+		neon_log(DEBUG2, "Swap file cache page");
+	}
+	else
+	{
+		/* Can't add this chunk - we don't have the space for it */
+		hash_search_with_hash_value(lfc_hash, &entry->key, hash,
+									HASH_REMOVE, NULL);
+		return NULL;
+	}
+
+	if (!found)
+	{
+		entry->access_count = 1;
+		entry->hash = hash;
+		memset(entry->bitmap, 0, sizeof entry->bitmap);
+		memset(entry->prewarming, 0, sizeof entry->prewarming);
+		lfc_db_stats(dboid)->used += 1;
+	}
+
+	return entry;
+}
+
 /*
  * Put page in local file cache.
  * If cache is full then evict some other page.
@@ -846,7 +1802,6 @@ lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 	BufferTag	tag;
 	FileCacheEntry *entry;
 	ssize_t		rc;
-	bool		found;
 	uint32		hash;
 	uint64		generation;
 	uint32		entry_offset;
@@ -897,83 +1852,9 @@ lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 			return;
 		}
 
-		entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_ENTER, &found);
-
-		if (found)
-		{
-			/*
-			 * Unlink entry from LRU list to pin it for the duration of IO
-			 * operation
-			 */
-			if (entry->access_count++ == 0)
-				dlist_delete(&entry->list_node);
-		}
-		/*-----------
-		 * If the chunk wasn't already in the LFC then we have these
-		 * options, in order of preference:
-		 *
-		 * Unless there is no space available, we can:
-		 *  1. Use an entry from the `holes` list, and
-		 *  2. Create a new entry.
-		 * We can always, regardless of space in the LFC:
-		 *  3. evict an entry from LRU, and
-		 *  4. ignore the write operation (the least favorite option)
-		 */
-		else if (lfc_ctl->used < lfc_ctl->limit)
-		{
-			if (!dlist_is_empty(&lfc_ctl->holes))
-			{
-				/* We can reuse a hole that was left behind when the LFC was shrunk previously */
-				FileCacheEntry *hole = dlist_container(FileCacheEntry, list_node,
-													   dlist_pop_head_node(&lfc_ctl->holes));
-				uint32 offset = hole->offset;
-				bool hole_found;
-
-				hash_search_with_hash_value(lfc_hash, &hole->key,
-											hole->hash, HASH_REMOVE, &hole_found);
-				CriticalAssert(hole_found);
-
-				lfc_ctl->used += 1;
-				entry->offset = offset;			/* reuse the hole */
-			}
-			else
-			{
-				lfc_ctl->used += 1;
-				entry->offset = lfc_ctl->size++;/* allocate new chunk at end
-												 * of file */
-			}
-		}
-		/*
-		 * We've already used up all allocated LFC entries.
-		 *
-		 * If we can clear an entry from the LRU, do that.
-		 * If we can't (e.g. because all other slots are being accessed)
-		 * then we will remove this entry from the hash and continue
-		 * on to the next chunk, as we may not exceed the limit.
-		 */
-		else if (!dlist_is_empty(&lfc_ctl->lru))
-		{
-			/* Cache overflow: evict least recently used chunk */
-			FileCacheEntry *victim = dlist_container(FileCacheEntry, list_node,
-													 dlist_pop_head_node(&lfc_ctl->lru));
-
-			for (int i = 0; i < BLOCKS_PER_CHUNK; i++)
-			{
-				lfc_ctl->used_pages -= (victim->bitmap[i >> 5] >> (i & 31)) & 1;
-			}
-
-			CriticalAssert(victim->access_count == 0);
-			entry->offset = victim->offset; /* grab victim's chunk */
-			hash_search_with_hash_value(lfc_hash, &victim->key,
-										victim->hash, HASH_REMOVE, NULL);
-			neon_log(DEBUG2, "Swap file cache page");
-		}
-		else
+		entry = lfc_enter_chunk(&tag, hash, NInfoGetDbOid(rinfo));
+		if (entry == NULL)
 		{
-			/* Can't add this chunk - we don't have the space for it */
-			hash_search_with_hash_value(lfc_hash, &entry->key, hash,
-										HASH_REMOVE, NULL);
-
 			/*
 			 * We can't process this chunk due to lack of space in LFC,
 			 * so skip to the next one
@@ -985,13 +1866,6 @@ lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 			continue;
 		}
 
-		if (!found)
-		{
-			entry->access_count = 1;
-			entry->hash = hash;
-			memset(entry->bitmap, 0, sizeof entry->bitmap);
-		}
-
 		generation = lfc_ctl->generation;
 		entry_offset = entry->offset;
 		LWLockRelease(lfc_lock);
@@ -1019,6 +1893,7 @@ lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 				CriticalAssert(entry->access_count > 0);
 
 				lfc_ctl->writes += blocks_in_chunk;
+				lfc_db_stats(NInfoGetDbOid(rinfo))->writes += blocks_in_chunk;
 				INSTR_TIME_SUBTRACT(io_start, io_end);
 				time_spent_us = INSTR_TIME_GET_MICROSEC(io_start);
 				lfc_ctl->time_write += time_spent_us;
@@ -1029,9 +1904,20 @@ lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 
 				for (int i = 0; i < blocks_in_chunk; i++)
 				{
+					uint32		bit = (uint32) 1 << ((chunk_offs + i) & 31);
+
+					/*
+					 * If lfc_prewarmv() is writing the page concurrently, we
+					 * can't tell which write landed last. Leave the page
+					 * uncached, and tell lfc_prewarmv() to do the same.
+					 */
+					if (entry->prewarming[(chunk_offs + i) >> 5] & bit)
+					{
+						entry->prewarming[(chunk_offs + i) >> 5] &= ~bit;
+						continue;
+					}
 					lfc_ctl->used_pages += 1 - ((entry->bitmap[(chunk_offs + i) >> 5] >> ((chunk_offs + i) & 31)) & 1);
-					entry->bitmap[(chunk_offs + i) >> 5] |=
-						((uint32)1 << ((chunk_offs + i) & 31));
+					entry->bitmap[(chunk_offs + i) >> 5] |= bit;
 				}
 			}
 
@@ -1043,6 +1929,199 @@ lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 	}
 }
 
+/*
+ * Put pages fetched for a prewarm in the local file cache.
+ *
+ * Unlike lfc_writev(), this only fills in pages that aren't cached yet, and
+ * skips pages that may have been modified after they were requested, i.e.
+ * whose last-written LSN is newer than lsns[i], or whose lsns[i] is invalid.
+ *
+ * Like in lfc_writev(), the chunk is pinned and the lock is released for
+ * the write. A backend that evicts a modified page advances its last-written
+ * LSN before writing it to the LFC, so it could write the newer version
+ * while we write the older one. To deal with that, the pages we write are
+ * marked in the chunk's 'prewarming' bitmap, and after the write, a page is
+ * only marked as cached if it's still marked there and its last-written LSN
+ * hasn't advanced. lfc_writev() clears the mark, and leaves the page
+ * uncached, if it writes a marked page. If the LSN has advanced but the mark
+ * is still there, a writer may still be on its way, so the mark is left in
+ * place for it to find. In the worst case, that makes a later write of the
+ * page skip caching it.
+ *
+ * Returns the number of pages written.
+ */
+int
+lfc_prewarmv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
+			 const void *const *buffers, BlockNumber nblocks,
+			 const XLogRecPtr *lsns)
+{
+	BufferTag	tag;
+	FileCacheEntry *entry;
+	int			buf_offset = 0;
+	int			blocks_written = 0;
+
+	if (lfc_maybe_disabled())	/* fast exit if file cache is disabled */
+		return 0;
+
+	if (!lfc_ensure_opened())
+		return 0;
+
+	CopyNRelFileInfoToBufTag(tag, rinfo);
+	tag.forkNum = forkNum;
+
+	CriticalAssert(BufTagGetRelNumber(&tag) != InvalidRelFileNumber);
+
+	while (nblocks > 0)
+	{
+		int			chunk_offs = blkno & (BLOCKS_PER_CHUNK - 1);
+		int			blocks_in_chunk = Min(nblocks, BLOCKS_PER_CHUNK - (blkno % BLOCKS_PER_CHUNK));
+		bits8		write[BLOCKS_PER_CHUNK / 8];
+		int			n_write = 0;
+		uint32		hash;
+		uint64		generation;
+		uint32		entry_offset;
+		instr_time	io_start,
+					io_end;
+
+		Assert(blocks_in_chunk > 0);
+
+		tag.blockNum = blkno & ~(BLOCKS_PER_CHUNK - 1);
+		hash = get_hash_value(lfc_hash, &tag);
+
+		LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+
+		if (!LFC_ENABLED())
+		{
+			LWLockRelease(lfc_lock);
+			return blocks_written;
+		}
+
+		/* Which pages of the chunk are missing and unmodified? */
+		entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, NULL);
+		memset(write, 0, sizeof(write));
+		for (int i = 0; i < blocks_in_chunk; i++)
+		{
+			int			this_chunk_offs = chunk_offs + i;
+			uint32		bit = (uint32) 1 << (this_chunk_offs & 31);
+
+			if (entry != NULL &&
+				((entry->bitmap[this_chunk_offs >> 5] | entry->prewarming[this_chunk_offs >> 5]) & bit) != 0)
+				continue;
+			if (lsns[buf_offset + i] == InvalidXLogRecPtr ||
+				GetLastWrittenLSN(rinfo, forkNum, blkno + i) > lsns[buf_offset + i])
+				continue;
+			BITMAP_SET(write, i);
+			n_write++;
+		}
+
+		if (n_write > 0)
+			entry = lfc_enter_chunk(&tag, hash, NInfoGetDbOid(rinfo));
+
+		if (n_write == 0 || entry == NULL)
+		{
+			LWLockRelease(lfc_lock);
+			blkno += blocks_in_chunk;
+			buf_offset += blocks_in_chunk;
+			nblocks -= blocks_in_chunk;
+			continue;
+		}
+
+		for (int i = 0; i < blocks_in_chunk; i++)
+		{
+			if (BITMAP_ISSET(write, i))
+				entry->prewarming[(chunk_offs + i) >> 5] |=
+					((uint32) 1 << ((chunk_offs + i) & 31));
+		}
+
+		generation = lfc_ctl->generation;
+		entry_offset = entry->offset;
+		LWLockRelease(lfc_lock);
+
+		/* Write each run of consecutive pages with one pwritev() */
+		pgstat_report_wait_start(WAIT_EVENT_NEON_LFC_WRITE);
+		INSTR_TIME_SET_CURRENT(io_start);
+		for (int i = 0; i < blocks_in_chunk;)
+		{
+			struct iovec iov[PG_IOV_MAX];
+			int			run = 0;
+			ssize_t		rc;
+
+			if (!BITMAP_ISSET(write, i))
+			{
+				i++;
+				continue;
+			}
+			while (i + run < blocks_in_chunk && run < PG_IOV_MAX &&
+				   BITMAP_ISSET(write, i + run))
+			{
+				iov[run].iov_base = unconstify(void *, buffers[buf_offset + i + run]);
+				iov[run].iov_len = BLCKSZ;
+				run++;
+			}
+
+			rc = pwritev(lfc_desc, iov, run,
+						 ((off_t) entry_offset * BLOCKS_PER_CHUNK + chunk_offs + i) * BLCKSZ);
+			if (rc != BLCKSZ * run)
+			{
+				pgstat_report_wait_end();
+				lfc_disable("write");
+				return blocks_written;
+			}
+			i += run;
+		}
+		INSTR_TIME_SET_CURRENT(io_end);
+		pgstat_report_wait_end();
+
+		LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+
+		if (lfc_ctl->generation == generation)
+		{
+			uint64		time_spent_us;
+
+			CriticalAssert(LFC_ENABLED());
+
+			lfc_ctl->writes += n_write;
+			lfc_db_stats(NInfoGetDbOid(rinfo))->writes += n_write;
+			INSTR_TIME_SUBTRACT(io_end, io_start);
+			time_spent_us = INSTR_TIME_GET_MICROSEC(io_end);
+			lfc_ctl->time_write += time_spent_us;
+			inc_page_cache_write_wait(time_spent_us);
+
+			for (int i = 0; i < blocks_in_chunk; i++)
+			{
+				int			this_chunk_offs = chunk_offs + i;
+				uint32		bit = (uint32) 1 << (this_chunk_offs & 31);
+
+				if (!BITMAP_ISSET(write, i) ||
+					(entry->prewarming[this_chunk_offs >> 5] & bit) == 0)
+					continue;
+
+				/* Leave the mark in place if the page was modified meanwhile */
+				if (GetLastWrittenLSN(rinfo, forkNum, blkno + i) > lsns[buf_offset + i])
+					continue;
+
+				entry->prewarming[this_chunk_offs >> 5] &= ~bit;
+				entry->bitmap[this_chunk_offs >> 5] |= bit;
+				lfc_ctl->used_pages += 1;
+				blocks_written++;
+			}
+
+			/* Place entry to the head of LRU list */
+			CriticalAssert(entry->access_count > 0);
+			if (--entry->access_count == 0)
+				dlist_push_tail(&lfc_ctl->lru, &entry->list_node);
+		}
+
+		LWLockRelease(lfc_lock);
+
+		blkno += blocks_in_chunk;
+		buf_offset += blocks_in_chunk;
+		nblocks -= blocks_in_chunk;
+	}
+
+	return blocks_written;
+}
+
 typedef struct
 {
 	TupleDesc	tupdesc;
@@ -1127,6 +2206,16 @@ neon_get_lfc_stats(PG_FUNCTION_ARGS)
 			if (lfc_ctl)
 				value = lfc_ctl->used_pages;
 			break;
+		case 6:
+			key = "file_cache_free_chunks";
+			if (lfc_ctl)
+				value = lfc_ctl->n_free;
+			break;
+		case 7:
+			key = "file_cache_invalidated";
+			if (lfc_ctl)
+				value = lfc_ctl->invalidated;
+			break;
 		default:
 			SRF_RETURN_DONE(funcctx);
 	}
@@ -1146,6 +2235,52 @@ neon_get_lfc_stats(PG_FUNCTION_ARGS)
 }
 
 
+#define NUM_NEON_GET_LFC_DB_STATS_COLS	5
+
+/*
+ * Per-database LFC usage and hit statistics. The row for databases that
+ * didn't get their own statistics slot has a NULL dboid.
+ */
+PG_FUNCTION_INFO_V1(neon_get_lfc_db_stats);
+Datum
+neon_get_lfc_db_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	FileCacheDbStats dbs[LFC_MAX_DATABASES + 1];
+	Datum		values[NUM_NEON_GET_LFC_DB_STATS_COLS];
+	bool		nulls[NUM_NEON_GET_LFC_DB_STATS_COLS];
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (lfc_ctl == NULL)
+		return (Datum) 0;
+
+	LWLockAcquire(lfc_lock, LW_SHARED);
+	memcpy(dbs, lfc_ctl->dbs, sizeof(dbs));
+	LWLockRelease(lfc_lock);
+
+	for (int i = 0; i <= LFC_MAX_DATABASES; i++)
+	{
+		if (i < LFC_MAX_DATABASES && !dbs[i].in_use)
+			continue;
+		if (i == LFC_MAX_DATABASES && dbs[i].used == 0 && dbs[i].hits == 0 &&
+			dbs[i].misses == 0 && dbs[i].writes == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(dbs[i].dboid);
+		nulls[0] = (i == LFC_MAX_DATABASES);
+		values[1] = Int64GetDatum((int64) dbs[i].used);
+		values[2] = Int64GetDatum((int64) dbs[i].hits);
+		values[3] = Int64GetDatum((int64) dbs[i].misses);
+		values[4] = Int64GetDatum((int64) dbs[i].writes);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
 /*
  * Function returning data from the local file cache
  * relation node/tablespace/database/blocknum and access_counter
@@ -1364,3 +2499,43 @@ approximate_working_set_size(PG_FUNCTION_ARGS)
 	}
 	PG_RETURN_NULL();
 }
+
+/*
+ * Load a relation fork into the LFC, bypassing shared buffers, to prepare
+ * the compute for a workload. Several relations can be loaded at the same
+ * time from different sessions. Returns the number of pages loaded; the
+ * progress can be followed in the file_cache_prewarm_* counters of the
+ * backend in neon_backend_perf_counters.
+ */
+PG_FUNCTION_INFO_V1(neon_prewarm_lfc);
+Datum
+neon_prewarm_lfc(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	ForkNumber	forknum = forkname_to_number(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+	Relation	rel;
+	AclResult	aclresult;
+	BlockNumber loaded = 0;
+
+	rel = relation_open(relid, AccessShareLock);
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+					   get_rel_name(relid));
+
+	if (!RELKIND_HAS_STORAGE(rel->rd_rel->relkind))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("relation \"%s\" does not have storage",
+						RelationGetRelationName(rel))));
+
+	/* Temporary and unlogged relations are not stored in the pageserver */
+	if (rel->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT &&
+		smgrexists(RelationGetSmgr(rel), forknum))
+		loaded = neon_prewarm_fork(RelationGetSmgr(rel), forknum);
+
+	relation_close(rel, AccessShareLock);
+
+	PG_RETURN_INT64((int64) loaded);
+}
@@ -14,6 +14,7 @@
  */
 #include "postgres.h"
 
+#include "access/xact.h"
 #include "access/xlog.h"
 #include "common/hashfn.h"
 #include "fmgr.h"
@@ -31,6 +32,7 @@
 #include "utils/guc.h"
 
 #include "neon.h"
+#include "neon_flight_recorder.h"
 #include "neon_perf_counters.h"
 #include "neon_utils.h"
 #include "pagestore_client.h"
@@ -55,10 +57,17 @@ char	   *neon_auth_token;
 
 int			readahead_buffer_size = 128;
 int			flush_every_n_requests = 8;
+int			abandoned_request_timeout = 10000;
+int			prefetch_buffer_budget = 0;
+bool		unlogged_build_populate_lfc = true;
+bool		replica_lfc_redo = false;
+bool		local_fsm = false;
+int			local_fsm_sync_distance = 64;
 
 int         neon_protocol_version = 2;
 
 static int	max_reconnect_attempts = 60;
+static int	pageserver_idle_check_interval = 10;
 static int	stripe_size;
 
 typedef struct
@@ -85,12 +94,21 @@ typedef struct
  * has changed since last access, and to detect and retry copying the value if
  * the postmaster changes the value concurrently. (Postmaster doesn't have a
  * PGPROC entry and therefore cannot use LWLocks.)
+ *
+ * In addition to the counters covering the whole map, each shard has a
+ * generation number that is bumped only when that shard's connection string
+ * changes (or the shard is added or removed). When the map changes, a backend
+ * compares the generations with the ones it saw last, and only reconnects to
+ * the shards whose connection string actually changed. For example, when a
+ * tenant is split into more shards, connections to the shards that stay on
+ * the same pageserver are kept.
  */
 typedef struct
 {
 	pg_atomic_uint64 begin_update_counter;
 	pg_atomic_uint64 end_update_counter;
 	ShardMap	shard_map;
+	uint64		shard_generation[MAX_SHARDS];
 } PagestoreShmemState;
 
 #if PG_VERSION_NUM >= 150000
@@ -99,6 +117,8 @@ static shmem_request_hook_type prev_shmem_request_hook = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook;
 static PagestoreShmemState *pagestore_shared;
 static uint64 pagestore_local_counter = 0;
+static uint64 pagestore_local_shard_generation[MAX_SHARDS];
+static shardno_t pagestore_local_num_shards = 0;
 
 typedef enum PSConnectionState {
 	PS_Disconnected,			/* no connection yet */
@@ -129,6 +149,9 @@ typedef struct
 	uint64			nrequests_sent;
 	uint64			nresponses_received;
 
+	/* start of the last statement that used the connection */
+	TimestampTz		last_used_stmt_start;
+
 	/*---
 	 * WaitEventSet containing:
 	 *	- WL_SOCKET_READABLE on 'conn'
@@ -236,8 +259,19 @@ AssignPageserverConnstring(const char *newval, void *extra)
 
 	if (memcmp(&pagestore_shared->shard_map, &shard_map, sizeof(ShardMap)) != 0)
 	{
+		ShardMap   *old_map = &pagestore_shared->shard_map;
+
 		pg_atomic_add_fetch_u64(&pagestore_shared->begin_update_counter, 1);
 		pg_write_barrier();
+		for (shardno_t i = 0; i < MAX_SHARDS; i++)
+		{
+			bool		old_exists = i < old_map->num_shards;
+			bool		new_exists = i < shard_map.num_shards;
+
+			if (old_exists != new_exists ||
+				(new_exists && strcmp(old_map->connstring[i], shard_map.connstring[i]) != 0))
+				pagestore_shared->shard_generation[i]++;
+		}
 		memcpy(&pagestore_shared->shard_map, &shard_map, sizeof(ShardMap));
 		pg_write_barrier();
 		pg_atomic_add_fetch_u64(&pagestore_shared->end_update_counter, 1);
@@ -259,7 +293,8 @@ AssignPageserverConnstring(const char *newval, void *extra)
  * long.
  *
  * As a side-effect, if the shard map in shared memory had changed since the
- * last call, terminates all existing connections to all pageservers.
+ * last call, terminates the existing connections to the pageservers whose
+ * connection string changed. Connections to other shards are kept.
  */
 static void
 load_shard_map(shardno_t shard_no, char *connstr_p, shardno_t *num_shards_p)
@@ -268,6 +303,8 @@ load_shard_map(shardno_t shard_no, char *connstr_p, shardno_t *num_shards_p)
 	uint64		end_update_counter;
 	ShardMap   *shard_map = &pagestore_shared->shard_map;
 	shardno_t	num_shards;
+	uint64		shard_generation[MAX_SHARDS];
+	bool		map_changed;
 
 	/*
 	 * Postmaster can update the shared memory values concurrently, in which
@@ -284,6 +321,11 @@ load_shard_map(shardno_t shard_no, char *connstr_p, shardno_t *num_shards_p)
 		num_shards = shard_map->num_shards;
 		if (connstr_p && shard_no < MAX_SHARDS)
 			strlcpy(connstr_p, shard_map->connstring[shard_no], MAX_PAGESERVER_CONNSTRING_SIZE);
+
+		/* The generations are only needed if something changed */
+		map_changed = pagestore_local_counter != end_update_counter;
+		if (map_changed)
+			memcpy(shard_generation, pagestore_shared->shard_generation, sizeof(shard_generation));
 		pg_memory_barrier();
 	}
 	while (begin_update_counter != end_update_counter
@@ -295,16 +337,51 @@ load_shard_map(shardno_t shard_no, char *connstr_p, shardno_t *num_shards_p)
 				 shard_no, num_shards);
 
 	/*
-	 * If any of the connection strings changed, reset all connections.
+	 * If any of the connection strings changed, reset the connections to
+	 * those shards.
 	 */
-	if (pagestore_local_counter != end_update_counter)
+	if (map_changed)
 	{
+		/*
+		 * On a shard split, requests that are in flight were routed with the
+		 * old number of shards, and the shard that received one might not
+		 * own the page anymore. Connections that are idle can be kept.
+		 */
+		bool		resharded = num_shards != pagestore_local_num_shards;
+
 		for (shardno_t i = 0; i < MAX_SHARDS; i++)
 		{
-			if (page_servers[i].conn)
+			PageServer *shard = &page_servers[i];
+			bool		in_flight;
+
+			if (shard->conn == NULL)
+			{
+				pagestore_local_shard_generation[i] = shard_generation[i];
+				continue;
+			}
+
+			in_flight = shard->nrequests_sent != shard->nresponses_received;
+
+			/*
+			 * If there are requests in flight on the connection, we have to
+			 * throw away the prefetch queue, like on any other disconnect.
+			 * Otherwise the other shards' connections and prefetched pages
+			 * can be kept.
+			 */
+			if (shard_generation[i] != pagestore_local_shard_generation[i])
+			{
+				if (in_flight)
+					pageserver_disconnect(i);
+				else
+					pageserver_disconnect_shard(i);
+			}
+			else if (resharded && in_flight)
 				pageserver_disconnect(i);
+
+			pagestore_local_shard_generation[i] = shard_generation[i];
 		}
 		pagestore_local_counter = end_update_counter;
+		pagestore_local_num_shards = num_shards;
 	}
 
 	if (num_shards_p)
@@ -342,7 +419,7 @@ CLEANUP_AND_DISCONNECT(PageServer *shard)
 	}
 	if (shard->conn)
 	{
-		MyNeonCounters->pageserver_disconnects_total++;
+		NEON_PERF_COUNTER_INC(pageserver_disconnects_total);
 		PQfinish(shard->conn);
 		shard->conn = NULL;
 	}
@@ -350,6 +427,33 @@ CLEANUP_AND_DISCONNECT(PageServer *shard)
 	shard->state = PS_Disconnected;
 }
 
+/*
+ * Does the connection string set the given option?
+ */
+static bool
+connstr_has_option(const char *connstr, const char *keyword)
+{
+	PQconninfoOption *options;
+	bool		result = false;
+
+	/* a malformed connection string is reported when connecting */
+	options = PQconninfoParse(connstr, NULL);
+	if (options == NULL)
+		return false;
+
+	for (PQconninfoOption *option = options; option->keyword != NULL; option++)
+	{
+		if (strcmp(option->keyword, keyword) == 0)
+		{
+			result = option->val != NULL;
+			break;
+		}
+	}
+	PQconninfoFree(options);
+
+	return result;
+}
+
 /*
  * Connect to a pageserver, or continue to try to connect if we're yet to
  * complete the connection (e.g. due to receiving an earlier cancellation
@@ -378,8 +482,9 @@ pageserver_connect(shardno_t shard_no, int elevel)
 	{
 	case PS_Disconnected:
 	{
-		const char *keywords[3];
-		const char *values[3];
+		const char *keywords[4];
+		const char *values[4];
+		char		keepalives_idle[16];
 		int			n_pgsql_params;
 		TimestampTz	now;
 		int64		us_since_last_attempt;
@@ -419,10 +524,15 @@ pageserver_connect(shardno_t shard_no, int elevel)
 		 * neon.pageserver_connstring GUC. If the NEON_AUTH_TOKEN environment
 		 * variable was set, use that as the password.
 		 *
-		 * The connection options are parsed in the order they're given, so when
-		 * we set the password before the connection string, the connection string
-		 * can override the password from the env variable. Seems useful, although
-		 * we don't currently use that capability anywhere.
+		 * The connection options are parsed in the order they're given, and
+		 * the connection string is expanded in place of 'dbname'. It must come
+		 * first, so that the password from the env variable overrides any
+		 * password in the connection string.
+		 *
+		 * TCP keepalives are enabled for idle connections, so that the kernel
+		 * notices dead pageservers while the backend is idle, see
+		 * pageserver_check_idle_connection(). That is only added if the
+		 * connection string doesn't set keepalives_idle itself.
 		 */
 		keywords[0] = "dbname";
 		values[0] = connstr;
@@ -430,8 +540,18 @@ pageserver_connect(shardno_t shard_no, int elevel)
 
 		if (neon_auth_token)
 		{
-			keywords[1] = "password";
-			values[1] = neon_auth_token;
+			keywords[n_pgsql_params] = "password";
+			values[n_pgsql_params] = neon_auth_token;
+			n_pgsql_params++;
+		}
+
+		if (pageserver_idle_check_interval > 0 &&
+			!connstr_has_option(connstr, "keepalives_idle"))
+		{
+			snprintf(keepalives_idle, sizeof(keepalives_idle), "%d",
+					 pageserver_idle_check_interval);
+			keywords[n_pgsql_params] = "keepalives_idle";
+			values[n_pgsql_params] = keepalives_idle;
 			n_pgsql_params++;
 		}
 
@@ -644,6 +764,7 @@ pageserver_connect(shardno_t shard_no, int elevel)
 		shard->state = PS_Connected;
 		shard->nrequests_sent = 0;
 		shard->nresponses_received = 0;
+		shard->last_used_stmt_start = GetCurrentStatementStartTimestamp();
 	}
 	/* FALLTHROUGH */
 	case PS_Connected:
@@ -828,6 +949,55 @@ pageserver_disconnect_shard(shardno_t shard_no)
 	shard->state = PS_Disconnected;
 }
 
+/*
+ * Check that a connection that has been idle is still alive, before we send
+ * a request on it.
+ *
+ * A pageserver restart or a tenant migration breaks the connections of idle
+ * backends, but we only notice when a request fails, in the middle of the
+ * next query. To avoid that, the first time a connection is used in a
+ * statement after it has been idle for neon.pageserver_idle_check_interval,
+ * we pick up anything the pageserver has sent without waiting. The
+ * pageserver never sends anything unprompted, so this only finds the end of
+ * the connection, or a TCP keepalive failure. In that case we reconnect
+ * right away, before the request is sent.
+ *
+ * Using the statement start time means this costs no clock reads on the
+ * request path, and only one check per statement.
+ */
+static void
+pageserver_check_idle_connection(shardno_t shard_no)
+{
+	PageServer *shard = &page_servers[shard_no];
+	TimestampTz stmt_start = GetCurrentStatementStartTimestamp();
+	bool		idle;
+
+	if (shard->last_used_stmt_start == stmt_start)
+		return;
+
+	idle = pageserver_idle_check_interval > 0 &&
+		TimestampDifferenceExceeds(shard->last_used_stmt_start, stmt_start,
+								   pageserver_idle_check_interval * 1000);
+	shard->last_used_stmt_start = stmt_start;
+
+	if (!idle)
+		return;
+
+	if (PQconsumeInput(shard->conn) == 0 || PQstatus(shard->conn) == CONNECTION_BAD)
+	{
+		char	   *msg = pchomp(PQerrorMessage(shard->conn));
+
+		neon_shard_log(shard_no, LOG, "idle pageserver connection was lost, reconnecting: %s", msg);
+		pfree(msg);
+
+		/* only throw away prefetches if some were sent on this connection */
+		if (shard->nrequests_sent != shard->nresponses_received)
+			pageserver_disconnect(shard_no);
+		else
+			pageserver_disconnect_shard(shard_no);
+	}
+}
+
 static bool
 pageserver_send(shardno_t shard_no, NeonRequest *request)
 {
@@ -835,7 +1005,10 @@ pageserver_send(shardno_t shard_no, NeonRequest *request)
 	PageServer *shard = &page_servers[shard_no];
 	PGconn	   *pageserver_conn;
 
-	MyNeonCounters->pageserver_requests_sent_total++;
+	NEON_PERF_COUNTER_INC(pageserver_requests_sent_total);
+
+	if (shard->state == PS_Connected)
+		pageserver_check_idle_connection(shard_no);
 
 	/* If the connection was lost for some reason, reconnect */
 	if (shard->state == PS_Connected && PQstatus(shard->conn) == CONNECTION_BAD)
@@ -932,6 +1105,8 @@ pageserver_receive(shardno_t shard_no)
 		/* call_PQgetCopyData handles rc == 0 */
 		Assert(rc > 0);
 
+		NEON_PERF_COUNTER_ADD(pageserver_received_bytes_total, rc);
+
 		PG_TRY();
 		{
 			resp_buff.len = rc;
@@ -999,6 +1174,8 @@ pageserver_try_receive(shardno_t shard_no)
 		return NULL;
 	else if (rc > 0)
 	{
+		NEON_PERF_COUNTER_ADD(pageserver_received_bytes_total, rc);
+
 		PG_TRY();
 		{
 			resp_buff.len = rc;
@@ -1057,7 +1234,7 @@ pageserver_flush(shardno_t shard_no)
 	}
 	else
 	{
-		MyNeonCounters->pageserver_send_flushes_total++;
+		NEON_PERF_COUNTER_INC(pageserver_send_flushes_total);
 		if (PQflush(pageserver_conn))
 		{
 			char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
@@ -1092,7 +1269,13 @@ check_neon_id(char **newval, void **extra, GucSource source)
 static Size
 PagestoreShmemSize(void)
 {
-	return add_size(sizeof(PagestoreShmemState), NeonPerfCountersShmemSize());
+	Size		size = sizeof(PagestoreShmemState);
+
+	size = add_size(size, NeonPerfCountersShmemSize());
+	size = add_size(size, NeonFlightRecorderShmemSize());
+	size = add_size(size, PrefetchShmemSize());
+
+	return size;
 }
 
 static bool
@@ -1109,10 +1292,14 @@ PagestoreShmemInit(void)
 		pg_atomic_init_u64(&pagestore_shared->begin_update_counter, 0);
 		pg_atomic_init_u64(&pagestore_shared->end_update_counter, 0);
 		memset(&pagestore_shared->shard_map, 0, sizeof(ShardMap));
+		memset(pagestore_shared->shard_generation, 0, sizeof(pagestore_shared->shard_generation));
 		AssignPageserverConnstring(page_server_connstring, NULL);
 	}
 
 	NeonPerfCountersShmemInit();
+	NeonFlightRecorderShmemInit();
+	PrefetchShmemInit();
+	LocalFsmShmemInit();
 
 	LWLockRelease(AddinShmemInitLock);
 	return found;
@@ -1136,6 +1323,8 @@ pagestore_shmem_request(void)
 #endif
 
 	RequestAddinShmemSpace(PagestoreShmemSize());
+	NeonPerfCountersShmemRequest();
+	LocalFsmShmemRequest();
 }
 
 static void
@@ -1219,6 +1408,15 @@ pg_init_libpagestore(void)
 							PGC_USERSET,
 							0,
 							NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.pageserver_idle_check_interval",
+							"Check pageserver connections that have been idle for this long before using them",
+							"Also used as the TCP keepalive idle time of the "
+							"connections. 0 disables the checks.",
+							&pageserver_idle_check_interval,
+							10, 0, 3600,
+							PGC_USERSET,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
 	DefineCustomIntVariable("neon.readahead_buffer_size",
 							"number of prefetches to buffer",
 							"This buffer is used to hold and manage prefetched "
@@ -1232,6 +1430,72 @@ pg_init_libpagestore(void)
 							PGC_USERSET,
 							0,	/* no flags required */
 							NULL, (GucIntAssignHook) &readahead_buffer_resize, NULL);
+	DefineCustomIntVariable("neon.prefetch_buffer_budget",
+							"Memory available for buffered prefetch responses, across all backends",
+							"When the budget is exhausted, backends stop issuing "
+							"prefetch requests until earlier responses have been "
+							"used, even if neon.readahead_buffer_size allows more. "
+							"Synchronous reads are not limited. 0 means no limit.",
+							&prefetch_buffer_budget,
+							0, 0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.abandoned_request_timeout",
+							"Time to wait for the responses of cancelled pageserver requests before reconnecting",
+							"When a query is cancelled while waiting for the "
+							"pageserver, the connection is kept, and the response "
+							"is discarded when it arrives. If it doesn't arrive "
+							"within this time, the connection is reset. 0 resets "
+							"the connection right away.",
+							&abandoned_request_timeout,
+							10000, 0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("neon.unlogged_build_populate_lfc",
+							 "Copy the pages of a newly built index to the local file cache",
+							 "At the end of an unlogged index build, the pages of the "
+							 "local copy of the index are written to the local file "
+							 "cache before the copy is removed, so that they don't "
+							 "have to be fetched back from the pageserver.",
+							 &unlogged_build_populate_lfc,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("neon.replica_lfc_redo",
+							 "Apply WAL to pages in the local file cache on a replica",
+							 "By default, WAL replay evicts the pages it modifies "
+							 "from the local file cache unless they're in shared "
+							 "buffers. With this setting, common heap and B-tree "
+							 "records are applied to the cached copy instead.",
+							 &replica_lfc_redo,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("neon.local_fsm",
+							 "Keep the free space map of relations in local files",
+							 "The local copy of the free space map is authoritative "
+							 "on the primary, and FSM pages are read from it instead "
+							 "of the pageserver. The pageserver's copy is only "
+							 "refreshed every neon.local_fsm_sync_distance of WAL.",
+							 &local_fsm,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.local_fsm_sync_distance",
+							"Amount of WAL after which a locally maintained FSM page is WAL-logged again",
+							NULL,
+							&local_fsm_sync_distance,
+							64, 0, INT_MAX / 2,
+							PGC_SIGHUP,
+							GUC_UNIT_MB,
+							NULL, NULL, NULL);
 	DefineCustomIntVariable("neon.protocol_version",
 							"Version of compute<->page server protocol",
 							NULL,
@@ -1243,6 +1507,15 @@ pg_init_libpagestore(void)
 							0,	/* no flags required */
 							NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("neon.flight_recorder",
+							 "Record recent pageserver requests of each backend",
+							 "The records can be inspected with the neon_flight_recorder view.",
+							 &flight_recorder_enabled,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+
 	relsize_hash_init();
 
 	if (page_server != NULL)
@@ -0,0 +1,8 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.11'" to load this file. \quit
+
+-- Load a relation fork into the local file cache, without going through
+-- shared buffers. Returns the number of pages loaded.
+CREATE FUNCTION neon_prewarm_lfc(rel regclass, fork text DEFAULT 'main')
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'neon_prewarm_lfc'
+LANGUAGE C STRICT PARALLEL SAFE;
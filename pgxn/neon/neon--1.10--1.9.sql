@@ -0,0 +1,2 @@
+DROP VIEW IF EXISTS neon_perf_counter_percentiles;
+DROP FUNCTION IF EXISTS neon_get_perf_counter_percentiles();
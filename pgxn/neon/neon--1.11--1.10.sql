@@ -0,0 +1 @@
+DROP FUNCTION IF EXISTS neon_prewarm_lfc(regclass, text);
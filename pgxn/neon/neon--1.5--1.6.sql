@@ -0,0 +1,39 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.6'" to load this file. \quit
+
+CREATE FUNCTION get_flight_recorder()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_flight_recorder'
+LANGUAGE C PARALLEL SAFE;
+
+-- The most recent pageserver requests of each backend, and the reads that
+-- were satisfied from the local file cache. 'source' is one of 'sync',
+-- 'prefetch' or 'lfc'; 'consumed' tells whether a GetPage response was used
+-- by a read. For GetSlruSegment requests, 'forknum' holds the SLRU kind and
+-- 'blocknum' the segment number. An 'lfc' row covers all the blocks of one
+-- read that were found in the LFC: 'nblocks' of them, starting at 'blocknum'.
+-- 'receive_time' is NULL while the response is outstanding.
+CREATE VIEW neon_flight_recorder AS
+  SELECT F.procno, F.pid, F.id, F.request, F.source, F.consumed, F.shard,
+         F.spcoid, F.dboid, F.relnumber, F.forknum, F.blocknum, F.nblocks,
+         F.request_lsn, F.not_modified_since,
+         F.send_time, F.receive_time, F.wait_seconds
+  FROM get_flight_recorder() AS F (
+    procno integer,
+    pid integer,
+    id bigint,
+    request text,
+    source text,
+    consumed boolean,
+    shard integer,
+    spcoid oid,
+    dboid oid,
+    relnumber oid,
+    forknum integer,
+    blocknum bigint,
+    nblocks integer,
+    request_lsn pg_lsn,
+    not_modified_since pg_lsn,
+    send_time timestamptz,
+    receive_time timestamptz,
+    wait_seconds float8
+  );
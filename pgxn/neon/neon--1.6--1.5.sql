@@ -0,0 +1,2 @@
+DROP VIEW IF EXISTS neon_flight_recorder;
+DROP FUNCTION IF EXISTS get_flight_recorder();
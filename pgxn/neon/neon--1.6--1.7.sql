@@ -0,0 +1,38 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.7'" to load this file. \quit
+
+CREATE FUNCTION get_query_io()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_query_io'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE FUNCTION reset_query_io()
+RETURNS void
+AS 'MODULE_PATHNAME', 'neon_reset_query_io'
+LANGUAGE C PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION reset_query_io() FROM PUBLIC;
+
+-- Pageserver and LFC I/O per query. Join with pg_stat_statements on
+-- (userid, dbid, queryid) to find the queries that spend the most time
+-- waiting for the pageserver. The counts include the I/O of nested
+-- statements and of parallel workers. Like in pg_stat_statements, users
+-- without pg_read_all_stats only see their own queries.
+CREATE VIEW neon_stat_statements_io AS
+  SELECT Q.userid, Q.dbid, Q.queryid,
+         Q.pageserver_requests, Q.pageserver_received_bytes,
+         Q.getpage_sync_requests, Q.getpage_prefetch_requests,
+         Q.getpage_prefetch_misses, Q.getpage_prefetch_discards,
+         Q.getpage_wait_seconds, Q.file_cache_hits
+  FROM get_query_io() AS Q (
+    userid oid,
+    dbid oid,
+    queryid bigint,
+    pageserver_requests bigint,
+    pageserver_received_bytes bigint,
+    getpage_sync_requests bigint,
+    getpage_prefetch_requests bigint,
+    getpage_prefetch_misses bigint,
+    getpage_prefetch_discards bigint,
+    getpage_wait_seconds float8,
+    file_cache_hits bigint
+  );
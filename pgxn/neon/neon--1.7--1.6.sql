@@ -0,0 +1,3 @@
+DROP VIEW IF EXISTS neon_stat_statements_io;
+DROP FUNCTION IF EXISTS reset_query_io();
+DROP FUNCTION IF EXISTS get_query_io();
@@ -0,0 +1,29 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.8'" to load this file. \quit
+
+CREATE FUNCTION get_relation_perf_counters()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_relation_perf_counters'
+LANGUAGE C PARALLEL SAFE;
+
+-- GetPage wait histograms of the relations with the most GetPage requests,
+-- across all backends. Waits for the remaining relations are summed up in the
+-- overflow row, which has NULL relation columns. 'relation' is only filled in
+-- for relations in the current database.
+--
+-- For histograms, 'bucket_le' is the upper bound of the histogram bucket.
+CREATE VIEW neon_relation_perf_counters AS
+  SELECT P.spcoid, P.dboid, P.relnumber, P.forknum,
+         CASE WHEN P.dboid = (SELECT oid FROM pg_database WHERE datname = current_database())
+              OR P.dboid = 0
+              THEN pg_filenode_relation(P.spcoid, P.relnumber)
+         END AS relation,
+         P.metric, P.bucket_le, P.value
+  FROM get_relation_perf_counters() AS P (
+    spcoid oid,
+    dboid oid,
+    relnumber oid,
+    forknum integer,
+    metric text,
+    bucket_le float8,
+    value float8
+  );
@@ -0,0 +1,2 @@
+DROP VIEW IF EXISTS neon_relation_perf_counters;
+DROP FUNCTION IF EXISTS get_relation_perf_counters();
@@ -0,0 +1,24 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.9'" to load this file. \quit
+
+CREATE FUNCTION neon_get_lfc_db_stats()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_lfc_db_stats'
+LANGUAGE C PARALLEL SAFE;
+
+-- Local file cache usage and hit ratio of each database. file_cache_used is
+-- in chunks, like in neon_lfc_stats. The row with NULL dboid sums up the
+-- databases that didn't get their own statistics slot.
+CREATE VIEW neon_lfc_db_stats AS
+  SELECT P.dboid, D.datname, P.file_cache_used, P.file_cache_hits,
+         P.file_cache_misses, P.file_cache_writes,
+         CASE WHEN P.file_cache_hits + P.file_cache_misses > 0
+              THEN P.file_cache_hits::float8 / (P.file_cache_hits + P.file_cache_misses)
+         END AS file_cache_hit_ratio
+  FROM neon_get_lfc_db_stats() AS P (
+    dboid oid,
+    file_cache_used bigint,
+    file_cache_hits bigint,
+    file_cache_misses bigint,
+    file_cache_writes bigint
+  )
+  LEFT JOIN pg_database D ON D.oid = P.dboid;
@@ -0,0 +1,18 @@
+\echo Use "ALTER EXTENSION neon UPDATE TO '1.10'" to load this file. \quit
+
+CREATE FUNCTION neon_get_perf_counter_percentiles()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_get_perf_counter_percentiles'
+LANGUAGE C PARALLEL SAFE;
+
+-- Percentiles of the I/O wait times across all backends, in seconds,
+-- estimated from the fine-grained histograms behind neon_perf_counters.
+CREATE VIEW neon_perf_counter_percentiles AS
+  SELECT P.* FROM neon_get_perf_counter_percentiles() AS P (
+    metric text,
+    count bigint,
+    p50 float8,
+    p90 float8,
+    p99 float8,
+    p999 float8
+  );
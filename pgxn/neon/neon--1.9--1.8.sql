@@ -0,0 +1,2 @@
+DROP VIEW IF EXISTS neon_lfc_db_stats;
+DROP FUNCTION IF EXISTS neon_get_lfc_db_stats();
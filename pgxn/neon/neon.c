@@ -12,6 +12,7 @@
 #include "fmgr.h"
 
 #include "miscadmin.h"
+#include "access/clog.h"
 #include "access/subtrans.h"
 #include "access/twophase.h"
 #include "access/xlog.h"
@@ -22,6 +23,7 @@
 #include "replication/logicallauncher.h"
 #include "replication/slot.h"
 #include "replication/walsender.h"
+#include "storage/fd.h"
 #include "storage/proc.h"
 #include "funcapi.h"
 #include "access/htup_details.h"
@@ -33,6 +35,7 @@
 #include "extension_server.h"
 #include "neon.h"
 #include "control_plane_connector.h"
+#include "pagestore_client.h"
 #include "logical_replication_monitor.h"
 #include "unstable_extensions.h"
 #include "walsender_hooks.h"
@@ -83,6 +86,219 @@ static const struct config_enum_entry running_xacts_overflow_policies[] = {
 #define TOTAL_MAX_CACHED_SUBXIDS \
 	((PGPROC_MAX_CACHED_SUBXIDS + 1) * PROCARRAY_MAXPROCS)
 
+/*
+ * XXX: These are private to clog.c, but we need them here. They describe the
+ * on-disk layout of the CLOG, which has been the same in all the supported
+ * versions; check clog.c again before adding a new one.
+ */
+#if PG_MAJORVERSION_NUM < 14 || PG_MAJORVERSION_NUM > 17
+#error "the CLOG layout below has not been verified against this PostgreSQL version"
+#endif
+#define CLOG_BITS_PER_XACT	2
+#define CLOG_XACTS_PER_BYTE 4
+#define CLOG_XACTS_PER_PAGE (BLCKSZ * CLOG_XACTS_PER_BYTE)
+#define CLOG_XACT_BITMASK	((1 << CLOG_BITS_PER_XACT) - 1)
+
+#define CLOG_SEGMENT_SIZE		(SLRU_PAGES_PER_SEGMENT * BLCKSZ)
+#define CLOG_XACTS_PER_SEGMENT	(CLOG_XACTS_PER_PAGE * SLRU_PAGES_PER_SEGMENT)
+#define CLOG_XACTS_PER_WORD		(sizeof(uint64) * CLOG_XACTS_PER_BYTE)
+
+/* Number of CLOG segments that are loaded at a time while scanning */
+#define CLOG_SCAN_BATCH_SEGMENTS 8
+
+/*
+ * State of a scan over the CLOG segment files, see ClogScanNext().
+ */
+typedef struct ClogScanState
+{
+	int			first_segno;	/* first segment in 'data' */
+	int			nsegs;			/* number of segments in 'data' */
+	int			n_blocks[CLOG_SCAN_BATCH_SEGMENTS]; /* pages in each segment */
+	char	   *data;			/* CLOG_SCAN_BATCH_SEGMENTS segments */
+} ClogScanState;
+
+/*
+ * Read a CLOG segment from the local pg_xact directory. Returns the number of
+ * pages read, or -1 if the segment hasn't been downloaded.
+ */
+static int
+ClogReadLocalSegment(int segno, char *buffer)
+{
+	char		path[MAXPGPATH];
+	int			fd;
+	Size		nread = 0;
+
+	snprintf(path, MAXPGPATH, "pg_xact/%04X", segno);
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return -1;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+	}
+
+	while (nread < CLOG_SEGMENT_SIZE)
+	{
+		ssize_t		rc = pg_pread(fd, buffer + nread, CLOG_SEGMENT_SIZE - nread, nread);
+
+		if (rc < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", path)));
+		if (rc == 0)
+			break;
+		nread += rc;
+	}
+	CloseTransientFile(fd);
+
+	return nread / BLCKSZ;
+}
+
+/*
+ * Load the batch of CLOG segments starting at 'segno' into the scan buffer.
+ *
+ * Segments that are present locally are read from disk. All the others are
+ * requested from the pageserver in one go, so that we pay for one round trip
+ * per batch rather than one per segment. Unlike SimpleLruReadPage(), this
+ * doesn't store the downloaded segments on local disk; the SLRU will still
+ * download the few that are needed later during replay.
+ */
+static void
+ClogScanLoad(ClogScanState *scan, int segno, TransactionId till)
+{
+	int			last_segno = (till - 1) / CLOG_XACTS_PER_SEGMENT;
+	int			max_segno = MaxTransactionId / CLOG_XACTS_PER_SEGMENT;
+	int			missing_segnos[CLOG_SCAN_BATCH_SEGMENTS];
+	char	   *missing_buffers[CLOG_SCAN_BATCH_SEGMENTS];
+	int			missing_n_blocks[CLOG_SCAN_BATCH_SEGMENTS];
+	int			missing_idx[CLOG_SCAN_BATCH_SEGMENTS];
+	int			nmissing = 0;
+
+	scan->first_segno = segno;
+	scan->nsegs = 0;
+	while (scan->nsegs < CLOG_SCAN_BATCH_SEGMENTS)
+	{
+		int			this_segno = segno + scan->nsegs;
+		char	   *buffer = scan->data + (Size) scan->nsegs * CLOG_SEGMENT_SIZE;
+		int			n_blocks = ClogReadLocalSegment(this_segno, buffer);
+
+		if (n_blocks < 0)
+		{
+			missing_segnos[nmissing] = this_segno;
+			missing_buffers[nmissing] = buffer;
+			missing_idx[nmissing] = scan->nsegs;
+			nmissing++;
+			n_blocks = 0;
+		}
+		scan->n_blocks[scan->nsegs++] = n_blocks;
+
+		/* stop at the end of the range, or where the XID space wraps around */
+		if (this_segno == last_segno || this_segno == max_segno)
+			break;
+	}
+
+	/*
+	 * Without a pageserver, leave the missing segments empty. Their XIDs are
+	 * looked up with TransactionIdGetStatus() instead.
+	 */
+	if (nmissing > 0 && page_server_connstring && page_server_connstring[0])
+	{
+		neon_read_slru_segments(SLRU_CLOG, nmissing, missing_segnos,
+								missing_buffers, missing_n_blocks);
+		for (int i = 0; i < nmissing; i++)
+			scan->n_blocks[missing_idx[i]] = missing_n_blocks[i];
+	}
+}
+
+/*
+ * Does the CLOG word have all its XIDs marked as either committed or aborted?
+ *
+ * Committed (01) and aborted (10) are the two statuses that have exactly one
+ * of their two bits set. The statuses never straddle a byte, so this works
+ * regardless of the byte order of the word.
+ */
+static inline bool
+ClogWordAllCompleted(uint64 word)
+{
+	const uint64 low_bits = UINT64CONST(0x5555555555555555);
+
+	return ((word & low_bits) ^ ((word >> 1) & low_bits)) == low_bits;
+}
+
+/*
+ * Advance '*xid' to the next XID, not past 'till', that is not marked as
+ * committed or aborted in the CLOG, and return its status in '*status'.
+ * Returns false if there are no such XIDs left.
+ *
+ * Runs of completed XIDs are skipped a word at a time, without going through
+ * TransactionIdGetStatus() and the SLRU lock for each XID.
+ */
+static bool
+ClogScanNext(ClogScanState *scan, TransactionId *xid, TransactionId till,
+			 XidStatus *status)
+{
+	TransactionId cur = *xid;
+
+	while (cur != till)
+	{
+		int			segno = cur / CLOG_XACTS_PER_SEGMENT;
+		uint32		off = cur % CLOG_XACTS_PER_SEGMENT;
+		char	   *segment;
+
+		if (scan->nsegs == 0 || segno < scan->first_segno ||
+			segno >= scan->first_segno + scan->nsegs)
+			ClogScanLoad(scan, segno, till);
+
+		/* the page is not available locally, ask the CLOG */
+		if (off / CLOG_XACTS_PER_PAGE >= scan->n_blocks[segno - scan->first_segno])
+		{
+			XLogRecPtr	xidlsn;
+
+			*status = TransactionIdGetStatus(cur, &xidlsn);
+			if (*status != TRANSACTION_STATUS_COMMITTED &&
+				*status != TRANSACTION_STATUS_ABORTED)
+				break;
+			TransactionIdAdvance(cur);
+			continue;
+		}
+
+		segment = scan->data + (Size) (segno - scan->first_segno) * CLOG_SEGMENT_SIZE;
+
+		/*
+		 * Skip a whole word at a time, if it doesn't contain 'till'. A word
+		 * never straddles a page boundary.
+		 */
+		if (off % CLOG_XACTS_PER_WORD == 0 &&
+			(uint32) (till - cur) >= CLOG_XACTS_PER_WORD)
+		{
+			uint64		word;
+
+			memcpy(&word, segment + off / CLOG_XACTS_PER_BYTE, sizeof(word));
+			if (ClogWordAllCompleted(word))
+			{
+				cur += CLOG_XACTS_PER_WORD;
+				/* wrapped around, skip the special XIDs like TransactionIdAdvance */
+				if (cur < FirstNormalTransactionId)
+					cur = FirstNormalTransactionId;
+				continue;
+			}
+		}
+
+		*status = (segment[off / CLOG_XACTS_PER_BYTE] >>
+				   ((off % CLOG_XACTS_PER_BYTE) * CLOG_BITS_PER_XACT)) & CLOG_XACT_BITMASK;
+		if (*status != TRANSACTION_STATUS_COMMITTED &&
+			*status != TRANSACTION_STATUS_ABORTED)
+			break;
+		TransactionIdAdvance(cur);
+	}
+
+	*xid = cur;
+	return cur != till;
+}
+
 /*
  * Restore running-xact information by scanning the CLOG at startup.
  *
@@ -143,6 +359,8 @@ RestoreRunningXactsFromClog(CheckPoint *checkpoint, TransactionId **xids, int *n
 	TransactionId *restored_xids = NULL;
 	int			n_restored_xids;
 	int			next_prepared_idx;
+	ClogScanState clog_scan = {0};
+	XidStatus	xidstatus;
 
 	Assert(*xids == NULL);
 
@@ -221,12 +439,18 @@ RestoreRunningXactsFromClog(CheckPoint *checkpoint, TransactionId **xids, int *n
 	n_restored_xids = 0;
 	next_prepared_idx = 0;
 
-	for (TransactionId xid = from; xid != till;)
-	{
-		XLogRecPtr	xidlsn;
-		XidStatus	xidstatus;
+	/*
+	 * Committed and aborted XIDs are skipped over by ClogScanNext(), so we
+	 * only get to see the ones that are still in progress (or that have an
+	 * unexpected status).
+	 */
+	clog_scan.nsegs = 0;
+	clog_scan.data = palloc((Size) CLOG_SCAN_BATCH_SEGMENTS * CLOG_SEGMENT_SIZE);
 
-		xidstatus = TransactionIdGetStatus(xid, &xidlsn);
+	for (TransactionId xid = from; ClogScanNext(&clog_scan, &xid, till, &xidstatus);)
+	{
+		Assert(xidstatus != TRANSACTION_STATUS_COMMITTED &&
+			   xidstatus != TRANSACTION_STATUS_ABORTED);
 
 		/*
 		 * "Merge" the prepared transactions into the restored_xids array as
@@ -254,16 +478,6 @@ RestoreRunningXactsFromClog(CheckPoint *checkpoint, TransactionId **xids, int *n
 			elog(DEBUG1, "XID %u: was next prepared xact (%d / %d)", xid, next_prepared_idx, n_prepared_xids);
 			next_prepared_idx++;
 		}
-		else if (xidstatus == TRANSACTION_STATUS_COMMITTED)
-		{
-			elog(DEBUG1, "XID %u: was committed", xid);
-			goto skip;
-		}
-		else if (xidstatus == TRANSACTION_STATUS_ABORTED)
-		{
-			elog(DEBUG1, "XID %u: was aborted", xid);
-			goto skip;
-		}
 		else if (xidstatus == TRANSACTION_STATUS_IN_PROGRESS)
 		{
 			/*
@@ -363,6 +577,8 @@ RestoreRunningXactsFromClog(CheckPoint *checkpoint, TransactionId **xids, int *n
 	*xids = restored_xids;
 	if (prepared_xids)
 		pfree(prepared_xids);
+	if (clog_scan.data)
+		pfree(clog_scan.data);
 	return true;
 
  fail:
@@ -372,6 +588,8 @@ RestoreRunningXactsFromClog(CheckPoint *checkpoint, TransactionId **xids, int *n
 		pfree(restored_xids);
 	if (prepared_xids)
 		pfree(prepared_xids);
+	if (clog_scan.data)
+		pfree(clog_scan.data);
 	return false;
 }
 
@@ -424,6 +642,7 @@ _PG_init(void)
 #endif
 
 	pg_init_libpagestore();
+	pg_init_query_io();
 	pg_init_walproposer();
 	Custom_XLogReaderRoutines = NeonOnDemandXLogReaderRoutines;
 
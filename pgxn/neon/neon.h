@@ -47,6 +47,7 @@ extern uint32		WAIT_EVENT_NEON_WAL_DL;
 
 extern void pg_init_libpagestore(void);
 extern void pg_init_walproposer(void);
+extern void pg_init_query_io(void);
 
 extern uint64 BackpressureThrottlingTime(void);
 extern void SetNeonCurrentClusterSize(uint64 size);
@@ -56,5 +57,6 @@ extern void replication_feedback_get_lsns(XLogRecPtr *writeLsn, XLogRecPtr *flus
 extern void PGDLLEXPORT WalProposerSync(int argc, char *argv[]);
 extern void PGDLLEXPORT WalProposerMain(Datum main_arg);
 PGDLLEXPORT void LogicalSlotsMonitorMain(Datum main_arg);
+PGDLLEXPORT void FileCacheInvalidatorMain(Datum main_arg);
 
 #endif							/* NEON_H */
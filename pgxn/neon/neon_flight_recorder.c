@@ -0,0 +1,365 @@
+/*-------------------------------------------------------------------------
+ *
+ * neon_flight_recorder.c
+ *	  Remember the most recent pageserver requests of each backend
+ *
+ * Each backend has a small ring buffer in shared memory, where it records
+ * the requests it sends to the pageserver and the reads it satisfies from
+ * the LFC, with their timestamps. Only the owning backend writes to its
+ * ring, so no locking is needed; readers detect concurrent modifications
+ * with the per-record change counter and retry.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+
+#include "bitmap.h"
+#include "neon_flight_recorder.h"
+#include "neon_perf_counters.h"
+#include "neon_pgversioncompat.h"
+
+NeonFlightRecorder *neon_flight_recorders_shared;
+
+bool		flight_recorder_enabled = true;
+
+#if PG_VERSION_NUM >= 170000
+#define MyFlightRecorder (&neon_flight_recorders_shared[MyProcNumber])
+#else
+#define MyFlightRecorder (&neon_flight_recorders_shared[MyProc->pgprocno])
+#endif
+
+#define FLIGHT_RECORD_BEGIN_WRITE(rec) \
+	do { \
+		(rec)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define FLIGHT_RECORD_END_WRITE(rec) \
+	do { \
+		pg_write_barrier(); \
+		(rec)->changecount++; \
+		Assert(((rec)->changecount & 1) == 0); \
+	} while (0)
+
+Size
+NeonFlightRecorderShmemSize(void)
+{
+	Size		size = 0;
+
+	size = add_size(size, mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
+								   sizeof(NeonFlightRecorder)));
+
+	return size;
+}
+
+void
+NeonFlightRecorderShmemInit(void)
+{
+	bool		found;
+
+	neon_flight_recorders_shared =
+		ShmemInitStruct("Neon flight recorder",
+						mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
+								 sizeof(NeonFlightRecorder)),
+						&found);
+	Assert(found == IsUnderPostmaster);
+	if (!found)
+	{
+		/* shared memory is initialized to zeros, the atomics need init */
+		for (int procno = 0; procno < NUM_NEON_PERF_COUNTER_SLOTS; procno++)
+			pg_atomic_init_u64(&neon_flight_recorders_shared[procno].last_id, 0);
+	}
+}
+
+static inline bool
+flight_recorder_active(void)
+{
+	return flight_recorder_enabled && neon_flight_recorders_shared != NULL &&
+		MyProc != NULL;
+}
+
+/*
+ * Find the record with the given id in this backend's ring, or NULL if it
+ * has already been overwritten.
+ */
+static inline NeonFlightRecord *
+flight_record_lookup(uint64 id)
+{
+	NeonFlightRecord *rec;
+
+	if (id == InvalidFlightRecordId || !flight_recorder_active())
+		return NULL;
+
+	rec = &MyFlightRecorder->records[id % NEON_FLIGHT_RECORDER_SIZE];
+	return rec->id == id ? rec : NULL;
+}
+
+static uint64
+flight_record_append(NeonMessageTag tag, shardno_t shard_no, BufferTag *buftag,
+					 uint32 nblocks,
+					 XLogRecPtr request_lsn, XLogRecPtr not_modified_since,
+					 NeonFlightRecordSource source, bool consumed,
+					 uint64 send_us, uint64 receive_us)
+{
+	NeonFlightRecorder *fr = MyFlightRecorder;
+	NeonFlightRecord *rec;
+	uint64		id;
+
+	/* we're the only writer, so no need for an atomic increment */
+	id = pg_atomic_read_u64(&fr->last_id) + 1;
+	rec = &fr->records[id % NEON_FLIGHT_RECORDER_SIZE];
+
+	FLIGHT_RECORD_BEGIN_WRITE(rec);
+	rec->pid = MyProcPid;
+	rec->tag = (uint8) tag;
+	rec->source = (uint8) source;
+	rec->consumed = consumed;
+	rec->shard_no = shard_no;
+	rec->buftag = *buftag;
+	rec->nblocks = nblocks;
+	rec->request_lsn = request_lsn;
+	rec->not_modified_since = not_modified_since;
+	rec->id = id;
+	rec->send_us = send_us;
+	rec->receive_us = receive_us;
+	FLIGHT_RECORD_END_WRITE(rec);
+
+	pg_atomic_write_u64(&fr->last_id, id);
+
+	return id;
+}
+
+/*
+ * Record a request that is about to be sent to the pageserver. Returns the
+ * id to pass to flight_record_response() once the response arrives.
+ */
+uint64
+flight_record_request(NeonMessageTag tag, shardno_t shard_no, BufferTag *buftag,
+					  XLogRecPtr request_lsn, XLogRecPtr not_modified_since,
+					  NeonFlightRecordSource source)
+{
+	if (!flight_recorder_active())
+		return InvalidFlightRecordId;
+
+	return flight_record_append(tag, shard_no, buftag, 1, request_lsn,
+								not_modified_since, source, false,
+								flight_recorder_now_us(), 0);
+}
+
+/*
+ * Record the arrival of the response to a request.
+ */
+void
+flight_record_response(uint64 id)
+{
+	NeonFlightRecord *rec = flight_record_lookup(id);
+
+	if (rec == NULL)
+		return;
+
+	FLIGHT_RECORD_BEGIN_WRITE(rec);
+	rec->receive_us = flight_recorder_now_us();
+	FLIGHT_RECORD_END_WRITE(rec);
+}
+
+/*
+ * Record that the response to a GetPage request was used to satisfy a read,
+ * as opposed to being discarded.
+ */
+void
+flight_record_consumed(uint64 id)
+{
+	NeonFlightRecord *rec = flight_record_lookup(id);
+
+	if (rec == NULL)
+		return;
+
+	FLIGHT_RECORD_BEGIN_WRITE(rec);
+	rec->consumed = true;
+	FLIGHT_RECORD_END_WRITE(rec);
+}
+
+/*
+ * Record the blocks of a read that were satisfied from the LFC, as a single
+ * record. If 'mask' is given, only the blocks with their bit set are counted.
+ */
+void
+flight_record_lfc_reads(NRelFileInfo rinfo, ForkNumber forknum,
+						BlockNumber blkno, BlockNumber nblocks,
+						const bits8 *mask, uint64 start_us)
+{
+	BufferTag	buftag = {0};
+	BlockNumber first = InvalidBlockNumber;
+	uint32		nread = 0;
+
+	if (!flight_recorder_active())
+		return;
+
+	for (BlockNumber i = 0; i < nblocks; i++)
+	{
+		if (mask != NULL && !BITMAP_ISSET(mask, i))
+			continue;
+
+		if (nread++ == 0)
+			first = blkno + i;
+	}
+	if (nread == 0)
+		return;
+
+	CopyNRelFileInfoToBufTag(buftag, rinfo);
+	buftag.forkNum = forknum;
+	buftag.blockNum = first;
+	flight_record_append(T_NeonGetPageRequest, 0, &buftag, nread,
+						 InvalidXLogRecPtr, InvalidXLogRecPtr,
+						 NFR_SOURCE_LFC, true, start_us,
+						 flight_recorder_now_us());
+}
+
+static const char *
+flight_record_tag_name(uint8 tag)
+{
+	switch (tag)
+	{
+		case T_NeonExistsRequest:
+			return "Exists";
+		case T_NeonNblocksRequest:
+			return "Nblocks";
+		case T_NeonGetPageRequest:
+			return "GetPage";
+		case T_NeonDbSizeRequest:
+			return "DbSize";
+		case T_NeonGetSlruSegmentRequest:
+			return "GetSlruSegment";
+		default:
+			return "unknown";
+	}
+}
+
+static const char *
+flight_record_source_name(uint8 source)
+{
+	switch (source)
+	{
+		case NFR_SOURCE_SYNC:
+			return "sync";
+		case NFR_SOURCE_PREFETCH:
+			return "prefetch";
+		case NFR_SOURCE_LFC:
+			return "lfc";
+		default:
+			return "unknown";
+	}
+}
+
+/*
+ * Convert a monotonic clock reading to a wall clock timestamp, given a pair
+ * of readings of both clocks taken at the same time. Another backend can
+ * write a record after we sampled the clocks, so clamp readings from the
+ * "future" to 'now_ts' instead of letting the unsigned subtraction wrap.
+ */
+static TimestampTz
+flight_record_timestamp(TimestampTz now_ts, uint64 now_us, uint64 us)
+{
+	if (us >= now_us)
+		return now_ts;
+	return now_ts - (TimestampTz) (now_us - us);
+}
+
+#define NUM_FLIGHT_RECORDER_COLS 18
+
+PG_FUNCTION_INFO_V1(neon_get_flight_recorder);
+Datum
+neon_get_flight_recorder(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum		values[NUM_FLIGHT_RECORDER_COLS];
+	bool		nulls[NUM_FLIGHT_RECORDER_COLS];
+	TimestampTz now_ts;
+	uint64		now_us;
+
+	/* We put all the tuples into a tuplestore in one go. */
+	InitMaterializedSRF(fcinfo, 0);
+
+	/*
+	 * The records carry monotonic clock readings. Convert them to wall clock
+	 * times relative to the current time.
+	 */
+	now_ts = GetCurrentTimestamp();
+	now_us = flight_recorder_now_us();
+
+	for (int procno = 0; procno < NUM_NEON_PERF_COUNTER_SLOTS; procno++)
+	{
+		NeonFlightRecorder *fr = &neon_flight_recorders_shared[procno];
+
+		for (int i = 0; i < NEON_FLIGHT_RECORDER_SIZE; i++)
+		{
+			NeonFlightRecord *rec = &fr->records[i];
+			NeonFlightRecord copy;
+			int			col = 0;
+
+			/* Retry until we get a consistent copy, like pgstat_read_current_status() */
+			for (;;)
+			{
+				uint32		before = rec->changecount;
+
+				pg_read_barrier();
+				memcpy(&copy, rec, sizeof(NeonFlightRecord));
+				pg_read_barrier();
+
+				if (before == rec->changecount && (before & 1) == 0)
+					break;
+
+				CHECK_FOR_INTERRUPTS();
+			}
+
+			if (copy.id == InvalidFlightRecordId)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[col++] = Int32GetDatum(procno);
+			values[col++] = Int32GetDatum(copy.pid);
+			values[col++] = Int64GetDatum((int64) copy.id);
+			values[col++] = CStringGetTextDatum(flight_record_tag_name(copy.tag));
+			values[col++] = CStringGetTextDatum(flight_record_source_name(copy.source));
+			values[col++] = BoolGetDatum(copy.consumed);
+			values[col++] = Int32GetDatum(copy.shard_no);
+			values[col++] = ObjectIdGetDatum(NInfoGetSpcOid(BufTagGetNRelFileInfo(copy.buftag)));
+			values[col++] = ObjectIdGetDatum(NInfoGetDbOid(BufTagGetNRelFileInfo(copy.buftag)));
+			values[col++] = ObjectIdGetDatum(NInfoGetRelNumber(BufTagGetNRelFileInfo(copy.buftag)));
+			values[col++] = Int32GetDatum(copy.buftag.forkNum);
+			values[col++] = Int64GetDatum((int64) copy.buftag.blockNum);
+			values[col++] = Int32GetDatum((int32) copy.nblocks);
+
+			values[col] = LSNGetDatum(copy.request_lsn);
+			nulls[col++] = copy.request_lsn == InvalidXLogRecPtr;
+			values[col] = LSNGetDatum(copy.not_modified_since);
+			nulls[col++] = copy.not_modified_since == InvalidXLogRecPtr;
+
+			values[col++] = TimestampTzGetDatum(flight_record_timestamp(now_ts, now_us, copy.send_us));
+			if (copy.receive_us != 0)
+			{
+				values[col++] = TimestampTzGetDatum(flight_record_timestamp(now_ts, now_us, copy.receive_us));
+				values[col++] = Float8GetDatum((double) (copy.receive_us - copy.send_us) / 1000000.0);
+			}
+			else
+			{
+				nulls[col++] = true;
+				nulls[col++] = true;
+			}
+			Assert(col == NUM_FLIGHT_RECORDER_COLS);
+
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
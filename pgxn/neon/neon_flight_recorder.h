@@ -0,0 +1,109 @@
+/*-------------------------------------------------------------------------
+ *
+ * neon_flight_recorder.h
+ *	  Per-backend ring buffer of recent pageserver requests
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef NEON_FLIGHT_RECORDER_H
+#define NEON_FLIGHT_RECORDER_H
+
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "storage/buf_internals.h"
+
+#include "pagestore_client.h"
+
+/*
+ * Number of requests remembered for each backend. This is a compile-time
+ * constant so that the shared memory size doesn't depend on a GUC.
+ */
+#define NEON_FLIGHT_RECORDER_SIZE 64
+
+/* Where the page or answer for a request came from */
+typedef enum
+{
+	NFR_SOURCE_SYNC = 0,		/* synchronous request to the pageserver */
+	NFR_SOURCE_PREFETCH,		/* speculative prefetch request */
+	NFR_SOURCE_LFC,				/* read from the local file cache */
+} NeonFlightRecordSource;
+
+typedef struct
+{
+	/*
+	 * Incremented before and after every change to the record, so it's odd
+	 * while the record is being written. Readers use it to detect torn reads,
+	 * like with PgBackendStatus.st_changecount.
+	 */
+	uint32		changecount;
+
+	int			pid;			/* backend that made the request */
+	uint8		tag;			/* NeonMessageTag of the request */
+	uint8		source;			/* NeonFlightRecordSource */
+	bool		consumed;		/* GetPage response was used by a read */
+	shardno_t	shard_no;
+
+	/*
+	 * For GetSlruSegment requests, forkNum holds the SLRU kind and blockNum
+	 * the segment number. DbSize requests only fill in the database.
+	 */
+	BufferTag	buftag;
+
+	/*
+	 * Number of blocks covered by the record: 1 for pageserver requests. An
+	 * LFC record stands for all the blocks of one read that were satisfied
+	 * from the LFC, starting at buftag.blockNum. They are not necessarily
+	 * contiguous, if other blocks of the read came from elsewhere.
+	 */
+	uint32		nblocks;
+	XLogRecPtr	request_lsn;
+	XLogRecPtr	not_modified_since;
+
+	uint64		id;				/* sequence number of this record, from 1 */
+	uint64		send_us;		/* INSTR_TIME microseconds */
+	uint64		receive_us;		/* 0 while the response is outstanding */
+} NeonFlightRecord;
+
+typedef struct
+{
+	/* id of the last record written */
+	pg_atomic_uint64 last_id;
+	NeonFlightRecord records[NEON_FLIGHT_RECORDER_SIZE];
+} NeonFlightRecorder;
+
+/* Pointer to the shared memory array of NeonFlightRecorders */
+extern NeonFlightRecorder *neon_flight_recorders_shared;
+
+extern bool flight_recorder_enabled;
+
+/* "no record", e.g. when the recorder is disabled */
+#define InvalidFlightRecordId 0
+
+/*
+ * Timestamps are taken with INSTR_TIME_SET_CURRENT(), which reads the
+ * monotonic clock through the vDSO without a system call.
+ */
+static inline uint64
+flight_recorder_now_us(void)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	return INSTR_TIME_GET_MICROSEC(now);
+}
+
+extern uint64 flight_record_request(NeonMessageTag tag, shardno_t shard_no,
+									BufferTag *buftag,
+									XLogRecPtr request_lsn,
+									XLogRecPtr not_modified_since,
+									NeonFlightRecordSource source);
+extern void flight_record_response(uint64 id);
+extern void flight_record_consumed(uint64 id);
+extern void flight_record_lfc_reads(NRelFileInfo rinfo, ForkNumber forknum,
+									BlockNumber blkno, BlockNumber nblocks,
+									const bits8 *mask, uint64 start_us);
+
+extern Size NeonFlightRecorderShmemSize(void);
+extern void NeonFlightRecorderShmemInit(void);
+
+#endif							/* NEON_FLIGHT_RECORDER_H */
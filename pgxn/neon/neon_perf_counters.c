@@ -3,7 +3,14 @@
  * neon_perf_counters.c
  *	  Collect statistics about Neon I/O
  *
- * Each backend has its own set of counters in shared memory.
+ * Each backend has its own set of counters in shared memory, in a slot of
+ * its own cache lines. Only the owning backend updates them; readers use the
+ * slot's change counter to get a consistent copy. In addition, GetPage waits
+ * are tracked per relation in a small shared table.
+ *
+ * Wait times are kept in fine-grained log-linear histograms. They are
+ * exported as coarser Prometheus histograms, and as percentiles by
+ * neon_get_perf_counter_percentiles().
  *
  *-------------------------------------------------------------------------
  */
@@ -13,14 +20,116 @@
 
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "storage/lwlock.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
 #include "utils/builtins.h"
+#include "utils/float.h"
+#include "utils/hsearch.h"
 
 #include "neon_perf_counters.h"
 #include "neon_pgversioncompat.h"
 
-neon_per_backend_counters *neon_per_backend_counters_shared;
+neon_per_backend_counters_slot *neon_per_backend_counters_shared;
+
+typedef struct
+{
+	Oid			spcoid;
+	Oid			dboid;
+	Oid			relnumber;
+	ForkNumber	forknum;
+} RelationPerfKey;
+
+/*
+ * Like IOHistogramData, but updated with atomic instructions, so that
+ * backends reading the same relation don't serialize on a lock.
+ */
+typedef struct
+{
+	pg_atomic_uint64 wait_us_count;
+	pg_atomic_uint64 wait_us_sum;
+	pg_atomic_uint64 wait_us_bucket[IO_HIST_NUM_BUCKETS];
+} AtomicIOHistogramData;
+
+typedef struct
+{
+	/* 'key' and 'in_use' are protected by relation_perf_lock */
+	bool		in_use;
+	RelationPerfKey key;
+
+	/*
+	 * Incremented whenever the slot is given to another relation, so that
+	 * backends can tell that the slot they remember is no longer theirs.
+	 */
+	pg_atomic_uint32 generation;
+
+	/* clock sweep usage count, up to RELATION_PERF_MAX_USAGE */
+	pg_atomic_uint32 usage;
+	AtomicIOHistogramData getpage_hist;
+} RelationPerfEntry;
+
+#define RELATION_PERF_MAX_USAGE 5
+
+/*
+ * GetPage wait histograms of individual relations.
+ *
+ * The table holds the NUM_RELATION_PERF_COUNTERS relations that have seen
+ * GetPage requests most recently and frequently. When it's full, a victim is
+ * chosen with a clock sweep over the usage counts, like the buffer manager
+ * does, its histogram is merged into the overflow histogram, and its slot is
+ * reused for the new relation. So the busy relations stay, and the sum of all
+ * entries and the overflow still matches getpage_hist of all backends
+ * combined.
+ *
+ * relation_perf_hash maps relations to their slots. It's protected by
+ * relation_perf_lock, which is only needed to find or assign a slot: lookups
+ * take it in shared mode, and only assigning a new slot takes it exclusively.
+ * Each
+ * backend remembers the slots of the relations it has recently read in
+ * relation_perf_cache, and updates the histograms of those without any lock.
+ * A backend can race with the slot being reassigned, and count one wait for
+ * the new relation. That's harmless for statistics, and the totals are still
+ * right, because the histogram of the old relation is moved to the overflow
+ * with atomic exchanges.
+ */
+typedef struct
+{
+	AtomicIOHistogramData overflow;
+
+	/* protected by relation_perf_lock */
+	int			nused;			/* slots [0, nused) have been assigned */
+	int			clock_hand;		/* next slot to consider for eviction */
+
+	RelationPerfEntry entries[NUM_RELATION_PERF_COUNTERS];
+} RelationPerfCounters;
+
+typedef struct
+{
+	RelationPerfKey key;		/* hash key, must be first */
+	int			slot;
+} RelationPerfHashEntry;
+
+static RelationPerfCounters *relation_perf_counters_shared;
+static HTAB *relation_perf_hash;
+static LWLockId relation_perf_lock;
+
+/*
+ * Slots of the relations that this backend has recently counted GetPage
+ * waits for. This is a small direct-mapped cache, so that a backend that
+ * alternates between a few relations, like an index scan, doesn't need to
+ * look them up every time.
+ */
+#define RELATION_PERF_CACHE_SIZE 8
+
+typedef struct
+{
+	bool		valid;
+	RelationPerfKey key;
+	int			slot;
+	uint32		generation;		/* generation of the slot when cached */
+} RelationPerfCacheEntry;
+
+static RelationPerfCacheEntry relation_perf_cache[RELATION_PERF_CACHE_SIZE];
 
 Size
 NeonPerfCountersShmemSize(void)
@@ -28,56 +137,307 @@ NeonPerfCountersShmemSize(void)
 	Size		size = 0;
 
 	size = add_size(size, mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
-								   sizeof(neon_per_backend_counters)));
+								   sizeof(neon_per_backend_counters_slot)));
+	size = add_size(size, sizeof(RelationPerfCounters));
+	size = add_size(size, hash_estimate_size(NUM_RELATION_PERF_COUNTERS,
+											 sizeof(RelationPerfHashEntry)));
 
 	return size;
 }
 
+static void
+atomic_iohist_init(AtomicIOHistogramData *hist)
+{
+	pg_atomic_init_u64(&hist->wait_us_count, 0);
+	pg_atomic_init_u64(&hist->wait_us_sum, 0);
+	for (int bucketno = 0; bucketno < IO_HIST_NUM_BUCKETS; bucketno++)
+		pg_atomic_init_u64(&hist->wait_us_bucket[bucketno], 0);
+}
+
 void
 NeonPerfCountersShmemInit(void)
 {
 	bool		found;
+	HASHCTL		info;
 
 	neon_per_backend_counters_shared =
 		ShmemInitStruct("Neon perf counters",
 						mul_size(NUM_NEON_PERF_COUNTER_SLOTS,
-								 sizeof(neon_per_backend_counters)),
+								 sizeof(neon_per_backend_counters_slot)),
 						&found);
 	Assert(found == IsUnderPostmaster);
+	Assert(((uintptr_t) neon_per_backend_counters_shared % PG_CACHE_LINE_SIZE) == 0);
 	if (!found)
 	{
 		/* shared memory is initialized to zeros, so nothing to do here */
 	}
+
+	relation_perf_counters_shared =
+		ShmemInitStruct("Neon relation perf counters",
+						sizeof(RelationPerfCounters),
+						&found);
+	Assert(found == IsUnderPostmaster);
+	if (!found)
+	{
+		atomic_iohist_init(&relation_perf_counters_shared->overflow);
+		relation_perf_counters_shared->nused = 0;
+		relation_perf_counters_shared->clock_hand = 0;
+		for (int i = 0; i < NUM_RELATION_PERF_COUNTERS; i++)
+		{
+			RelationPerfEntry *entry = &relation_perf_counters_shared->entries[i];
+
+			entry->in_use = false;
+			pg_atomic_init_u32(&entry->generation, 0);
+			pg_atomic_init_u32(&entry->usage, 0);
+			atomic_iohist_init(&entry->getpage_hist);
+		}
+	}
+
+	info.keysize = sizeof(RelationPerfKey);
+	info.entrysize = sizeof(RelationPerfHashEntry);
+	relation_perf_hash = ShmemInitHash("Neon relation perf counters hash",
+									   NUM_RELATION_PERF_COUNTERS,
+									   NUM_RELATION_PERF_COUNTERS,
+									   &info,
+									   HASH_ELEM | HASH_BLOBS);
+	relation_perf_lock = (LWLockId) GetNamedLWLockTranche("neon_relation_perf_counters");
+}
+
+/*
+ * Request the lock of the relation perf counters. The shared memory is
+ * included in NeonPerfCountersShmemSize().
+ */
+void
+NeonPerfCountersShmemRequest(void)
+{
+	RequestNamedLWLockTranche("neon_relation_perf_counters", 1);
 }
 
 static inline void
 inc_iohist(IOHistogram hist, uint64 latency_us)
 {
-	int			lo = 0;
-	int			hi = NUM_IO_WAIT_BUCKETS - 1;
+	hist->wait_us_bucket[io_hist_bucket(latency_us)]++;
+	hist->wait_us_sum += latency_us;
+	hist->wait_us_count++;
+}
+
+static inline void
+histogram_merge_into(IOHistogram into, IOHistogram from)
+{
+	into->wait_us_count += from->wait_us_count;
+	into->wait_us_sum += from->wait_us_sum;
+	for (int bucketno = 0; bucketno < IO_HIST_NUM_BUCKETS; bucketno++)
+		into->wait_us_bucket[bucketno] += from->wait_us_bucket[bucketno];
+}
+
+static inline void
+inc_atomic_iohist(AtomicIOHistogramData *hist, uint64 latency_us)
+{
+	pg_atomic_fetch_add_u64(&hist->wait_us_bucket[io_hist_bucket(latency_us)], 1);
+	pg_atomic_fetch_add_u64(&hist->wait_us_sum, latency_us);
+	pg_atomic_fetch_add_u64(&hist->wait_us_count, 1);
+}
 
-	/* Find the right bucket with binary search */
-	while (lo < hi)
+/*
+ * Move the counts of one atomic histogram to another, leaving it empty.
+ * Concurrent increments of 'from' end up in either histogram, never lost.
+ */
+static void
+atomic_iohist_move(AtomicIOHistogramData *into, AtomicIOHistogramData *from)
+{
+	pg_atomic_fetch_add_u64(&into->wait_us_count,
+							pg_atomic_exchange_u64(&from->wait_us_count, 0));
+	pg_atomic_fetch_add_u64(&into->wait_us_sum,
+							pg_atomic_exchange_u64(&from->wait_us_sum, 0));
+	for (int bucketno = 0; bucketno < IO_HIST_NUM_BUCKETS; bucketno++)
+		pg_atomic_fetch_add_u64(&into->wait_us_bucket[bucketno],
+								pg_atomic_exchange_u64(&from->wait_us_bucket[bucketno], 0));
+}
+
+/*
+ * Copy an atomic histogram. The copy isn't a consistent snapshot if the
+ * histogram is being updated concurrently, but each count is exact.
+ */
+static void
+atomic_iohist_read(AtomicIOHistogramData *hist, IOHistogram copy)
+{
+	copy->wait_us_count = pg_atomic_read_u64(&hist->wait_us_count);
+	copy->wait_us_sum = pg_atomic_read_u64(&hist->wait_us_sum);
+	for (int bucketno = 0; bucketno < IO_HIST_NUM_BUCKETS; bucketno++)
+		copy->wait_us_bucket[bucketno] = pg_atomic_read_u64(&hist->wait_us_bucket[bucketno]);
+}
+
+/*
+ * Estimate the given percentile of a histogram, in seconds. Like
+ * HdrHistogram, this returns the highest value that falls into the same
+ * bucket as the value at the percentile, or infinity if that's the overflow
+ * bucket. Returns false if the histogram is empty.
+ */
+bool
+io_histogram_percentile(IOHistogram hist, double percentile, double *result)
+{
+	uint64		total = 0;
+	uint64		rank;
+	uint64		accum = 0;
+
+	for (int bucketno = 0; bucketno < IO_HIST_NUM_BUCKETS; bucketno++)
+		total += hist->wait_us_bucket[bucketno];
+	if (total == 0)
+		return false;
+
+	rank = (uint64) ceil(percentile / 100.0 * (double) total);
+	rank = Max(rank, 1);
+
+	for (int bucketno = 0; bucketno < IO_HIST_NUM_BUCKETS; bucketno++)
 	{
-		int			mid = (lo + hi) / 2;
+		accum += hist->wait_us_bucket[bucketno];
+		if (accum >= rank)
+		{
+			if (bucketno == IO_HIST_OVERFLOW_BUCKET)
+				*result = get_float8_infinity();
+			else
+				*result = (double) (io_hist_bucket_lower(bucketno + 1) - 1) / 1000000.0;
+			return true;
+		}
+	}
 
-		if (latency_us < io_wait_bucket_thresholds[mid])
-			hi = mid;
-		else
-			lo = mid + 1;
+	pg_unreachable();
+}
+
+static inline bool
+relation_perf_key_equal(const RelationPerfKey *a, const RelationPerfKey *b)
+{
+	return a->spcoid == b->spcoid && a->dboid == b->dboid &&
+		a->relnumber == b->relnumber && a->forknum == b->forknum;
+}
+
+/*
+ * Choose a slot to reassign with a clock sweep: decrement the usage counts
+ * until we find one that is zero. Increments only race with us upwards, so
+ * the counts can't wrap around. The caller holds relation_perf_lock in
+ * exclusive mode.
+ */
+static int
+relation_perf_clock_sweep(void)
+{
+	RelationPerfCounters *rpc = relation_perf_counters_shared;
+
+	/* the counts are capped, so this is bounded unless they keep rising */
+	for (int i = 0; i < NUM_RELATION_PERF_COUNTERS * (RELATION_PERF_MAX_USAGE + 1); i++)
+	{
+		int			slot = rpc->clock_hand;
+		RelationPerfEntry *entry = &rpc->entries[slot];
+
+		rpc->clock_hand = (slot + 1) % NUM_RELATION_PERF_COUNTERS;
+		if (pg_atomic_read_u32(&entry->usage) == 0)
+			return slot;
+		pg_atomic_fetch_sub_u32(&entry->usage, 1);
 	}
-	hist->wait_us_bucket[lo]++;
-	hist->wait_us_sum += latency_us;
-	hist->wait_us_count++;
+
+	/* every relation is busy, just take the next one */
+	return rpc->clock_hand;
+}
+
+/*
+ * Find or assign the slot for a relation, and return it with its current
+ * generation.
+ */
+static int
+relation_perf_assign_slot(const RelationPerfKey *key, uint32 *generation)
+{
+	RelationPerfCounters *rpc = relation_perf_counters_shared;
+	RelationPerfHashEntry *hentry;
+	RelationPerfEntry *entry;
+	bool		found;
+	int			victim;
+
+	LWLockAcquire(relation_perf_lock, LW_SHARED);
+	hentry = hash_search(relation_perf_hash, key, HASH_FIND, NULL);
+	if (hentry != NULL)
+	{
+		int			slot = hentry->slot;
+
+		*generation = pg_atomic_read_u32(&rpc->entries[slot].generation);
+		LWLockRelease(relation_perf_lock);
+		return slot;
+	}
+	LWLockRelease(relation_perf_lock);
+
+	LWLockAcquire(relation_perf_lock, LW_EXCLUSIVE);
+	hentry = hash_search(relation_perf_hash, key, HASH_FIND, NULL);
+	if (hentry != NULL)
+	{
+		/* another backend assigned it concurrently */
+		int			slot = hentry->slot;
+
+		*generation = pg_atomic_read_u32(&rpc->entries[slot].generation);
+		LWLockRelease(relation_perf_lock);
+		return slot;
+	}
+
+	/* Slots are never freed, so take the next unused one until we run out */
+	if (rpc->nused < NUM_RELATION_PERF_COUNTERS)
+		victim = rpc->nused++;
+	else
+		victim = relation_perf_clock_sweep();
+
+	/* Remove the old relation first, so that the hash never needs to grow */
+	entry = &rpc->entries[victim];
+	if (entry->in_use)
+	{
+		hash_search(relation_perf_hash, &entry->key, HASH_REMOVE, NULL);
+		pg_atomic_fetch_add_u32(&entry->generation, 1);
+		atomic_iohist_move(&rpc->overflow, &entry->getpage_hist);
+	}
+	hentry = hash_search(relation_perf_hash, key, HASH_ENTER, &found);
+	Assert(!found);
+	entry->key = *key;
+	entry->in_use = true;
+	pg_atomic_write_u32(&entry->usage, 1);
+	hentry->slot = victim;
+	*generation = pg_atomic_read_u32(&entry->generation);
+	LWLockRelease(relation_perf_lock);
+
+	return victim;
 }
 
 /*
  * Count a GetPage wait operation.
  */
 void
-inc_getpage_wait(uint64 latency)
+inc_getpage_wait(NRelFileInfo rinfo, ForkNumber forknum, uint64 latency)
 {
-	inc_iohist(&MyNeonCounters->getpage_hist, latency);
+	RelationPerfCounters *rpc = relation_perf_counters_shared;
+	RelationPerfKey key;
+	RelationPerfCacheEntry *cached;
+	RelationPerfEntry *entry;
+	neon_per_backend_counters *counters = MyNeonCounters;
+
+	NEON_PERF_COUNTERS_BEGIN_WRITE(counters);
+	inc_iohist(&counters->getpage_hist, latency);
+	NEON_PERF_COUNTERS_END_WRITE(counters);
+
+	memset(&key, 0, sizeof(key));
+	key.spcoid = NInfoGetSpcOid(rinfo);
+	key.dboid = NInfoGetDbOid(rinfo);
+	key.relnumber = NInfoGetRelNumber(rinfo);
+	key.forknum = forknum;
+
+	/* Fast path: we know the slot, and it hasn't been reassigned since */
+	cached = &relation_perf_cache[(key.relnumber ^ key.forknum) % RELATION_PERF_CACHE_SIZE];
+	if (!cached->valid ||
+		!relation_perf_key_equal(&cached->key, &key) ||
+		pg_atomic_read_u32(&rpc->entries[cached->slot].generation) != cached->generation)
+	{
+		cached->key = key;
+		cached->slot = relation_perf_assign_slot(&key, &cached->generation);
+		cached->valid = true;
+	}
+
+	entry = &rpc->entries[cached->slot];
+	if (pg_atomic_read_u32(&entry->usage) < RELATION_PERF_MAX_USAGE)
+		pg_atomic_fetch_add_u32(&entry->usage, 1);
+	inc_atomic_iohist(&entry->getpage_hist, latency);
 }
 
 /*
@@ -86,7 +446,11 @@ inc_getpage_wait(uint64 latency)
 void
 inc_page_cache_read_wait(uint64 latency)
 {
-	inc_iohist(&MyNeonCounters->file_cache_read_hist, latency);
+	neon_per_backend_counters *counters = MyNeonCounters;
+
+	NEON_PERF_COUNTERS_BEGIN_WRITE(counters);
+	inc_iohist(&counters->file_cache_read_hist, latency);
+	NEON_PERF_COUNTERS_END_WRITE(counters);
 }
 
 /*
@@ -95,7 +459,35 @@ inc_page_cache_read_wait(uint64 latency)
 void
 inc_page_cache_write_wait(uint64 latency)
 {
-	inc_iohist(&MyNeonCounters->file_cache_write_hist, latency);
+	neon_per_backend_counters *counters = MyNeonCounters;
+
+	NEON_PERF_COUNTERS_BEGIN_WRITE(counters);
+	inc_iohist(&counters->file_cache_write_hist, latency);
+	NEON_PERF_COUNTERS_END_WRITE(counters);
+}
+
+/*
+ * Get a consistent copy of the counters of one backend. Retries while the
+ * backend is updating them, like pgstat_read_current_status().
+ */
+static void
+neon_perf_counters_read_slot(int procno, neon_per_backend_counters *copy)
+{
+	neon_per_backend_counters *counters = NeonPerfCountersSlot(procno);
+
+	for (;;)
+	{
+		uint32		before = counters->changecount;
+
+		pg_read_barrier();
+		memcpy(copy, counters, sizeof(neon_per_backend_counters));
+		pg_read_barrier();
+
+		if (before == counters->changecount && (before & 1) == 0)
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+	}
 }
 
 /*
@@ -120,6 +512,7 @@ histogram_to_metrics(IOHistogram histogram,
 {
 	int		i = 0;
 	uint64	bucket_accum = 0;
+	int		fine_bucketno = 0;
 
 	metrics[i].name = count;
 	metrics[i].is_bucket = false;
@@ -133,11 +526,32 @@ histogram_to_metrics(IOHistogram histogram,
 	{
 		uint64		threshold = io_wait_bucket_thresholds[bucketno];
 
-		bucket_accum += histogram->wait_us_bucket[bucketno];
-
 		metrics[i].name = bucket;
 		metrics[i].is_bucket = true;
-		metrics[i].bucket_le = (threshold == UINT64_MAX) ? INFINITY : ((double) threshold) / 1000000.0;
+
+		if (threshold == UINT64_MAX)
+		{
+			while (fine_bucketno < IO_HIST_NUM_BUCKETS)
+				bucket_accum += histogram->wait_us_bucket[fine_bucketno++];
+			metrics[i].bucket_le = INFINITY;
+		}
+		else
+		{
+			/*
+			 * Sum up the fine buckets that lie entirely below the threshold.
+			 * Not all thresholds fall on fine bucket boundaries, so the
+			 * exported bound is the upper edge of the last bucket included,
+			 * which can be slightly below the threshold. That keeps the
+			 * counts exact: no wait longer than the bound is counted in it.
+			 */
+			while (fine_bucketno < IO_HIST_OVERFLOW_BUCKET &&
+				   io_hist_bucket_lower(fine_bucketno + 1) <= threshold)
+			{
+				bucket_accum += histogram->wait_us_bucket[fine_bucketno];
+				fine_bucketno++;
+			}
+			metrics[i].bucket_le = ((double) io_hist_bucket_lower(fine_bucketno)) / 1000000.0;
+		}
 		metrics[i].value = (double) bucket_accum;
 		i++;
 	}
@@ -148,7 +562,7 @@ histogram_to_metrics(IOHistogram histogram,
 static metric_t *
 neon_perf_counters_to_metrics(neon_per_backend_counters *counters)
 {
-#define NUM_METRICS ((2 + NUM_IO_WAIT_BUCKETS) * 3 + 10)
+#define NUM_METRICS ((2 + NUM_IO_WAIT_BUCKETS) * 3 + 14)
 	metric_t   *metrics = palloc((NUM_METRICS + 1) * sizeof(metric_t));
 	int			i = 0;
 
@@ -168,13 +582,17 @@ neon_perf_counters_to_metrics(neon_per_backend_counters *counters)
 	APPEND_METRIC(getpage_sync_requests_total);
 	APPEND_METRIC(getpage_prefetch_misses_total);
 	APPEND_METRIC(getpage_prefetch_discards_total);
+	APPEND_METRIC(getpage_prefetch_throttled_total);
 	APPEND_METRIC(pageserver_requests_sent_total);
 	APPEND_METRIC(pageserver_disconnects_total);
 	APPEND_METRIC(pageserver_send_flushes_total);
+	APPEND_METRIC(pageserver_received_bytes_total);
 	APPEND_METRIC(pageserver_open_requests);
 	APPEND_METRIC(getpage_prefetches_buffered);
 
 	APPEND_METRIC(file_cache_hits_total);
+	APPEND_METRIC(file_cache_prewarm_pages_total);
+	APPEND_METRIC(file_cache_prewarm_pages_remaining);
 
 	i += histogram_to_metrics(&counters->file_cache_read_hist, &metrics[i],
 							  "file_cache_read_wait_seconds_count",
@@ -234,8 +652,11 @@ neon_get_backend_perf_counters(PG_FUNCTION_ARGS)
 	{
 		PGPROC	   *proc = GetPGProcByNumber(procno);
 		int			pid = proc->pid;
-		neon_per_backend_counters *counters = &neon_per_backend_counters_shared[procno];
-		metric_t   *metrics = neon_perf_counters_to_metrics(counters);
+		neon_per_backend_counters counters;
+		metric_t   *metrics;
+
+		neon_perf_counters_read_slot(procno, &counters);
+		metrics = neon_perf_counters_to_metrics(&counters);
 
 		values[0] = Int32GetDatum(procno);
 		nulls[0] = false;
@@ -254,13 +675,39 @@ neon_get_backend_perf_counters(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
-static inline void
-histogram_merge_into(IOHistogram into, IOHistogram from)
+/*
+ * Aggregate the counters across all backends
+ */
+static void
+neon_perf_counters_totals(neon_per_backend_counters *totals)
 {
-	into->wait_us_count += from->wait_us_count;
-	into->wait_us_sum += from->wait_us_sum;
-	for (int bucketno = 0; bucketno < NUM_IO_WAIT_BUCKETS; bucketno++)
-		into->wait_us_bucket[bucketno] += from->wait_us_bucket[bucketno];
+	memset(totals, 0, sizeof(neon_per_backend_counters));
+
+	for (int procno = 0; procno < NUM_NEON_PERF_COUNTER_SLOTS; procno++)
+	{
+		neon_per_backend_counters copy;
+		neon_per_backend_counters *counters = &copy;
+
+		neon_perf_counters_read_slot(procno, &copy);
+
+		histogram_merge_into(&totals->getpage_hist, &counters->getpage_hist);
+		totals->getpage_prefetch_requests_total += counters->getpage_prefetch_requests_total;
+		totals->getpage_sync_requests_total += counters->getpage_sync_requests_total;
+		totals->getpage_prefetch_misses_total += counters->getpage_prefetch_misses_total;
+		totals->getpage_prefetch_discards_total += counters->getpage_prefetch_discards_total;
+		totals->getpage_prefetch_throttled_total += counters->getpage_prefetch_throttled_total;
+		totals->pageserver_requests_sent_total += counters->pageserver_requests_sent_total;
+		totals->pageserver_disconnects_total += counters->pageserver_disconnects_total;
+		totals->pageserver_send_flushes_total += counters->pageserver_send_flushes_total;
+		totals->pageserver_received_bytes_total += counters->pageserver_received_bytes_total;
+		totals->pageserver_open_requests += counters->pageserver_open_requests;
+		totals->getpage_prefetches_buffered += counters->getpage_prefetches_buffered;
+		totals->file_cache_hits_total += counters->file_cache_hits_total;
+		totals->file_cache_prewarm_pages_total += counters->file_cache_prewarm_pages_total;
+		totals->file_cache_prewarm_pages_remaining += counters->file_cache_prewarm_pages_remaining;
+		histogram_merge_into(&totals->file_cache_read_hist, &counters->file_cache_read_hist);
+		histogram_merge_into(&totals->file_cache_write_hist, &counters->file_cache_write_hist);
+	}
 }
 
 PG_FUNCTION_INFO_V1(neon_get_perf_counters);
@@ -270,31 +717,13 @@ neon_get_perf_counters(PG_FUNCTION_ARGS)
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	Datum		values[3];
 	bool		nulls[3];
-	neon_per_backend_counters totals = {0};
+	neon_per_backend_counters totals;
 	metric_t   *metrics;
 
 	/* We put all the tuples into a tuplestore in one go. */
 	InitMaterializedSRF(fcinfo, 0);
 
-	/* Aggregate the counters across all backends */
-	for (int procno = 0; procno < NUM_NEON_PERF_COUNTER_SLOTS; procno++)
-	{
-		neon_per_backend_counters *counters = &neon_per_backend_counters_shared[procno];
-
-		histogram_merge_into(&totals.getpage_hist, &counters->getpage_hist);
-		totals.getpage_prefetch_requests_total += counters->getpage_prefetch_requests_total;
-		totals.getpage_sync_requests_total += counters->getpage_sync_requests_total;
-		totals.getpage_prefetch_misses_total += counters->getpage_prefetch_misses_total;
-		totals.getpage_prefetch_discards_total += counters->getpage_prefetch_discards_total;
-		totals.pageserver_requests_sent_total += counters->pageserver_requests_sent_total;
-		totals.pageserver_disconnects_total += counters->pageserver_disconnects_total;
-		totals.pageserver_send_flushes_total += counters->pageserver_send_flushes_total;
-		totals.pageserver_open_requests += counters->pageserver_open_requests;
-		totals.getpage_prefetches_buffered += counters->getpage_prefetches_buffered;
-		totals.file_cache_hits_total += counters->file_cache_hits_total;
-		histogram_merge_into(&totals.file_cache_read_hist, &counters->file_cache_read_hist);
-		histogram_merge_into(&totals.file_cache_write_hist, &counters->file_cache_write_hist);
-	}
+	neon_perf_counters_totals(&totals);
 
 	metrics = neon_perf_counters_to_metrics(&totals);
 	for (int i = 0; metrics[i].name != NULL; i++)
@@ -306,3 +735,118 @@ neon_get_perf_counters(PG_FUNCTION_ARGS)
 
 	return (Datum) 0;
 }
+
+static void
+histogram_percentiles_to_tuple(ReturnSetInfo *rsinfo, const char *name,
+							   IOHistogram hist)
+{
+	static const double percentiles[] = {50, 90, 99, 99.9};
+	Datum		values[2 + lengthof(percentiles)];
+	bool		nulls[2 + lengthof(percentiles)];
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(name);
+	values[1] = Int64GetDatum((int64) hist->wait_us_count);
+	for (int i = 0; i < lengthof(percentiles); i++)
+	{
+		double		value;
+
+		if (io_histogram_percentile(hist, percentiles[i], &value))
+			values[2 + i] = Float8GetDatum(value);
+		else
+			nulls[2 + i] = true;
+	}
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+/*
+ * Percentiles of the wait time histograms, across all backends, in seconds.
+ */
+PG_FUNCTION_INFO_V1(neon_get_perf_counter_percentiles);
+Datum
+neon_get_perf_counter_percentiles(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	neon_per_backend_counters totals;
+
+	/* We put all the tuples into a tuplestore in one go. */
+	InitMaterializedSRF(fcinfo, 0);
+
+	neon_perf_counters_totals(&totals);
+
+	histogram_percentiles_to_tuple(rsinfo, "getpage_wait_seconds",
+								   &totals.getpage_hist);
+	histogram_percentiles_to_tuple(rsinfo, "file_cache_read_wait_seconds",
+								   &totals.file_cache_read_hist);
+	histogram_percentiles_to_tuple(rsinfo, "file_cache_write_wait_seconds",
+								   &totals.file_cache_write_hist);
+
+	return (Datum) 0;
+}
+
+/*
+ * Emit the GetPage wait histogram of one relation, or the overflow histogram
+ * if 'key' is NULL.
+ */
+static void
+relation_perf_counters_to_tuples(ReturnSetInfo *rsinfo, RelationPerfKey *key,
+								 IOHistogram hist)
+{
+	Datum		values[7];
+	bool		nulls[7];
+	metric_t	metrics[2 + NUM_IO_WAIT_BUCKETS];
+	int			nmetrics;
+
+	memset(nulls, 0, sizeof(nulls));
+	if (key)
+	{
+		values[0] = ObjectIdGetDatum(key->spcoid);
+		values[1] = ObjectIdGetDatum(key->dboid);
+		values[2] = ObjectIdGetDatum(key->relnumber);
+		values[3] = Int32GetDatum(key->forknum);
+	}
+	else
+	{
+		nulls[0] = nulls[1] = nulls[2] = nulls[3] = true;
+	}
+
+	nmetrics = histogram_to_metrics(hist, metrics,
+									"getpage_wait_seconds_count",
+									"getpage_wait_seconds_sum",
+									"getpage_wait_seconds_bucket");
+	for (int i = 0; i < nmetrics; i++)
+	{
+		metric_to_datums(&metrics[i], &values[4], &nulls[4]);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+}
+
+PG_FUNCTION_INFO_V1(neon_get_relation_perf_counters);
+Datum
+neon_get_relation_perf_counters(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	RelationPerfCounters *rpc = relation_perf_counters_shared;
+	IOHistogramData hist;
+
+	/* We put all the tuples into a tuplestore in one go. */
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(relation_perf_lock, LW_SHARED);
+	for (int i = 0; i < NUM_RELATION_PERF_COUNTERS; i++)
+	{
+		RelationPerfEntry *entry = &rpc->entries[i];
+
+		if (!entry->in_use)
+			continue;
+
+		atomic_iohist_read(&entry->getpage_hist, &hist);
+		relation_perf_counters_to_tuples(rsinfo, &entry->key, &hist);
+	}
+	LWLockRelease(relation_perf_lock);
+
+	atomic_iohist_read(&rpc->overflow, &hist);
+	relation_perf_counters_to_tuples(rsinfo, NULL, &hist);
+
+	return (Datum) 0;
+}
@@ -15,6 +15,17 @@
 #include "storage/proc.h"
 #endif
 
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+
+#include "neon_pgversioncompat.h"
+
+/*
+ * Bucket thresholds of the histograms exported as Prometheus metrics. These
+ * are coarse, to keep the number of series down; the buckets are derived
+ * from the finer histograms below. Where a threshold falls inside a fine
+ * bucket, the exported bound is rounded down to that bucket's lower edge.
+ */
 static const uint64 io_wait_bucket_thresholds[] = {
 	       2,        3,        6,        10,  /* 0 us   - 10 us */
 	      20,       30,       60,       100,  /* 10 us  - 100 us */
@@ -27,17 +38,134 @@ static const uint64 io_wait_bucket_thresholds[] = {
 };
 #define NUM_IO_WAIT_BUCKETS (lengthof(io_wait_bucket_thresholds))
 
+/*
+ * Wait times are counted in log-linear histograms, like HdrHistogram: values
+ * below 2^IO_HIST_SUB_BUCKET_BITS microseconds have a bucket each, and every
+ * power of two above that is split into 2^IO_HIST_SUB_BUCKET_BITS equal
+ * buckets. So the relative error of a percentile computed from the histogram
+ * is below 1 / 2^IO_HIST_SUB_BUCKET_BITS.
+ *
+ * IO_HIST_SIGNIFICANT_FIGURES sets the precision, with the same meaning as
+ * in HdrHistogram. It's a compile-time constant, because the histograms live
+ * in shared memory, and each extra figure makes them 8 times larger.
+ */
+#define IO_HIST_SIGNIFICANT_FIGURES 1
+
+#if IO_HIST_SIGNIFICANT_FIGURES == 1
+#define IO_HIST_SUB_BUCKET_BITS 4
+#elif IO_HIST_SIGNIFICANT_FIGURES == 2
+#define IO_HIST_SUB_BUCKET_BITS 7
+#elif IO_HIST_SIGNIFICANT_FIGURES == 3
+#define IO_HIST_SUB_BUCKET_BITS 10
+#else
+#error "IO_HIST_SIGNIFICANT_FIGURES must be 1, 2 or 3"
+#endif
+
+/*
+ * Waits of 2^IO_HIST_MAX_BITS us (about 16 s) or more all go to the overflow
+ * bucket, which comes after the regular buckets. Its lower bound is
+ * 2^IO_HIST_MAX_BITS, but nothing is known about the values in it beyond
+ * that.
+ */
+#define IO_HIST_MAX_BITS 24
+#define IO_HIST_OVERFLOW_BUCKET \
+	((IO_HIST_MAX_BITS - IO_HIST_SUB_BUCKET_BITS + 1) << IO_HIST_SUB_BUCKET_BITS)
+#define IO_HIST_NUM_BUCKETS (IO_HIST_OVERFLOW_BUCKET + 1)
+
 typedef struct IOHistogramData
 {
 	uint64		wait_us_count;
 	uint64		wait_us_sum;
-	uint64		wait_us_bucket[NUM_IO_WAIT_BUCKETS];
+	uint64		wait_us_bucket[IO_HIST_NUM_BUCKETS];
 } IOHistogramData;
 
 typedef IOHistogramData *IOHistogram;
 
+static inline int
+io_hist_bucket(uint64 latency_us)
+{
+	int			msb;
+	int			shift;
+
+	if (latency_us < (UINT64CONST(1) << IO_HIST_SUB_BUCKET_BITS))
+		return (int) latency_us;
+
+	msb = pg_leftmost_one_pos64(latency_us);
+	if (msb >= IO_HIST_MAX_BITS)
+		return IO_HIST_OVERFLOW_BUCKET;
+
+	shift = msb - IO_HIST_SUB_BUCKET_BITS;
+	return ((shift + 1) << IO_HIST_SUB_BUCKET_BITS) +
+		(int) ((latency_us >> shift) - (UINT64CONST(1) << IO_HIST_SUB_BUCKET_BITS));
+}
+
+/* Smallest value that falls into the given bucket */
+static inline uint64
+io_hist_bucket_lower(int bucketno)
+{
+	int			group = bucketno >> IO_HIST_SUB_BUCKET_BITS;
+
+	if (group == 0)
+		return (uint64) bucketno;
+
+	return ((uint64) bucketno - ((uint64) (group - 1) << IO_HIST_SUB_BUCKET_BITS))
+		<< (group - 1);
+}
+
 typedef struct
 {
+	/*
+	 * Incremented before and after every update of the counters, so it's odd
+	 * while the backend is updating them. Readers use it to get a consistent
+	 * copy, like with PgBackendStatus.st_changecount. Use the
+	 * NEON_PERF_COUNTER_* macros to update the counters.
+	 */
+	uint32		changecount;
+
+	/*
+	 * The counters that are updated on every read come first, so that they
+	 * share the slot's first cache line with the changecount.
+	 */
+
+	/*
+	 * Total number of speculative prefetch Getpage requests and synchronous
+	 * GetPage requests sent.
+	 */
+	uint64		getpage_prefetch_requests_total;
+	uint64		getpage_sync_requests_total;
+
+	/*
+	 * Total number of requests send to pageserver. (prefetch_requests_total
+	 * and sync_request_total count only GetPage requests, this counts all
+	 * request types.)
+	 */
+	uint64		pageserver_requests_sent_total;
+
+	/*
+	 * Total size of the responses received from the pageserver, in bytes.
+	 */
+	uint64		pageserver_received_bytes_total;
+
+	/*
+	 * Number of open requests to PageServer.
+	 */
+	uint64		pageserver_open_requests;
+
+	/*
+	 * Number of unused prefetches currently cached in this backend.
+	 */
+	uint64		getpage_prefetches_buffered;
+
+	/*
+	 * Number of requests satisfied from the LFC.
+	 *
+	 * This is redundant with the server-wide file_cache_hits, but this gives
+	 * per-backend granularity, and it's handy to have this in the same place
+	 * as counters for requests that went to the pageserver. Maybe move all
+	 * the LFC stats to this struct in the future?
+	 */
+	uint64		file_cache_hits_total;
+
 	/*
 	 * Histogram for how long an smgrread() request needs to wait for response
 	 * from pageserver. When prefetching is effective, these wait times can be
@@ -50,13 +178,6 @@ typedef struct
 	 */
 	IOHistogramData getpage_hist;
 
-	/*
-	 * Total number of speculative prefetch Getpage requests and synchronous
-	 * GetPage requests sent.
-	 */
-	uint64		getpage_prefetch_requests_total;
-	uint64		getpage_sync_requests_total;
-
 	/*
 	 * Total number of readahead misses; consisting of either prefetches that
 	 * don't satisfy the LSN bounds, or cases where no readahead was issued
@@ -72,11 +193,10 @@ typedef struct
 	uint64		getpage_prefetch_discards_total;
 
 	/*
-	 * Total number of requests send to pageserver. (prefetch_requests_total
-	 * and sync_request_total count only GetPage requests, this counts all
-	 * request types.)
+	 * Number of prefetch requests that were not issued, because the global
+	 * neon.prefetch_buffer_budget was exhausted.
 	 */
-	uint64		pageserver_requests_sent_total;
+	uint64		getpage_prefetch_throttled_total;
 
 	/*
 	 * Number of times the connection to the pageserver was lost and the
@@ -91,34 +211,34 @@ typedef struct
 	 * this can be smaller than pageserver_requests_sent_total.
 	 */
 	uint64		pageserver_send_flushes_total;
-	
-	/*
-	 * Number of open requests to PageServer.
-	 */
-	uint64		pageserver_open_requests;
 
 	/*
-	 * Number of unused prefetches currently cached in this backend.
+	 * Pages loaded into the LFC by neon_prewarm_lfc(), and the number of
+	 * pages of the relation fork that it's working on that are still to be
+	 * looked at.
 	 */
-	uint64		getpage_prefetches_buffered;
-
-	/*
-	 * Number of requests satisfied from the LFC.
-	 *
-	 * This is redundant with the server-wide file_cache_hits, but this gives
-	 * per-backend granularity, and it's handy to have this in the same place
-	 * as counters for requests that went to the pageserver. Maybe move all
-	 * the LFC stats to this struct in the future?
-	 */
-	uint64		file_cache_hits_total;
+	uint64		file_cache_prewarm_pages_total;
+	uint64		file_cache_prewarm_pages_remaining;
 
 	/* LFC I/O time buckets */
 	IOHistogramData file_cache_read_hist;
 	IOHistogramData file_cache_write_hist;
 } neon_per_backend_counters;
 
-/* Pointer to the shared memory array of neon_per_backend_counters structs */
-extern neon_per_backend_counters *neon_per_backend_counters_shared;
+/*
+ * The counters of each backend are padded to a multiple of the cache line
+ * size, so that backends updating their own counters don't cause false
+ * sharing with their neighbours. (Shared memory allocations are cache line
+ * aligned, so each slot starts at a cache line boundary.)
+ */
+typedef union
+{
+	neon_per_backend_counters counters;
+	char		pad[TYPEALIGN(PG_CACHE_LINE_SIZE, sizeof(neon_per_backend_counters))];
+} neon_per_backend_counters_slot;
+
+/* Pointer to the shared memory array of neon_per_backend_counters slots */
+extern neon_per_backend_counters_slot *neon_per_backend_counters_shared;
 
 /*
  * Size of the perf counters array in shared memory. One slot for each backend
@@ -128,18 +248,76 @@ extern neon_per_backend_counters *neon_per_backend_counters_shared;
  */
 #define NUM_NEON_PERF_COUNTER_SLOTS (MaxBackends + NUM_AUXILIARY_PROCS)
 
+#define NeonPerfCountersSlot(procno) (&neon_per_backend_counters_shared[(procno)].counters)
+
 #if PG_VERSION_NUM >= 170000
-#define MyNeonCounters (&neon_per_backend_counters_shared[MyProcNumber])
+#define MyNeonCounters NeonPerfCountersSlot(MyProcNumber)
 #else
-#define MyNeonCounters (&neon_per_backend_counters_shared[MyProc->pgprocno])
+#define MyNeonCounters NeonPerfCountersSlot(MyProc->pgprocno)
 #endif
 
-extern void inc_getpage_wait(uint64 latency);
+/*
+ * Update this backend's counters. Only the owning backend writes to its
+ * slot, so no locking is needed; the changecount lets readers detect a
+ * concurrent update, including torn 64-bit values on platforms without
+ * atomic 8-byte stores. On x86, the barriers are just compiler barriers.
+ */
+#define NEON_PERF_COUNTERS_BEGIN_WRITE(c) \
+	do { \
+		(c)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define NEON_PERF_COUNTERS_END_WRITE(c) \
+	do { \
+		pg_write_barrier(); \
+		(c)->changecount++; \
+		Assert(((c)->changecount & 1) == 0); \
+	} while (0)
+
+#define NEON_PERF_COUNTER_ADD(field, n) \
+	do { \
+		neon_per_backend_counters *c_ = MyNeonCounters; \
+		NEON_PERF_COUNTERS_BEGIN_WRITE(c_); \
+		c_->field += (n); \
+		NEON_PERF_COUNTERS_END_WRITE(c_); \
+	} while (0)
+
+#define NEON_PERF_COUNTER_SUB(field, n) \
+	do { \
+		neon_per_backend_counters *c_ = MyNeonCounters; \
+		NEON_PERF_COUNTERS_BEGIN_WRITE(c_); \
+		c_->field -= (n); \
+		NEON_PERF_COUNTERS_END_WRITE(c_); \
+	} while (0)
+
+#define NEON_PERF_COUNTER_SET(field, value) \
+	do { \
+		neon_per_backend_counters *c_ = MyNeonCounters; \
+		NEON_PERF_COUNTERS_BEGIN_WRITE(c_); \
+		c_->field = (value); \
+		NEON_PERF_COUNTERS_END_WRITE(c_); \
+	} while (0)
+
+#define NEON_PERF_COUNTER_INC(field) NEON_PERF_COUNTER_ADD(field, 1)
+
+/*
+ * Number of relations that get their own GetPage wait histogram. Waits for
+ * other relations are counted in a shared overflow histogram. This is a
+ * compile-time constant so that the shared memory size doesn't depend on a
+ * GUC.
+ */
+#define NUM_RELATION_PERF_COUNTERS 128
+
+extern bool io_histogram_percentile(IOHistogram hist, double percentile, double *result);
+
+extern void inc_getpage_wait(NRelFileInfo rinfo, ForkNumber forknum, uint64 latency);
 extern void inc_page_cache_read_wait(uint64 latency);
 extern void inc_page_cache_write_wait(uint64 latency);
 
 extern Size NeonPerfCountersShmemSize(void);
 extern void NeonPerfCountersShmemInit(void);
+extern void NeonPerfCountersShmemRequest(void);
 
 
 #endif							/* NEON_PERF_COUNTERS_H */
@@ -0,0 +1,402 @@
+/*-------------------------------------------------------------------------
+ *
+ * neon_query_io.c
+ *	  Per-query accounting of pageserver I/O
+ *
+ * The executor hooks take a snapshot of the backend's perf counters before
+ * and after each ExecutorRun and ExecutorFinish call, and add the difference
+ * to a shared hash table entry keyed by (userid, dbid, queryid), like
+ * pg_stat_statements. The 'neon_stat_statements_io' view can be joined with
+ * pg_stat_statements to find the queries that spend the most time waiting
+ * for the pageserver.
+ *
+ * The accounting is inclusive: I/O performed by a nested statement is also
+ * counted in the statement that invoked it. Parallel workers add their own
+ * I/O to the same entry, as the query id is passed down to them. Queries
+ * without a query id (compute_query_id = off) are not tracked, and entries
+ * are only created for queries that did some pageserver or LFC I/O.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "catalog/pg_authid.h"
+#include "executor/executor.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+#include "neon.h"
+#include "neon_perf_counters.h"
+
+typedef struct
+{
+	Oid			userid;
+	Oid			dbid;
+	uint64		queryid;
+} QueryIOKey;
+
+/*
+ * Counters accumulated for one query. These are deltas of the corresponding
+ * fields in neon_per_backend_counters.
+ */
+typedef struct
+{
+	uint64		pageserver_requests;	/* round trips, all request types */
+	uint64		pageserver_received_bytes;
+	uint64		getpage_sync_requests;
+	uint64		getpage_prefetch_requests;
+	uint64		getpage_prefetch_misses;
+	uint64		getpage_prefetch_discards;
+	uint64		getpage_wait_us;	/* time blocked waiting for GetPage */
+	uint64		file_cache_hits;
+} QueryIOCounters;
+
+typedef struct
+{
+	QueryIOKey	key;
+	slock_t		mutex;			/* protects the counters */
+	QueryIOCounters counters;
+} QueryIOEntry;
+
+static HTAB *query_io_hash;
+static LWLockId query_io_lock;
+static int	query_io_max;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+
+#define DEFAULT_QUERY_IO_MAX 1000
+
+/* Percentage of entries to remove when the table is full, like pg_stat_statements */
+#define QUERY_IO_DEALLOC_PERCENT 5
+
+static void
+query_io_shmem_startup(void)
+{
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	query_io_lock = (LWLockId) GetNamedLWLockTranche("neon_query_io");
+	info.keysize = sizeof(QueryIOKey);
+	info.entrysize = sizeof(QueryIOEntry);
+	query_io_hash = ShmemInitHash("neon_query_io",
+								  query_io_max, query_io_max,
+								  &info,
+								  HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+query_io_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(hash_estimate_size(query_io_max, sizeof(QueryIOEntry)));
+	RequestNamedLWLockTranche("neon_query_io", 1);
+}
+#endif
+
+static inline bool
+query_io_active(QueryDesc *queryDesc)
+{
+	return query_io_hash != NULL && neon_per_backend_counters_shared != NULL &&
+		MyProc != NULL && queryDesc->plannedstmt->queryId != UINT64CONST(0);
+}
+
+static inline void
+query_io_snapshot(QueryIOCounters *c)
+{
+	neon_per_backend_counters *counters = MyNeonCounters;
+
+	c->pageserver_requests = counters->pageserver_requests_sent_total;
+	c->pageserver_received_bytes = counters->pageserver_received_bytes_total;
+	c->getpage_sync_requests = counters->getpage_sync_requests_total;
+	c->getpage_prefetch_requests = counters->getpage_prefetch_requests_total;
+	c->getpage_prefetch_misses = counters->getpage_prefetch_misses_total;
+	c->getpage_prefetch_discards = counters->getpage_prefetch_discards_total;
+	c->getpage_wait_us = counters->getpage_hist.wait_us_sum;
+	c->file_cache_hits = counters->file_cache_hits_total;
+}
+
+static int
+query_io_wait_cmp(const void *lhs, const void *rhs)
+{
+	uint64		l = (*(QueryIOEntry *const *) lhs)->counters.getpage_wait_us;
+	uint64		r = (*(QueryIOEntry *const *) rhs)->counters.getpage_wait_us;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Make room for new entries by removing the QUERY_IO_DEALLOC_PERCENT of
+ * entries that waited least for the pageserver, like entry_dealloc() in
+ * pg_stat_statements. Removing a batch at a time means that we don't need
+ * to scan the whole table for every new query once it's full. Caller must
+ * hold the lock in exclusive mode.
+ */
+static void
+query_io_evict(void)
+{
+	HASH_SEQ_STATUS status;
+	QueryIOEntry **entries;
+	QueryIOEntry *entry;
+	int			nentries = 0;
+	int			nvictims;
+
+	entries = palloc(hash_get_num_entries(query_io_hash) * sizeof(QueryIOEntry *));
+
+	hash_seq_init(&status, query_io_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		entries[nentries++] = entry;
+
+	/* The counters might be changing concurrently, this is just a heuristic */
+	qsort(entries, nentries, sizeof(QueryIOEntry *), query_io_wait_cmp);
+
+	nvictims = Max(10, nentries * QUERY_IO_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, nentries);
+
+	for (int i = 0; i < nvictims; i++)
+		hash_search(query_io_hash, &entries[i]->key, HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+static void
+query_io_accumulate(QueryDesc *queryDesc, QueryIOCounters *start)
+{
+	QueryIOCounters end;
+	QueryIOCounters delta;
+	QueryIOKey	key;
+	QueryIOEntry *entry;
+
+	query_io_snapshot(&end);
+	delta.pageserver_requests = end.pageserver_requests - start->pageserver_requests;
+	delta.pageserver_received_bytes = end.pageserver_received_bytes - start->pageserver_received_bytes;
+	delta.getpage_sync_requests = end.getpage_sync_requests - start->getpage_sync_requests;
+	delta.getpage_prefetch_requests = end.getpage_prefetch_requests - start->getpage_prefetch_requests;
+	delta.getpage_prefetch_misses = end.getpage_prefetch_misses - start->getpage_prefetch_misses;
+	delta.getpage_prefetch_discards = end.getpage_prefetch_discards - start->getpage_prefetch_discards;
+	delta.getpage_wait_us = end.getpage_wait_us - start->getpage_wait_us;
+	delta.file_cache_hits = end.file_cache_hits - start->file_cache_hits;
+
+	/* Don't bother with queries that didn't read anything from storage */
+	if (delta.pageserver_requests == 0 && delta.file_cache_hits == 0 &&
+		delta.getpage_prefetch_discards == 0)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.userid = GetUserId();
+	key.dbid = MyDatabaseId;
+	key.queryid = queryDesc->plannedstmt->queryId;
+
+	LWLockAcquire(query_io_lock, LW_SHARED);
+	entry = hash_search(query_io_hash, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		/* Need exclusive lock to make a new entry */
+		LWLockRelease(query_io_lock);
+		LWLockAcquire(query_io_lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(query_io_hash) >= query_io_max &&
+			hash_search(query_io_hash, &key, HASH_FIND, NULL) == NULL)
+			query_io_evict();
+
+		entry = hash_search(query_io_hash, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			LWLockRelease(query_io_lock);
+			return;
+		}
+		if (!found)
+		{
+			memset(&entry->counters, 0, sizeof(entry->counters));
+			SpinLockInit(&entry->mutex);
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->counters.pageserver_requests += delta.pageserver_requests;
+	entry->counters.pageserver_received_bytes += delta.pageserver_received_bytes;
+	entry->counters.getpage_sync_requests += delta.getpage_sync_requests;
+	entry->counters.getpage_prefetch_requests += delta.getpage_prefetch_requests;
+	entry->counters.getpage_prefetch_misses += delta.getpage_prefetch_misses;
+	entry->counters.getpage_prefetch_discards += delta.getpage_prefetch_discards;
+	entry->counters.getpage_wait_us += delta.getpage_wait_us;
+	entry->counters.file_cache_hits += delta.file_cache_hits;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(query_io_lock);
+}
+
+static void
+query_io_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					 uint64 count, bool execute_once)
+{
+	QueryIOCounters start;
+	bool		active = query_io_active(queryDesc);
+
+	if (active)
+		query_io_snapshot(&start);
+
+	if (prev_ExecutorRun)
+		prev_ExecutorRun(queryDesc, direction, count, execute_once);
+	else
+		standard_ExecutorRun(queryDesc, direction, count, execute_once);
+
+	if (active)
+		query_io_accumulate(queryDesc, &start);
+}
+
+static void
+query_io_ExecutorFinish(QueryDesc *queryDesc)
+{
+	QueryIOCounters start;
+	bool		active = query_io_active(queryDesc);
+
+	if (active)
+		query_io_snapshot(&start);
+
+	if (prev_ExecutorFinish)
+		prev_ExecutorFinish(queryDesc);
+	else
+		standard_ExecutorFinish(queryDesc);
+
+	if (active)
+		query_io_accumulate(queryDesc, &start);
+}
+
+void
+pg_init_query_io(void)
+{
+	DefineCustomIntVariable("neon.query_io_max",
+							"Sets the maximum number of queries tracked in neon_stat_statements_io",
+							NULL,
+							&query_io_max,
+							DEFAULT_QUERY_IO_MAX,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	if (query_io_max > 0)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = query_io_shmem_request;
+#else
+		RequestAddinShmemSpace(hash_estimate_size(query_io_max, sizeof(QueryIOEntry)));
+		RequestNamedLWLockTranche("neon_query_io", 1);
+#endif
+
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = query_io_shmem_startup;
+
+		prev_ExecutorRun = ExecutorRun_hook;
+		ExecutorRun_hook = query_io_ExecutorRun;
+		prev_ExecutorFinish = ExecutorFinish_hook;
+		ExecutorFinish_hook = query_io_ExecutorFinish;
+	}
+}
+
+#define NUM_QUERY_IO_COLS 11
+
+PG_FUNCTION_INFO_V1(neon_get_query_io);
+Datum
+neon_get_query_io(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum		values[NUM_QUERY_IO_COLS];
+	bool		nulls[NUM_QUERY_IO_COLS];
+	HASH_SEQ_STATUS status;
+	QueryIOEntry *entry;
+	Oid			userid = GetUserId();
+	bool		is_allowed_role;
+
+	/* We put all the tuples into a tuplestore in one go. */
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (query_io_hash == NULL)
+		return (Datum) 0;
+
+	/* Like pg_stat_statements, only superusers and pg_read_all_stats see all users' queries */
+	is_allowed_role = has_privs_of_role(userid, ROLE_PG_READ_ALL_STATS);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	LWLockAcquire(query_io_lock, LW_SHARED);
+	hash_seq_init(&status, query_io_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		QueryIOCounters c;
+		int			col = 0;
+
+		if (!is_allowed_role && entry->key.userid != userid)
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		c = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		values[col++] = ObjectIdGetDatum(entry->key.userid);
+		values[col++] = ObjectIdGetDatum(entry->key.dbid);
+		values[col++] = Int64GetDatum((int64) entry->key.queryid);
+		values[col++] = Int64GetDatum((int64) c.pageserver_requests);
+		values[col++] = Int64GetDatum((int64) c.pageserver_received_bytes);
+		values[col++] = Int64GetDatum((int64) c.getpage_sync_requests);
+		values[col++] = Int64GetDatum((int64) c.getpage_prefetch_requests);
+		values[col++] = Int64GetDatum((int64) c.getpage_prefetch_misses);
+		values[col++] = Int64GetDatum((int64) c.getpage_prefetch_discards);
+		values[col++] = Float8GetDatum((double) c.getpage_wait_us / 1000000.0);
+		values[col++] = Int64GetDatum((int64) c.file_cache_hits);
+		Assert(col == NUM_QUERY_IO_COLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	LWLockRelease(query_io_lock);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(neon_reset_query_io);
+Datum
+neon_reset_query_io(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	QueryIOEntry *entry;
+
+	if (query_io_hash == NULL)
+		PG_RETURN_VOID();
+
+	LWLockAcquire(query_io_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, query_io_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(query_io_hash, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(query_io_lock);
+
+	PG_RETURN_VOID();
+}
@@ -18,6 +18,7 @@
 #include RELFILEINFO_HDR
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
+#include "port/pg_iovec.h"
 #include "storage/block.h"
 #include "storage/buf_internals.h"
 #include "storage/smgr.h"
@@ -229,6 +230,12 @@ extern page_server_api *page_server;
 extern char *page_server_connstring;
 extern int	flush_every_n_requests;
 extern int	readahead_buffer_size;
+extern int	abandoned_request_timeout;
+extern int	prefetch_buffer_budget;
+extern bool unlogged_build_populate_lfc;
+extern bool replica_lfc_redo;
+extern bool local_fsm;
+extern int	local_fsm_sync_distance;
 extern char *neon_timeline;
 extern char *neon_tenant;
 extern int32 max_cluster_size;
@@ -239,6 +246,10 @@ extern shardno_t get_shard_number(BufferTag* tag);
 extern const f_smgr *smgr_neon(ProcNumber backend, NRelFileInfo rinfo);
 extern void smgr_init_neon(void);
 extern void readahead_buffer_resize(int newsize, void *extra);
+extern Size PrefetchShmemSize(void);
+extern void PrefetchShmemInit(void);
+extern void LocalFsmShmemInit(void);
+extern void LocalFsmShmemRequest(void);
 
 /*
  * LSN values associated with each request to the pageserver
@@ -279,7 +290,10 @@ extern PGDLLEXPORT void neon_read_at_lsn(NRelFileInfo rnode, ForkNumber forkNum,
 extern PGDLLEXPORT void neon_read_at_lsn(NRelFileInfo rnode, ForkNumber forkNum, BlockNumber blkno,
 										 neon_request_lsns request_lsns, void *buffer);
 #endif
+extern BlockNumber neon_prewarm_fork(SMgrRelation reln, ForkNumber forknum);
 extern int64 neon_dbsize(Oid dbNode);
+extern void neon_read_slru_segments(SlruKind kind, int nsegs, const int *segnos,
+								   char **buffers, int *n_blocks);
 
 /* utils for neon relsize cache */
 extern void relsize_hash_init(void);
@@ -287,6 +301,8 @@ extern bool get_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum, BlockNumb
 extern void set_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber size);
 extern void update_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber size);
 extern void forget_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum);
+extern bool get_cached_relexists(NRelFileInfo rinfo, ForkNumber forknum, bool *exists);
+extern void set_cached_relsize_absent(NRelFileInfo rinfo, ForkNumber forknum);
 
 /* functions for local file cache */
 extern void lfc_writev(NRelFileInfo rinfo, ForkNumber forkNum,
@@ -301,7 +317,15 @@ extern bool lfc_cache_contains(NRelFileInfo rinfo, ForkNumber forkNum,
 							   BlockNumber blkno);
 extern int lfc_cache_containsv(NRelFileInfo rinfo, ForkNumber forkNum,
 							   BlockNumber blkno, int nblocks, bits8 *bitmap);
+extern int lfc_prefetchv(NRelFileInfo rinfo, ForkNumber forkNum,
+						 BlockNumber blkno, int nblocks, bits8 *bitmap);
+extern int lfc_prewarmv(NRelFileInfo rinfo, ForkNumber forkNum,
+						BlockNumber blkno, const void *const *buffers,
+						BlockNumber nblocks, const XLogRecPtr *lsns);
 extern void lfc_evict(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno);
+extern void lfc_invalidate(NRelFileInfo rinfo, ForkNumber forkNum,
+						   BlockNumber from_blkno, BlockNumber nblocks);
+extern bool lfc_maybe_disabled(void);
 extern void lfc_init(void);
 
 static inline bool
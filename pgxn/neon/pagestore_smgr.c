@@ -45,7 +45,10 @@
  */
 #include "postgres.h"
 
+#include "access/heapam_xlog.h"
+#include "access/nbtxlog.h"
 #include "access/parallel.h"
+#include "access/rmgr.h"
 #include "access/xact.h"
 #include "access/xlog.h"
 #include "access/xlogdefs.h"
@@ -58,14 +61,19 @@
 #include "pgstat.h"
 #include "postmaster/autovacuum.h"
 #include "postmaster/interrupt.h"
+#include "port/atomics.h"
 #include "port/pg_iovec.h"
 #include "replication/walsender.h"
 #include "storage/bufmgr.h"
 #include "storage/buf_internals.h"
 #include "storage/fsm_internals.h"
+#include "storage/ipc.h"
 #include "storage/md.h"
+#include "storage/shmem.h"
 #include "storage/smgr.h"
+#include "utils/timestamp.h"
 
+#include "neon_flight_recorder.h"
 #include "neon_perf_counters.h"
 #include "pagestore_client.h"
 #include "bitmap.h"
@@ -147,11 +155,10 @@ static uint32 local_request_counter;
  * smgr_read, all prefetch responses in the pipeline will need to be read from
  * the connection; the responses are stored for later use.
  *
- * NOTE: The current implementation of the prefetch system implements a ring
- * buffer of up to readahead_buffer_size requests. If there are more _read and
- * _prefetch requests between the initial _prefetch and the _read of a buffer,
- * the prefetch request will have been dropped from this prefetch buffer, and
- * your prefetch was wasted.
+ * NOTE: The prefetch buffer holds up to readahead_buffer_size requests and
+ * responses. If there are more _read and _prefetch requests between the
+ * initial _prefetch and the _read of a buffer, the oldest response is dropped
+ * from the buffer to make room, and that prefetch was wasted.
  */
 
 /*
@@ -160,12 +167,14 @@ static uint32 local_request_counter;
  * not in hash : in hash
  *             :
  * UNUSED ------> REQUESTED --> RECEIVED
- *   ^         :      |            |
- *   |         :      v            |
- *   |         : TAG_UNUSED        |
- *   |         :      |            |
- *   +----------------+------------+
+ *   ^         :                   |
+ *   |         :                   |
+ *   +-----------------------------+
  *             :
+ *
+ * A slot is on exactly one of the lists of PrefetchState: UNUSED slots are
+ * on the free list, REQUESTED slots on the in-flight list, and RECEIVED
+ * slots on the received list.
  */
 typedef enum PrefetchStatus
 {
@@ -174,16 +183,22 @@ typedef enum PrefetchStatus
 								 * PS, but not necessarily flushed. all fields
 								 * except response valid */
 	PRFS_RECEIVED,				/* all fields valid */
-	PRFS_TAG_REMAINS,			/* only buftag and my_ring_index are still
-								 * valid */
 } PrefetchStatus;
 
-/* must fit in uint8; bits 0x1 are used */
+/* must fit in uint8; bits 0x7 are used */
 typedef enum {
 	PRFSF_NONE	= 0x0,
 	PRFSF_SEQ	= 0x1,
+	PRFSF_PREFETCH = 0x2,		/* speculative request, for the flight recorder */
+	PRFSF_ABANDONED = 0x4,		/* response of a cancelled request, to be
+								 * discarded; see prefetch_abandon_request() */
 } PrefetchRequestFlags;
 
+/* index of a slot in prf_buffer, or PRF_NONE */
+typedef int PrfSlotNo;
+
+#define PRF_NONE	(-1)
+
 typedef struct PrefetchRequest
 {
 	BufferTag	buftag;			/* must be first entry in the struct */
@@ -193,9 +208,18 @@ typedef struct PrefetchRequest
 	neon_request_lsns request_lsns;
 	NeonRequestId reqid;
 	NeonResponse *response;		/* may be null */
-	uint64		my_ring_index;
+	uint64		my_ring_index;	/* sequence number of the request */
+	uint64		flight_record_id;	/* see neon_flight_recorder.c */
+	PrfSlotNo	prev;			/* links in the slot's list */
+	PrfSlotNo	next;
 } PrefetchRequest;
 
+typedef struct PrfList
+{
+	PrfSlotNo	head;			/* oldest entry */
+	PrfSlotNo	tail;
+} PrfList;
+
 /* prefetch buffer lookup hash table */
 
 typedef struct PrfHashEntry
@@ -205,17 +229,26 @@ typedef struct PrfHashEntry
 	uint32		hash;
 } PrfHashEntry;
 
+/*
+ * The entries of one backend's prefetch buffer are told apart well enough by
+ * relation number, fork and block number, so hash only those. That's much
+ * cheaper than hash_bytes() over the whole BufferTag. Lookups still compare
+ * the whole tag.
+ */
+static inline uint32
+prefetch_buftag_hash(const BufferTag *tag)
+{
+	return hash_combine(murmurhash32(tag->blockNum),
+						BufTagGetRelNumber(tag) ^ ((uint32) tag->forkNum << 28));
+}
+
 #define SH_PREFIX			prfh
 #define SH_ELEMENT_TYPE		PrfHashEntry
 #define SH_KEY_TYPE			PrefetchRequest *
 #define SH_KEY				slot
 #define SH_STORE_HASH
 #define SH_GET_HASH(tb, a)	((a)->hash)
-#define SH_HASH_KEY(tb, key) hash_bytes( \
-	((const unsigned char *) &(key)->buftag), \
-	sizeof(BufferTag) \
-)
-
+#define SH_HASH_KEY(tb, key) prefetch_buftag_hash(&(key)->buftag)
 #define SH_EQUAL(tb, a, b)	(BufferTagsEqual(&(a)->buftag, &(b)->buftag))
 #define SH_SCOPE			static inline
 #define SH_DEFINE
@@ -225,17 +258,28 @@ typedef struct PrfHashEntry
 
 /*
  * PrefetchState maintains the state of (prefetch) getPage@LSN requests.
- * It maintains a (ring) buffer of in-flight requests and responses.
  *
- * We maintain several indexes into the ring buffer:
- * ring_unused >= ring_flush >= ring_receive >= ring_last >= 0
+ * Each request gets a sequence number, its ring index, when it's sent:
+ * ring_unused >= ring_flush >= ring_receive
  *
- * ring_unused points to the first unused slot of the buffer
+ * ring_unused is the ring index of the next request
+ * ring_flush is the next request that is to be flushed
  * ring_receive is the next request that is to be received
- * ring_last is the oldest received entry in the buffer
  *
- * Apart from being an entry in the ring buffer of prefetch requests, each
- * PrefetchRequest that is not UNUSED is indexed in prf_hash by buftag.
+ * The requests and responses are kept in prf_buffer. A slot keeps its place
+ * in the array from the time the request is sent until the response is
+ * consumed or discarded, so pointers to slots stay valid, unless the slot is
+ * released or the buffer is resized. The slots are linked into three lists:
+ *
+ * - free_slots: unused slots
+ * - inflight: requests in the order they were sent, ring indexes
+ *   ring_receive to ring_unused - 1. Responses arrive in the same order.
+ * - received: buffered responses in the order they were received, so the
+ *   head is the oldest response, which is dropped first when we need room.
+ *
+ * Each slot that is not UNUSED is also indexed in prf_hash by buftag,
+ * except for abandoned requests, which only hold a place in the in-flight
+ * list until their response has been received and thrown away.
  */
 typedef struct PrefetchState
 {
@@ -245,19 +289,28 @@ typedef struct PrefetchState
 								 * allocations */
 	MemoryContext hashctx;		/* context for prf_buffer */
 
-	/* buffer indexes */
-	uint64		ring_unused;	/* first unused slot */
+	/* ring indexes */
+	uint64		ring_unused;	/* next request to send */
 	uint64		ring_flush;		/* next request to flush */
-	uint64		ring_receive;	/* next slot that is to receive a response */
-	uint64		ring_last;		/* min slot with a response value */
+	uint64		ring_receive;	/* next request that is to receive a response */
+
+	/* slot lists */
+	PrfList		free_slots;
+	PrfList		inflight;
+	PrfList		received;
 
 	/* metrics / statistics  */
 	int			n_responses_buffered;	/* count of PS responses not yet in
 										 * buffers */
 	int			n_requests_inflight;	/* count of PS requests considered in
 										 * flight */
-	int			n_unused;		/* count of buffers < unused, > last, that are
-								 * also unused */
+	int			n_abandoned;	/* count of abandoned requests in flight */
+	int			n_borrowed;		/* count of slots borrowed from the prefetch
+								 * buffer budget */
+	int			n_reserved;		/* count of slots reserved in the shared
+								 * budget counter, >= n_borrowed */
+	TimestampTz abandoned_since;	/* when we started waiting for the oldest
+									 * abandoned request */
 
 	/* the buffers */
 	prfh_hash	*prf_hash;
@@ -269,33 +322,150 @@ typedef struct PrefetchState
 
 static PrefetchState *MyPState;
 
-#define GetPrfSlotNoCheck(ring_index) ( \
-	&MyPState->prf_buffer[((ring_index) % readahead_buffer_size)] \
-)
+/*
+ * Prefetch buffer budget, shared by all backends.
+ *
+ * Each slot of a prefetch ring that holds a request or a buffered response
+ * (other than an abandoned request) is borrowed from a global budget of
+ * neon.prefetch_buffer_budget, counted in units of PS_GETPAGERESPONSE_SIZE.
+ * Speculative prefetches are only issued if a slot can be borrowed without
+ * exceeding the budget. So when many backends prefetch at the same time,
+ * their effective readahead window shrinks, instead of the memory use
+ * growing with the number of backends times neon.readahead_buffer_size.
+ * Synchronous requests can't be held back, so they always get a slot, even
+ * if that takes the total over the budget.
+ *
+ * To avoid contention on the shared counter, backends reserve slots in it in
+ * batches of up to PREFETCH_BUDGET_BATCH, and keep less than
+ * 2 * PREFETCH_BUDGET_BATCH reserved slots that they're not using. A batch
+ * is cut short if the rest of the budget is smaller, so the reservations
+ * never exceed the budget, except for the synchronous requests.
+ */
+#define PREFETCH_BUDGET_BATCH		8
 
-#define GetPrfSlot(ring_index) ( \
-	( \
-		AssertMacro((ring_index) < MyPState->ring_unused && \
-					(ring_index) >= MyPState->ring_last), \
-		GetPrfSlotNoCheck(ring_index) \
-	) \
-)
+typedef struct PrefetchShmemState
+{
+	pg_atomic_uint32 slots_reserved;
+} PrefetchShmemState;
 
-#define ReceiveBufferNeedsCompaction() (\
-	(MyPState->n_responses_buffered / 8) < ( \
-		MyPState->ring_receive - \
-			MyPState->ring_last - \
-			MyPState->n_responses_buffered \
-	) \
-)
+static PrefetchShmemState *prefetch_shared;
+
+Size
+PrefetchShmemSize(void)
+{
+	return sizeof(PrefetchShmemState);
+}
+
+void
+PrefetchShmemInit(void)
+{
+	bool		found;
+
+	prefetch_shared = ShmemInitStruct("Neon prefetch budget",
+									  sizeof(PrefetchShmemState),
+									  &found);
+	if (!found)
+		pg_atomic_init_u32(&prefetch_shared->slots_reserved, 0);
+}
+
+/*
+ * Reserve more slots in the shared budget counter. Returns false if the
+ * budget is exhausted, unless 'force' is set, in which case a single slot is
+ * reserved beyond the budget.
+ */
+static bool
+prefetch_budget_reserve(bool force)
+{
+	uint32		budget_slots;
+	uint32		reserved;
+
+	budget_slots = (uint32) Min((uint64) prefetch_buffer_budget * 1024 / PS_GETPAGERESPONSE_SIZE,
+								PG_UINT32_MAX);
+
+	reserved = pg_atomic_read_u32(&prefetch_shared->slots_reserved);
+	for (;;)
+	{
+		uint32		nslots;
+
+		if (prefetch_buffer_budget == 0)
+			nslots = PREFETCH_BUDGET_BATCH;
+		else if (reserved < budget_slots)
+			nslots = Min(PREFETCH_BUDGET_BATCH, budget_slots - reserved);
+		else if (force)
+			nslots = 1;
+		else
+			return false;
+
+		/* on failure, 'reserved' is updated to the current value */
+		if (pg_atomic_compare_exchange_u32(&prefetch_shared->slots_reserved,
+										   &reserved, reserved + nslots))
+		{
+			MyPState->n_reserved += nslots;
+			return true;
+		}
+	}
+}
+
+/*
+ * Borrow a slot for a request. This always succeeds, call
+ * prefetch_budget_available() first for speculative requests.
+ */
+static inline void
+prefetch_budget_borrow(void)
+{
+	if (MyPState->n_borrowed == MyPState->n_reserved)
+		(void) prefetch_budget_reserve(true);
+	MyPState->n_borrowed++;
+}
+
+static inline void
+prefetch_budget_return(void)
+{
+	Assert(MyPState->n_borrowed > 0);
+	MyPState->n_borrowed--;
+	if (MyPState->n_reserved - MyPState->n_borrowed >= 2 * PREFETCH_BUDGET_BATCH)
+	{
+		pg_atomic_fetch_sub_u32(&prefetch_shared->slots_reserved,
+								PREFETCH_BUDGET_BATCH);
+		MyPState->n_reserved -= PREFETCH_BUDGET_BATCH;
+	}
+}
+
+/*
+ * Can we borrow a slot for a speculative prefetch request, without exceeding
+ * the budget? If this returns true, the following prefetch_budget_borrow()
+ * uses a slot that has already been reserved.
+ */
+static inline bool
+prefetch_budget_available(void)
+{
+	return MyPState->n_borrowed < MyPState->n_reserved ||
+		prefetch_budget_reserve(false);
+}
+
+/* Give back this backend's reservation at exit */
+static void
+prefetch_budget_shmem_exit(int code, Datum arg)
+{
+	if (MyPState != NULL && MyPState->n_reserved > 0)
+	{
+		pg_atomic_fetch_sub_u32(&prefetch_shared->slots_reserved,
+								MyPState->n_reserved);
+		MyPState->n_reserved = 0;
+		MyPState->n_borrowed = 0;
+	}
+}
+
+#define PrfSlot(slotno) (&MyPState->prf_buffer[(slotno)])
+#define PrfSlotNoOf(slot) ((PrfSlotNo) ((slot) - MyPState->prf_buffer))
 
-static bool compact_prefetch_buffers(void);
 static void consume_prefetch_responses(void);
 static bool prefetch_read(PrefetchRequest *slot);
 static void prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns);
 static bool prefetch_wait_for(uint64 ring_index);
-static void prefetch_cleanup_trailing_unused(void);
-static inline void prefetch_set_unused(uint64 ring_index);
+static void prefetch_release_abandoned(PrefetchRequest *slot, NeonResponse *response);
+static void prefetch_check_abandoned(void);
+static inline void prefetch_set_unused(PrefetchRequest *slot);
 #if PG_MAJORVERSION_NUM < 17
 static void
 GetLastWrittenLSNv(NRelFileInfo relfilenode, ForkNumber forknum,
@@ -309,100 +479,112 @@ neon_get_request_lsns(NRelFileInfo rinfo, ForkNumber forknum,
 static bool neon_prefetch_response_usable(neon_request_lsns *request_lsns,
 										  PrefetchRequest *slot);
 
-static bool
-compact_prefetch_buffers(void)
+/*
+ * Doubly-linked lists of slots, linked through the slots' prev and next
+ * fields. All operations are O(1).
+ */
+static inline PrefetchRequest *
+prefetch_list_first(PrfList *list)
 {
-	uint64		empty_ring_index = MyPState->ring_last;
-	uint64		search_ring_index = MyPState->ring_receive;
-	int			n_moved = 0;
-
-	if (MyPState->ring_receive == MyPState->ring_last)
-		return false;
-
-	while (search_ring_index > MyPState->ring_last)
-	{
-		search_ring_index--;
-		if (GetPrfSlot(search_ring_index)->status == PRFS_UNUSED)
-		{
-			empty_ring_index = search_ring_index;
-			break;
-		}
-	}
-
-	/*
-	 * Here we have established: slots < search_ring_index have an unknown
-	 * state (not scanned) slots >= search_ring_index and <= empty_ring_index
-	 * are unused slots > empty_ring_index are in use, or outside our buffer's
-	 * range. ... unless search_ring_index <= ring_last
-	 *
-	 * Therefore, there is a gap of at least one unused items between
-	 * search_ring_index and empty_ring_index (both inclusive), which grows as
-	 * we hit more unused items while moving backwards through the array.
-	 */
-
-	while (search_ring_index > MyPState->ring_last)
-	{
-		PrefetchRequest *source_slot;
-		PrefetchRequest *target_slot;
-		bool		found;
+	return list->head == PRF_NONE ? NULL : PrfSlot(list->head);
+}
 
-		/* update search index to an unprocessed entry */
-		search_ring_index--;
+static inline void
+prefetch_list_append(PrfList *list, PrefetchRequest *slot)
+{
+	PrfSlotNo	slotno = PrfSlotNoOf(slot);
 
-		source_slot = GetPrfSlot(search_ring_index);
+	slot->prev = list->tail;
+	slot->next = PRF_NONE;
+	if (list->tail == PRF_NONE)
+		list->head = slotno;
+	else
+		PrfSlot(list->tail)->next = slotno;
+	list->tail = slotno;
+}
 
-		if (source_slot->status == PRFS_UNUSED)
-			continue;
+static inline void
+prefetch_list_remove(PrfList *list, PrefetchRequest *slot)
+{
+	if (slot->prev == PRF_NONE)
+		list->head = slot->next;
+	else
+		PrfSlot(slot->prev)->next = slot->next;
+	if (slot->next == PRF_NONE)
+		list->tail = slot->prev;
+	else
+		PrfSlot(slot->next)->prev = slot->prev;
+	slot->prev = slot->next = PRF_NONE;
+}
 
-		/* slot is used -- start moving slot */
-		target_slot = GetPrfSlot(empty_ring_index);
+/* Clear a slot that's not on any list, and put it on the free list */
+static inline void
+prefetch_slot_free(PrefetchRequest *slot)
+{
+	MemSet(slot, 0, sizeof(PrefetchRequest));
+	slot->status = PRFS_UNUSED;
+	prefetch_list_append(&MyPState->free_slots, slot);
+}
 
-		Assert(source_slot->status == PRFS_RECEIVED);
-		Assert(target_slot->status == PRFS_UNUSED);
+/* Take a slot from the free list, or NULL if there are none */
+static inline PrefetchRequest *
+prefetch_slot_alloc(void)
+{
+	PrefetchRequest *slot = prefetch_list_first(&MyPState->free_slots);
 
-		target_slot->buftag = source_slot->buftag;
-		target_slot->shard_no = source_slot->shard_no;
-		target_slot->status = source_slot->status;
-		target_slot->response = source_slot->response;
-		target_slot->reqid = source_slot->reqid;
-		target_slot->request_lsns = source_slot->request_lsns;
-		target_slot->my_ring_index = empty_ring_index;
+	if (slot != NULL)
+		prefetch_list_remove(&MyPState->free_slots, slot);
+	return slot;
+}
 
-		prfh_delete(MyPState->prf_hash, source_slot);
-		prfh_insert(MyPState->prf_hash, target_slot, &found);
+/* Allocate a PrefetchState with all slots on the free list */
+static PrefetchState *
+prefetch_state_alloc(int nslots)
+{
+	PrefetchState *state;
 
-		Assert(!found);
+	state = MemoryContextAllocZero(TopMemoryContext,
+								   offsetof(PrefetchState, prf_buffer) +
+								   sizeof(PrefetchRequest) * nslots);
+	state->free_slots.head = state->free_slots.tail = PRF_NONE;
+	state->inflight.head = state->inflight.tail = PRF_NONE;
+	state->received.head = state->received.tail = PRF_NONE;
 
-		/* Adjust the location of our known-empty slot */
-		empty_ring_index--;
+	for (int i = nslots - 1; i >= 0; i--)
+	{
+		state->prf_buffer[i].status = PRFS_UNUSED;
+		state->prf_buffer[i].prev = PRF_NONE;
+		state->prf_buffer[i].next = state->free_slots.head;
+		if (state->free_slots.head == PRF_NONE)
+			state->free_slots.tail = i;
+		else
+			state->prf_buffer[state->free_slots.head].prev = i;
+		state->free_slots.head = i;
+	}
 
-		/* empty the moved slot */
-		source_slot->status = PRFS_UNUSED;
-		source_slot->buftag = (BufferTag)
-		{
-			0
-		};
-		source_slot->response = NULL;
-		source_slot->my_ring_index = 0;
-		source_slot->request_lsns = (neon_request_lsns) {
-			InvalidXLogRecPtr, InvalidXLogRecPtr, InvalidXLogRecPtr
-		};
+	return state;
+}
 
-		/* update bookkeeping */
-		n_moved++;
-	}
+/*
+ * Store the response to the oldest request in flight in its slot.
+ */
+static void
+prefetch_set_received(PrefetchRequest *slot, NeonResponse *response)
+{
+	Assert(slot == prefetch_list_first(&MyPState->inflight));
 
-	/*
-	 * Only when we've moved slots we can expect trailing unused slots, so
-	 * only then we clean up trailing unused slots.
-	 */
-	if (n_moved > 0)
-	{
-		prefetch_cleanup_trailing_unused();
-		return true;
-	}
+	/* update prefetch state */
+	MyPState->n_responses_buffered += 1;
+	MyPState->n_requests_inflight -= 1;
+	MyPState->ring_receive += 1;
+	NEON_PERF_COUNTER_SET(getpage_prefetches_buffered,
+		MyPState->n_responses_buffered);
 
-	return false;
+	/* update slot state */
+	prefetch_list_remove(&MyPState->inflight, slot);
+	prefetch_list_append(&MyPState->received, slot);
+	slot->status = PRFS_RECEIVED;
+	slot->response = response;
 }
 
 /*
@@ -418,13 +600,15 @@ compact_prefetch_buffers(void)
 static void
 prefetch_pump_state(void)
 {
+	prefetch_check_abandoned();
+
 	while (MyPState->ring_receive != MyPState->ring_flush)
 	{
 		NeonResponse   *response;
 		PrefetchRequest *slot;
 		MemoryContext	old;
 
-		slot = GetPrfSlot(MyPState->ring_receive);
+		slot = prefetch_list_first(&MyPState->inflight);
 
 		old = MemoryContextSwitchTo(MyPState->errctx);
 		response = page_server->try_receive(slot->shard_no);
@@ -442,27 +626,23 @@ prefetch_pump_state(void)
 						   slot->status, slot->response,
 						   (long) slot->my_ring_index, (long) MyPState->ring_receive);
 
-		/* update prefetch state */
-		MyPState->n_responses_buffered += 1;
-		MyPState->n_requests_inflight -= 1;
-		MyPState->ring_receive += 1;
-		MyNeonCounters->getpage_prefetches_buffered =
-			MyPState->n_responses_buffered;
+		if (slot->flags & PRFSF_ABANDONED)
+		{
+			prefetch_release_abandoned(slot, response);
+			continue;
+		}
 
-		/* update slot state */
-		slot->status = PRFS_RECEIVED;
-		slot->response = response;
+		prefetch_set_received(slot, response);
+		flight_record_response(slot->flight_record_id);
 	}
 }
 
 void
 readahead_buffer_resize(int newsize, void *extra)
 {
-	uint64		end,
-				nfree = newsize;
-	PrefetchState *newPState;
-	Size		newprfs_size = offsetof(PrefetchState, prf_buffer) +
-		(sizeof(PrefetchRequest) * newsize);
+	PrefetchState *oldPState;
+	int			nslots_kept = 0;
+	int			n_dropped;
 
 	/* don't try to re-initialize if we haven't initialized yet */
 	if (MyPState == NULL)
@@ -480,88 +660,80 @@ readahead_buffer_resize(int newsize, void *extra)
 	}
 
 	/* construct the new PrefetchState, and copy over the memory contexts */
-	newPState = MemoryContextAllocZero(TopMemoryContext, newprfs_size);
-
-	newPState->bufctx = MyPState->bufctx;
-	newPState->errctx = MyPState->errctx;
-	newPState->hashctx = MyPState->hashctx;
-	newPState->prf_hash = prfh_create(MyPState->hashctx, newsize, NULL);
-	newPState->n_unused = newsize;
-	newPState->n_requests_inflight = 0;
-	newPState->n_responses_buffered = 0;
-	newPState->ring_last = newsize;
-	newPState->ring_unused = newsize;
-	newPState->ring_receive = newsize;
-	newPState->max_shard_no = MyPState->max_shard_no;
-	memcpy(newPState->shard_bitmap, MyPState->shard_bitmap, sizeof(MyPState->shard_bitmap));
+	oldPState = MyPState;
+	MyPState = prefetch_state_alloc(newsize);
+
+	MyPState->bufctx = oldPState->bufctx;
+	MyPState->errctx = oldPState->errctx;
+	MyPState->hashctx = oldPState->hashctx;
+	MyPState->prf_hash = prfh_create(oldPState->hashctx, newsize, NULL);
+	MyPState->ring_unused = oldPState->ring_unused;
+	MyPState->ring_flush = oldPState->ring_flush;
+	MyPState->ring_receive = oldPState->ring_receive;
+	MyPState->n_abandoned = oldPState->n_abandoned;
+	MyPState->n_borrowed = oldPState->n_borrowed;
+	MyPState->n_reserved = oldPState->n_reserved;
+	MyPState->abandoned_since = oldPState->abandoned_since;
+	MyPState->max_shard_no = oldPState->max_shard_no;
+	memcpy(MyPState->shard_bitmap, oldPState->shard_bitmap, sizeof(oldPState->shard_bitmap));
 
 	/*
-	 * Copy over the prefetches.
-	 *
-	 * We populate the prefetch array from the end; to retain the most recent
-	 * prefetches, but this has the benefit of only needing to do one
-	 * iteration on the dataset, and trivial compaction.
+	 * Copy over the requests in flight, and as many of the most recent
+	 * responses as fit in the remaining slots. The requests keep their ring
+	 * indexes.
 	 */
-	for (end = MyPState->ring_unused - 1;
-		 end >= MyPState->ring_last && end != UINT64_MAX && nfree != 0;
-		 end -= 1)
-	{
-		PrefetchRequest *slot = GetPrfSlot(end);
-		PrefetchRequest *newslot;
-		bool		found;
+	n_dropped = Max(0, oldPState->n_responses_buffered -
+					(newsize - oldPState->n_requests_inflight));
 
-		if (slot->status == PRFS_UNUSED)
-			continue;
+	for (int i = 0; i < 2; i++)
+	{
+		PrfList    *oldlist = i == 0 ? &oldPState->inflight : &oldPState->received;
+		PrfList    *newlist = i == 0 ? &MyPState->inflight : &MyPState->received;
 
-		nfree -= 1;
+		for (PrfSlotNo slotno = oldlist->head;
+			 slotno != PRF_NONE;
+			 slotno = oldPState->prf_buffer[slotno].next)
+		{
+			PrefetchRequest *slot = &oldPState->prf_buffer[slotno];
+			PrefetchRequest *newslot;
+			bool		found;
 
-		newslot = &newPState->prf_buffer[nfree];
-		*newslot = *slot;
-		newslot->my_ring_index = nfree;
+			if (slot->status == PRFS_RECEIVED && n_dropped > 0)
+			{
+				pfree(slot->response);
+				n_dropped--;
+				continue;
+			}
 
-		prfh_insert(newPState->prf_hash, newslot, &found);
+			newslot = prefetch_slot_alloc();
+			*newslot = *slot;
+			prefetch_list_append(newlist, newslot);
 
-		Assert(!found);
+			if (!(newslot->flags & PRFSF_ABANDONED))
+			{
+				prfh_insert(MyPState->prf_hash, newslot, &found);
+				Assert(!found);
+				nslots_kept += 1;
+			}
 
-		switch (newslot->status)
-		{
-			case PRFS_UNUSED:
-				pg_unreachable();
-			case PRFS_REQUESTED:
-				newPState->n_requests_inflight += 1;
-				newPState->ring_receive -= 1;
-				newPState->ring_last -= 1;
-				break;
-			case PRFS_RECEIVED:
-				newPState->n_responses_buffered += 1;
-				newPState->ring_last -= 1;
-				break;
-			case PRFS_TAG_REMAINS:
-				newPState->ring_last -= 1;
-				break;
+			if (newslot->status == PRFS_REQUESTED)
+				MyPState->n_requests_inflight += 1;
+			else
+				MyPState->n_responses_buffered += 1;
 		}
-		newPState->n_unused -= 1;
 	}
-	newPState->ring_flush = newPState->ring_receive;
 
-	MyNeonCounters->getpage_prefetches_buffered =
-		MyPState->n_responses_buffered;
-	MyNeonCounters->pageserver_open_requests =
-		MyPState->n_requests_inflight;
+	NEON_PERF_COUNTER_SET(getpage_prefetches_buffered,
+		MyPState->n_responses_buffered);
+	NEON_PERF_COUNTER_SET(pageserver_open_requests,
+		MyPState->n_requests_inflight);
 
-	for (; end >= MyPState->ring_last && end != UINT64_MAX; end -= 1)
-	{
-		PrefetchRequest *slot = GetPrfSlot(end);
-		Assert(slot->status != PRFS_REQUESTED);
-		if (slot->status == PRFS_RECEIVED)
-		{
-			pfree(slot->response);
-		}
-	}
+	prfh_destroy(oldPState->prf_hash);
+	pfree(oldPState);
 
-	prfh_destroy(MyPState->prf_hash);
-	pfree(MyPState);
-	MyPState = newPState;
+	/* return the budget of the slots that didn't fit */
+	while (MyPState->n_borrowed > nslots_kept)
+		prefetch_budget_return();
 }
 
 
@@ -579,21 +751,121 @@ consume_prefetch_responses(void)
 		prefetch_wait_for(MyPState->ring_unused - 1);
 }
 
-static void
-prefetch_cleanup_trailing_unused(void)
+/*
+ * Keep the connection after a request was cancelled while we were waiting
+ * for its response.
+ *
+ * Instead of dropping the connection, and with it all other requests in
+ * flight on it, we put a placeholder for the request into the in-flight
+ * list. The response is then read and thrown away like any other prefetch
+ * response, whenever we next receive from the connection. If it takes longer
+ * than neon.abandoned_request_timeout, prefetch_check_abandoned() gives up
+ * and resets the connection.
+ *
+ * The request must have been sent and flushed after all requests that are
+ * currently in flight. Returns false if the request can't be tracked, in
+ * which case the caller must disconnect.
+ */
+static bool
+prefetch_abandon_request(shardno_t shard_no, uint64 flight_record_id)
 {
-	uint64		ring_index;
 	PrefetchRequest *slot;
+	uint64		ring_index;
 
-	while (MyPState->ring_last < MyPState->ring_receive)
+	if (abandoned_request_timeout == 0 || MyPState == NULL)
+		return false;
+
+	/* make room, if we can do so without waiting */
+	slot = prefetch_slot_alloc();
+	if (slot == NULL)
 	{
-		ring_index = MyPState->ring_last;
-		slot = GetPrfSlot(ring_index);
+		slot = prefetch_list_first(&MyPState->received);
+		if (slot == NULL)
+			return false;
+		prefetch_set_unused(slot);
+		slot = prefetch_slot_alloc();
+	}
 
-		if (slot->status == PRFS_UNUSED)
-			MyPState->ring_last += 1;
-		else
+	ring_index = MyPState->ring_unused;
+
+	slot->status = PRFS_REQUESTED;
+	slot->flags = PRFSF_ABANDONED;
+	slot->shard_no = shard_no;
+	slot->my_ring_index = ring_index;
+	slot->flight_record_id = flight_record_id;
+	prefetch_list_append(&MyPState->inflight, slot);
+
+	/*
+	 * The request itself was flushed, but that doesn't cover prefetch
+	 * requests to other shards that may still be waiting to be flushed.
+	 */
+	if (MyPState->ring_flush == ring_index)
+		MyPState->ring_flush += 1;
+	else
+	{
+		BITMAP_SET(MyPState->shard_bitmap, shard_no);
+		MyPState->max_shard_no = Max(shard_no + 1, MyPState->max_shard_no);
+	}
+
+	MyPState->ring_unused += 1;
+	MyPState->n_requests_inflight += 1;
+
+	if (MyPState->n_abandoned++ == 0)
+		MyPState->abandoned_since = GetCurrentTimestamp();
+
+	return true;
+}
+
+/*
+ * Throw away the response of an abandoned request.
+ */
+static void
+prefetch_release_abandoned(PrefetchRequest *slot, NeonResponse *response)
+{
+	Assert(slot->flags & PRFSF_ABANDONED);
+	Assert(slot->my_ring_index == MyPState->ring_receive);
+
+	flight_record_response(slot->flight_record_id);
+	pfree(response);
+
+	MyPState->n_requests_inflight -= 1;
+	MyPState->ring_receive += 1;
+
+	/* restart the clock for the next abandoned request, if any */
+	if (--MyPState->n_abandoned > 0)
+		MyPState->abandoned_since = GetCurrentTimestamp();
+
+	prefetch_list_remove(&MyPState->inflight, slot);
+	prefetch_slot_free(slot);
+}
+
+/*
+ * Reset the connection if the pageserver hasn't answered an abandoned
+ * request within neon.abandoned_request_timeout.
+ */
+static void
+prefetch_check_abandoned(void)
+{
+	if (MyPState->n_abandoned == 0 ||
+		!TimestampDifferenceExceeds(MyPState->abandoned_since,
+									GetCurrentTimestamp(),
+									abandoned_request_timeout))
+		return;
+
+	for (PrfSlotNo slotno = MyPState->inflight.head;
+		 slotno != PRF_NONE;
+		 slotno = PrfSlot(slotno)->next)
+	{
+		PrefetchRequest *slot = PrfSlot(slotno);
+
+		if (slot->flags & PRFSF_ABANDONED)
+		{
+			neon_shard_log(slot->shard_no, LOG,
+						   "no response to cancelled request within %d ms, resetting connection",
+						   abandoned_request_timeout);
+			page_server->disconnect(slot->shard_no);
 			break;
+		}
 	}
 }
 
@@ -615,7 +887,7 @@ prefetch_flush_requests(void)
 }
 
 /*
- * Wait for slot of ring_index to have received its response.
+ * Wait for the request with ring_index to have received its response.
  * The caller is responsible for making sure the request buffer is flushed.
  *
  * NOTE: this function may indirectly update MyPState->pfs_hash; which
@@ -640,7 +912,7 @@ prefetch_wait_for(uint64 ring_index)
 
 	while (MyPState->ring_receive <= ring_index)
 	{
-		entry = GetPrfSlot(MyPState->ring_receive);
+		entry = prefetch_list_first(&MyPState->inflight);
 
 		Assert(entry->status == PRFS_REQUESTED);
 		if (!prefetch_read(entry))
@@ -704,16 +976,14 @@ prefetch_read(PrefetchRequest *slot)
 						   slot->status, slot->response,
 						   (long) slot->my_ring_index, (long) MyPState->ring_receive);
 
-		/* update prefetch state */
-		MyPState->n_responses_buffered += 1;
-		MyPState->n_requests_inflight -= 1;
-		MyPState->ring_receive += 1;
-		MyNeonCounters->getpage_prefetches_buffered =
-			MyPState->n_responses_buffered;
+		if (slot->flags & PRFSF_ABANDONED)
+		{
+			prefetch_release_abandoned(slot, response);
+			return true;
+		}
 
-		/* update slot state */
-		slot->status = PRFS_RECEIVED;
-		slot->response = response;
+		prefetch_set_received(slot, response);
+		flight_record_response(slot->flight_record_id);
 		return true;
 	}
 	else
@@ -740,17 +1010,14 @@ prefetch_read(PrefetchRequest *slot)
 void
 prefetch_on_ps_disconnect(void)
 {
+	PrefetchRequest *slot;
+
 	MyPState->ring_flush = MyPState->ring_unused;
 
-	while (MyPState->ring_receive < MyPState->ring_unused)
+	while ((slot = prefetch_list_first(&MyPState->inflight)) != NULL)
 	{
-		PrefetchRequest *slot;
-		uint64		ring_index = MyPState->ring_receive;
-
-		slot = GetPrfSlot(ring_index);
-
 		Assert(slot->status == PRFS_REQUESTED);
-		Assert(slot->my_ring_index == ring_index);
+		Assert(slot->my_ring_index == MyPState->ring_receive);
 
 		/*
 		 * Drop connection to all shards which have prefetch requests.
@@ -760,81 +1027,64 @@ prefetch_on_ps_disconnect(void)
 		 */
 		page_server->disconnect(slot->shard_no);
 
+		/* abandoned requests were never going to be used anyway */
+		if (slot->flags & PRFSF_ABANDONED)
+			MyPState->n_abandoned -= 1;
+		else
+		{
+			pgBufferUsage.prefetch.expired += 1;
+			NEON_PERF_COUNTER_INC(getpage_prefetch_discards_total);
+			prfh_delete(MyPState->prf_hash, slot);
+			prefetch_budget_return();
+		}
+
 		/* clean up the request */
-		slot->status = PRFS_TAG_REMAINS;
 		MyPState->n_requests_inflight -= 1;
 		MyPState->ring_receive += 1;
 
-		prefetch_set_unused(ring_index);
-		pgBufferUsage.prefetch.expired += 1;
-		MyNeonCounters->getpage_prefetch_discards_total += 1;
+		prefetch_list_remove(&MyPState->inflight, slot);
+		prefetch_slot_free(slot);
 	}
+	Assert(MyPState->ring_receive == MyPState->ring_unused);
+	Assert(MyPState->n_abandoned == 0);
 
 	/*
 	 * We can have gone into retry due to network error, so update stats with
-	 * the latest available 
+	 * the latest available
 	 */
-	MyNeonCounters->pageserver_open_requests =
-		MyPState->n_requests_inflight;
-	MyNeonCounters->getpage_prefetches_buffered =
-		MyPState->n_responses_buffered;
+	NEON_PERF_COUNTER_SET(pageserver_open_requests,
+		MyPState->n_requests_inflight);
+	NEON_PERF_COUNTER_SET(getpage_prefetches_buffered,
+		MyPState->n_responses_buffered);
 }
 
 /*
- * prefetch_set_unused() - clear a received prefetch slot
+ * prefetch_set_unused() - release a received prefetch slot
  *
- * The slot at ring_index must be a current member of the ring buffer,
- * and may not be in the PRFS_REQUESTED state.
+ * The slot must be in the PRFS_RECEIVED state. This is O(1), the other slots
+ * are not affected.
  *
  * NOTE: this function will update MyPState->pfs_hash; which invalidates any
  * active pointers into the hash table.
  */
 static inline void
-prefetch_set_unused(uint64 ring_index)
+prefetch_set_unused(PrefetchRequest *slot)
 {
-	PrefetchRequest *slot;
-
-	if (ring_index < MyPState->ring_last)
-		return;					/* Should already be unused */
-
-	slot = GetPrfSlot(ring_index);
-	if (slot->status == PRFS_UNUSED)
-		return;
-
-	Assert(slot->status == PRFS_RECEIVED || slot->status == PRFS_TAG_REMAINS);
+	Assert(slot->status == PRFS_RECEIVED);
+	Assert(!(slot->flags & PRFSF_ABANDONED));
 
-	if (slot->status == PRFS_RECEIVED)
-	{
-		pfree(slot->response);
-		slot->response = NULL;
+	pfree(slot->response);
+	slot->response = NULL;
 
-		MyPState->n_responses_buffered -= 1;
-		MyPState->n_unused += 1;
-
-		MyNeonCounters->getpage_prefetches_buffered =
-			MyPState->n_responses_buffered;
-	}
-	else
-	{
-		Assert(slot->response == NULL);
-	}
+	MyPState->n_responses_buffered -= 1;
+	NEON_PERF_COUNTER_SET(getpage_prefetches_buffered,
+		MyPState->n_responses_buffered);
 
 	prfh_delete(MyPState->prf_hash, slot);
+	prefetch_budget_return();
 
-	/* clear all fields */
-	MemSet(slot, 0, sizeof(PrefetchRequest));
-	slot->status = PRFS_UNUSED;
-
-	/* run cleanup if we're holding back ring_last */
-	if (MyPState->ring_last == ring_index)
-		prefetch_cleanup_trailing_unused();
-
-	/*
-	 * ... and try to store the buffered responses more compactly if > 12.5%
-	 * of the buffer is gaps
-	 */
-	else if (ReceiveBufferNeedsCompaction())
-		compact_prefetch_buffers();
+	prefetch_list_remove(&MyPState->received, slot);
+	prefetch_slot_free(slot);
 }
 
 /*
@@ -872,6 +1122,12 @@ prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns
 	Assert(slot->response == NULL);
 	Assert(slot->my_ring_index == MyPState->ring_unused);
 
+	slot->flight_record_id =
+		flight_record_request(T_NeonGetPageRequest, slot->shard_no, &slot->buftag,
+							  request.hdr.lsn, request.hdr.not_modified_since,
+							  (slot->flags & PRFSF_PREFETCH) ?
+							  NFR_SOURCE_PREFETCH : NFR_SOURCE_SYNC);
+
 	while (!page_server->send(slot->shard_no, (NeonRequest *) &request))
 	{
 		Assert(mySlotNo == MyPState->ring_unused);
@@ -880,13 +1136,13 @@ prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns
 
 	/* update prefetch state */
 	MyPState->n_requests_inflight += 1;
-	MyPState->n_unused -= 1;
 	MyPState->ring_unused += 1;
 	BITMAP_SET(MyPState->shard_bitmap, slot->shard_no);
 	MyPState->max_shard_no = Max(slot->shard_no+1, MyPState->max_shard_no);
 
 	/* update slot state */
 	slot->status = PRFS_REQUESTED;
+	prefetch_list_append(&MyPState->inflight, slot);
 	prfh_insert(MyPState->prf_hash, slot, &found);
 	Assert(!found);
 }
@@ -903,18 +1159,21 @@ prefetch_do_request(PrefetchRequest *slot, neon_request_lsns *force_request_lsns
  * to calculate the LSNs to send.
  *
  * When performing a prefetch rather than a synchronous request,
- * is_prefetch==true. Currently, it only affects how the request is accounted
- * in the perf counters.
+ * is_prefetch==true. Prefetch requests are not issued if the prefetch buffer
+ * budget is exhausted.
+ *
+ * Returns the slot of the last block that was registered, or NULL if none
+ * was registered because the budget was exhausted.
  *
  * NOTE: this function may indirectly update MyPState->pfs_hash; which
  * invalidates any active pointers into the hash table.
  */
-static uint64
+static PrefetchRequest *
 prefetch_register_bufferv(BufferTag tag, neon_request_lsns *frlsns,
 						  BlockNumber nblocks, const bits8 *mask,
 						  bool is_prefetch)
 {
-	uint64		min_ring_index;
+	PrefetchRequest *last_slot;
 	PrefetchRequest hashkey;
 #ifdef USE_ASSERT_CHECKING
 	bool		any_hits = false;
@@ -932,19 +1191,18 @@ prefetch_register_bufferv(BufferTag tag, neon_request_lsns *frlsns,
 Retry:
 	/*
 	 * We can have gone into retry due to network error, so update stats with
-	 * the latest available 
+	 * the latest available
 	 */
-	MyNeonCounters->pageserver_open_requests =
-		MyPState->ring_unused - MyPState->ring_receive;
-	MyNeonCounters->getpage_prefetches_buffered =
-		MyPState->n_responses_buffered;
+	NEON_PERF_COUNTER_SET(pageserver_open_requests,
+		MyPState->ring_unused - MyPState->ring_receive);
+	NEON_PERF_COUNTER_SET(getpage_prefetches_buffered,
+		MyPState->n_responses_buffered);
 
-	min_ring_index = UINT64_MAX;
+	last_slot = NULL;
 	for (int i = 0; i < nblocks; i++)
 	{
 		PrefetchRequest *slot = NULL;
 		PrfHashEntry *entry = NULL;
-		uint64		ring_index;
 		neon_request_lsns *lsns;
 
 		if (PointerIsValid(mask) && !BITMAP_ISSET(mask, i))
@@ -968,12 +1226,8 @@ Retry:
 		if (entry != NULL)
 		{
 			slot = entry->slot;
-			ring_index = slot->my_ring_index;
-			Assert(slot == GetPrfSlot(ring_index));
 
 			Assert(slot->status != PRFS_UNUSED);
-			Assert(MyPState->ring_last <= ring_index &&
-				   ring_index < MyPState->ring_unused);
 			Assert(BufferTagsEqual(&slot->buftag, &hashkey.buftag));
 
 			/*
@@ -985,45 +1239,31 @@ Retry:
 				if (!neon_prefetch_response_usable(lsns, slot))
 				{
 					/* Wait for the old request to finish and discard it */
-					if (!prefetch_wait_for(ring_index))
+					if (!prefetch_wait_for(slot->my_ring_index))
 						goto Retry;
-					prefetch_set_unused(ring_index);
+					prefetch_set_unused(slot);
 					entry = NULL;
 					slot = NULL;
 					pgBufferUsage.prefetch.expired += 1;
-					MyNeonCounters->getpage_prefetch_discards_total += 1;
+					NEON_PERF_COUNTER_INC(getpage_prefetch_discards_total);
 				}
 			}
 
 			if (entry != NULL)
 			{
-				/*
-				 * We received a prefetch for a page that was recently read
-				 * and removed from the buffers. Remove that request from the
-				 * buffers.
-				 */
-				if (slot->status == PRFS_TAG_REMAINS)
-				{
-					prefetch_set_unused(ring_index);
-					entry = NULL;
-					slot = NULL;
-				}
+				last_slot = slot;
+				/* The buffered request is good enough, return that slot */
+				if (is_prefetch)
+					pgBufferUsage.prefetch.duplicates++;
 				else
-				{
-					min_ring_index = Min(min_ring_index, ring_index);
-					/* The buffered request is good enough, return that index */
-					if (is_prefetch)
-						pgBufferUsage.prefetch.duplicates++;
-					else
-						pgBufferUsage.prefetch.hits++;
-					continue;
-				}
+					pgBufferUsage.prefetch.hits++;
+				continue;
 			}
 		}
 		else if (!is_prefetch)
 		{
 			pgBufferUsage.prefetch.misses += 1;
-			MyNeonCounters->getpage_prefetch_misses_total++;
+			NEON_PERF_COUNTER_INC(getpage_prefetch_misses_total);
 		}
 		/*
 		 * We can only leave the block above by finding that there's
@@ -1036,79 +1276,52 @@ Retry:
 		Assert(entry == NULL);
 		Assert(slot == NULL);
 
-		/* There should be no buffer overflow */
-		Assert(MyPState->ring_last + readahead_buffer_size >= MyPState->ring_unused);
-
 		/*
-		 * If the prefetch queue is full, we need to make room by clearing the
-		 * oldest slot. If the oldest slot holds a buffer that was already
-		 * received, we can just throw it away; we fetched the page
-		 * unnecessarily in that case. If the oldest slot holds a request that
-		 * we haven't received a response for yet, we have to wait for the
-		 * response to that before we can continue. We might not have even
-		 * flushed the request to the pageserver yet, it might be just sitting
-		 * in the output buffer. In that case, we flush it and wait for the
-		 * response. (We could decide not to send it, but it's hard to abort
-		 * when the request is already in the output buffer, and 'not sending'
-		 * a prefetch request kind of goes against the principles of
-		 * prefetching)
+		 * Don't issue more speculative requests if that would exceed the
+		 * prefetch buffer budget. The block will be requested when it's read.
 		 */
-		if (MyPState->ring_last + readahead_buffer_size == MyPState->ring_unused)
+		if (is_prefetch && !prefetch_budget_available())
 		{
-			uint64		cleanup_index = MyPState->ring_last;
-
-			slot = GetPrfSlot(cleanup_index);
-
-			Assert(slot->status != PRFS_UNUSED);
-
-			/*
-			 * If there is good reason to run compaction on the prefetch buffers,
-			 * try to do that.
-			 */
-			if (ReceiveBufferNeedsCompaction() && compact_prefetch_buffers())
-			{
-				Assert(slot->status == PRFS_UNUSED);
-			}
-			else
-			{
-				/*
-				 * We have the slot for ring_last, so that must still be in
-				 * progress
-				 */
-				switch (slot->status)
-				{
-					case PRFS_REQUESTED:
-						Assert(MyPState->ring_receive == cleanup_index);
-						if (!prefetch_wait_for(cleanup_index))
-							goto Retry;
-						prefetch_set_unused(cleanup_index);
-						pgBufferUsage.prefetch.expired += 1;
-						MyNeonCounters->getpage_prefetch_discards_total += 1;
-						break;
-					case PRFS_RECEIVED:
-					case PRFS_TAG_REMAINS:
-						prefetch_set_unused(cleanup_index);
-						pgBufferUsage.prefetch.expired += 1;
-						MyNeonCounters->getpage_prefetch_discards_total += 1;
-						break;
-					default:
-						pg_unreachable();
-				}
-			}
+			NEON_PERF_COUNTER_INC(getpage_prefetch_throttled_total);
+			continue;
 		}
 
 		/*
-		 * The next buffer pointed to by `ring_unused` is now definitely empty, so
-		 * we can insert the new request to it.
+		 * If the prefetch buffer is full, we need to make room by dropping
+		 * the oldest response. We fetched that page unnecessarily. If all
+		 * slots hold requests that we haven't received a response for yet,
+		 * we have to wait for the response to the oldest one before we can
+		 * continue. We might not have even flushed the request to the
+		 * pageserver yet, it might be just sitting in the output buffer. In
+		 * that case, we flush it and wait for the response. (We could decide
+		 * not to send it, but it's hard to abort when the request is already
+		 * in the output buffer, and 'not sending' a prefetch request kind of
+		 * goes against the principles of prefetching)
 		 */
-		ring_index = MyPState->ring_unused;
+		slot = prefetch_slot_alloc();
+		if (slot == NULL)
+		{
+			PrefetchRequest *victim = prefetch_list_first(&MyPState->received);
 
-		Assert(MyPState->ring_last <= ring_index &&
-			   ring_index <= MyPState->ring_unused);
+			if (victim == NULL)
+			{
+				victim = prefetch_list_first(&MyPState->inflight);
+				Assert(victim != NULL);
+				if (!prefetch_wait_for(victim->my_ring_index))
+					goto Retry;
+			}
 
-		slot = GetPrfSlotNoCheck(ring_index);
+			/* the response to an abandoned request is discarded as soon as it's read */
+			if (victim->status == PRFS_RECEIVED)
+			{
+				prefetch_set_unused(victim);
+				pgBufferUsage.prefetch.expired += 1;
+				NEON_PERF_COUNTER_INC(getpage_prefetch_discards_total);
+			}
 
-		Assert(slot->status == PRFS_UNUSED);
+			slot = prefetch_slot_alloc();
+			Assert(slot != NULL);
+		}
 
 		/*
 		 * We must update the slot data before insertion, because the hash
@@ -1116,27 +1329,28 @@ Retry:
 		 */
 		slot->buftag = hashkey.buftag;
 		slot->shard_no = get_shard_number(&tag);
-		slot->my_ring_index = ring_index;
+		slot->my_ring_index = MyPState->ring_unused;
+		slot->flags = is_prefetch ? PRFSF_PREFETCH : PRFSF_NONE;
 
-		min_ring_index = Min(min_ring_index, ring_index);
+		last_slot = slot;
+		prefetch_budget_borrow();
 
 		if (is_prefetch)
-			MyNeonCounters->getpage_prefetch_requests_total++;
+			NEON_PERF_COUNTER_INC(getpage_prefetch_requests_total);
 		else
-			MyNeonCounters->getpage_sync_requests_total++;
+			NEON_PERF_COUNTER_INC(getpage_sync_requests_total);
 
 		prefetch_do_request(slot, lsns);
 	}
 
-	MyNeonCounters->pageserver_open_requests =
-		MyPState->ring_unused - MyPState->ring_receive;
+	NEON_PERF_COUNTER_SET(pageserver_open_requests,
+		MyPState->ring_unused - MyPState->ring_receive);
 
 	Assert(any_hits);
 
-	Assert(GetPrfSlot(min_ring_index)->status == PRFS_REQUESTED ||
-		   GetPrfSlot(min_ring_index)->status == PRFS_RECEIVED);
-	Assert(MyPState->ring_last <= min_ring_index &&
-		   min_ring_index < MyPState->ring_unused);
+	Assert((is_prefetch && last_slot == NULL) ||
+		   last_slot->status == PRFS_REQUESTED ||
+		   last_slot->status == PRFS_RECEIVED);
 
 	if (flush_every_n_requests > 0 &&
 		MyPState->ring_unused - MyPState->ring_flush >= flush_every_n_requests)
@@ -1152,7 +1366,7 @@ Retry:
 		MyPState->ring_flush = MyPState->ring_unused;
 	}
 
-	return min_ring_index;
+	return last_slot;
 }
 
 static bool
@@ -1172,6 +1386,7 @@ page_server_request(void const *req)
 	NeonResponse *resp;
 	BufferTag tag = {0};
 	shardno_t shard_no;
+	uint64		flight_record_id;
 
 	switch (messageTag(req))
 	{
@@ -1202,8 +1417,15 @@ page_server_request(void const *req)
 		shard_no = 0;
 	}
 
+	flight_record_id = flight_record_request(messageTag(req), shard_no, &tag,
+											 ((NeonRequest *) req)->lsn,
+											 ((NeonRequest *) req)->not_modified_since,
+											 NFR_SOURCE_SYNC);
+
 	do
 	{
+		volatile bool sent = false;
+
 		PG_TRY();
 		{
 			while (!page_server->send(shard_no, (NeonRequest *) req)
@@ -1211,19 +1433,25 @@ page_server_request(void const *req)
 			{
 				/* do nothing */
 			}
-			MyNeonCounters->pageserver_open_requests++;
+			sent = true;
+			NEON_PERF_COUNTER_INC(pageserver_open_requests);
 			consume_prefetch_responses();
 			resp = page_server->receive(shard_no);
-			MyNeonCounters->pageserver_open_requests--;
+			NEON_PERF_COUNTER_SUB(pageserver_open_requests, 1);
 		}
 		PG_CATCH();
 		{
 			/*
-			 * Cancellation in this code needs to be handled better at some
-			 * point, but this currently seems fine for now.
+			 * If the query was cancelled while we were waiting, the
+			 * connection is still fine: leave the response to be discarded
+			 * when it arrives. Any other error may have left the connection
+			 * in an unknown state, so reset it.
 			 */
-			page_server->disconnect(shard_no);
-			MyNeonCounters->pageserver_open_requests = 0;
+			if (!(sent && geterrcode() == ERRCODE_QUERY_CANCELED &&
+				  prefetch_abandon_request(shard_no, flight_record_id)))
+				page_server->disconnect(shard_no);
+			NEON_PERF_COUNTER_SET(pageserver_open_requests,
+				MyPState->n_requests_inflight);
 
 			PG_RE_THROW();
 		}
@@ -1231,6 +1459,8 @@ page_server_request(void const *req)
 
 	} while (resp == NULL);
 
+	flight_record_response(flight_record_id);
+
 	return resp;
 }
 
@@ -1691,6 +1921,114 @@ PageIsEmptyHeapPage(char *buffer)
 	return memcmp(buffer, empty_page.data, BLCKSZ) == 0;
 }
 
+/*
+ * With neon.local_fsm, the primary keeps the FSM fork of permanent relations
+ * in local files, where md.c would keep them. The local copy is
+ * authoritative: FSM pages that are not in the LFC are read from it, and
+ * every evicted FSM page is written to it. Pages that are not in the local
+ * file yet, e.g. after a restart, are fetched from the pageserver once and
+ * then added to it.
+ *
+ * The pageserver's copy is only refreshed now and then: an evicted FSM page
+ * is WAL-logged if it hasn't been logged within the last
+ * neon.local_fsm_sync_distance of WAL. The local files are not fsync'd.
+ * That's all fine, because the FSM is only a hint.
+ */
+static inline bool
+neon_use_local_fsm(ForkNumber forknum)
+{
+	return local_fsm && forknum == FSM_FORKNUM && !RecoveryInProgress();
+}
+
+static bool
+neon_fsm_sync_due(Page page)
+{
+	XLogRecPtr	lsn = PageGetLSN(page);
+
+	return lsn == InvalidXLogRecPtr ||
+		GetXLogInsertRecPtr() - lsn >= (uint64) local_fsm_sync_distance * 1024 * 1024;
+}
+
+/* Serializes extending the local FSM files */
+static LWLockId local_fsm_extend_lock;
+
+void
+LocalFsmShmemInit(void)
+{
+	local_fsm_extend_lock = (LWLockId) GetNamedLWLockTranche("neon_local_fsm");
+}
+
+void
+LocalFsmShmemRequest(void)
+{
+	RequestNamedLWLockTranche("neon_local_fsm", 1);
+}
+
+static bool
+neon_local_fsm_exists(SMgrRelation reln)
+{
+	/* mdexists() reopens the file every time, avoid that when it's open */
+	return reln->md_num_open_segs[FSM_FORKNUM] > 0 || mdexists(reln, FSM_FORKNUM);
+}
+
+/*
+ * Read an FSM page from the local file. Returns false if the page has not
+ * been written to the local file.
+ */
+static bool
+neon_local_fsm_read(SMgrRelation reln, BlockNumber blkno, void *buffer)
+{
+	if (!neon_local_fsm_exists(reln) || blkno >= mdnblocks(reln, FSM_FORKNUM))
+		return false;
+
+#if PG_MAJORVERSION_NUM >= 17
+	mdreadv(reln, FSM_FORKNUM, blkno, &buffer, 1);
+#else
+	mdread(reln, FSM_FORKNUM, blkno, buffer);
+#endif
+
+	/* a hole in the file */
+	return !PageIsNew((Page) buffer);
+}
+
+static void
+neon_local_fsm_write(SMgrRelation reln, BlockNumber blkno, const void *buffer)
+{
+	bool		extend;
+
+	if (PageIsNew((Page) buffer))
+		return;
+
+	/* isRedo makes mdcreate() tolerate a concurrent creation of the file */
+	if (!neon_local_fsm_exists(reln))
+		mdcreate(reln, FSM_FORKNUM, true);
+
+	/*
+	 * Other backends may be extending the file concurrently, as they evict
+	 * other FSM pages. Recheck the size while holding the lock, so that we
+	 * don't mdextend() over a block that someone else has just added. The
+	 * FSM is small, so extending it is rare enough for a single lock.
+	 */
+	extend = blkno >= mdnblocks(reln, FSM_FORKNUM);
+	if (extend)
+	{
+		LWLockAcquire(local_fsm_extend_lock, LW_EXCLUSIVE);
+		extend = blkno >= mdnblocks(reln, FSM_FORKNUM);
+		if (extend)
+			mdextend(reln, FSM_FORKNUM, blkno, (char *) buffer, true);
+		LWLockRelease(local_fsm_extend_lock);
+	}
+
+	if (!extend)
+	{
+#if PG_MAJORVERSION_NUM >= 17
+		mdwritev(reln, FSM_FORKNUM, blkno, &buffer, 1, true);
+#else
+		mdwrite(reln, FSM_FORKNUM, blkno, (char *) buffer, true);
+#endif
+	}
+}
+
 #if PG_MAJORVERSION_NUM >= 17
 static void
 neon_wallog_pagev(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
@@ -1720,6 +2058,14 @@ neon_wallog_pagev(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			 (forknum == FSM_FORKNUM || forknum == VISIBILITYMAP_FORKNUM))
 	{
 		log_pages = true;
+
+		/* A locally maintained FSM only needs to be synced now and then */
+		if (neon_use_local_fsm(forknum))
+		{
+			log_pages = false;
+			for (int i = 0; i < nblocks && !log_pages; i++)
+				log_pages = neon_fsm_sync_due((Page) buffers[i]);
+		}
 	}
 
 	if (log_pages)
@@ -1839,16 +2185,20 @@ neon_wallog_pagev(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 /*
  * A page is being evicted from the shared buffer cache. Update the
  * last-written LSN of the page, and WAL-log it if needed.
+ *
+ * Returns the LSN of the WAL record if the page was WAL-logged, or
+ * InvalidXLogRecPtr. The page itself is not modified.
  */
 #if PG_MAJORVERSION_NUM < 16
-static void
+static XLogRecPtr
 neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, char *buffer, bool force)
 #else
-static void
+static XLogRecPtr
 neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, const char *buffer, bool force)
 #endif
 {
 	XLogRecPtr	lsn = PageGetLSN((Page) buffer);
+	XLogRecPtr	recptr = InvalidXLogRecPtr;
 	bool		log_page;
 
 	/*
@@ -1868,17 +2218,18 @@ neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, co
 			 !ShutdownRequestPending &&
 			 (forknum == FSM_FORKNUM || forknum == VISIBILITYMAP_FORKNUM))
 	{
-		log_page = true;
+		/* A locally maintained FSM only needs to be synced now and then */
+		log_page = !neon_use_local_fsm(forknum) ||
+			neon_fsm_sync_due((Page) buffer);
 	}
 
 	if (log_page)
 	{
-		XLogRecPtr	recptr;
-
 		recptr = log_newpage_copy(&InfoFromSMgrRel(reln), forknum, blocknum,
 								  (Page) buffer, false);
 		XLogFlush(recptr);
 		lsn = recptr;
+
 		ereport(SmgrTrace,
 				(errmsg(NEON_TAG "Page %u of relation %u/%u/%u.%u was force logged. Evicted at lsn=%X/%X",
 						blocknum,
@@ -1957,6 +2308,8 @@ neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, co
 	 * read the same or newer version of it.
 	 */
 	SetLastWrittenLSNForBlock(lsn, InfoFromSMgrRel(reln), forknum, blocknum);
+
+	return recptr;
 }
 
 /*
@@ -1965,8 +2318,6 @@ neon_wallog_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, co
 static void
 neon_init(void)
 {
-	Size		prfs_size;
-
 	if (MyPState != NULL)
 		return;
 
@@ -1980,16 +2331,11 @@ neon_init(void)
 	 * releases.
 	 */
 #if PG_VERSION_NUM>=150000
-	if (MyNeonCounters >= &neon_per_backend_counters_shared[NUM_NEON_PERF_COUNTER_SLOTS])
+	if ((void *) MyNeonCounters >= (void *) &neon_per_backend_counters_shared[NUM_NEON_PERF_COUNTER_SLOTS])
 		elog(ERROR, "MyNeonCounters points past end of array");
 #endif
 
-	prfs_size = offsetof(PrefetchState, prf_buffer) +
-		sizeof(PrefetchRequest) * readahead_buffer_size;
-
-	MyPState = MemoryContextAllocZero(TopMemoryContext, prfs_size);
-
-	MyPState->n_unused = readahead_buffer_size;
+	MyPState = prefetch_state_alloc(readahead_buffer_size);
 
 	MyPState->bufctx = SlabContextCreate(TopMemoryContext,
 										 "NeonSMGR/prefetch",
@@ -2005,6 +2351,8 @@ neon_init(void)
 	MyPState->prf_hash = prfh_create(MyPState->hashctx,
 									 readahead_buffer_size, NULL);
 
+	on_shmem_exit(prefetch_budget_shmem_exit, (Datum) 0);
+
 	old_redo_read_buffer_filter = redo_read_buffer_filter;
 	redo_read_buffer_filter = neon_redo_read_buffer_filter;
 
@@ -2137,6 +2485,17 @@ neon_get_request_lsns(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber blkno,
 		 * so we would get blocked waiting the redo function to release the
 		 * lock. To emulate that, wait for the WAL replay of the record to
 		 * finish.
+		 *
+		 * The pageserver only waits for the WAL up to not_modified_since to
+		 * be ingested, not up to request_lsn. So a read on a replica depends
+		 * on the pageserver's ingest lag only if the page was modified by a
+		 * record that neon_redo_read_buffer_filter() skipped recently. We
+		 * cannot request an older version of such a page and replay the
+		 * newer records on it in the backend: the redo functions work on
+		 * shared buffers, and assume that they run in the startup process.
+		 * Instead, with neon.replica_lfc_redo, the startup process replays
+		 * common records on pages that are in the LFC, so that those pages
+		 * don't need to be read from the pageserver at all.
 		 */
 		/* Request the page at the end of the last fully replayed LSN. */
 		XLogRecPtr replay_lsn = GetXLogReplayRecPtr(NULL);
@@ -2357,7 +2716,6 @@ neon_exists(SMgrRelation reln, ForkNumber forkNum)
 {
 	bool		exists;
 	NeonResponse *resp;
-	BlockNumber n_blocks;
 	neon_request_lsns request_lsns;
 
 	switch (reln->smgr_relpersistence)
@@ -2385,9 +2743,9 @@ neon_exists(SMgrRelation reln, ForkNumber forkNum)
 			neon_log(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
-	if (get_cached_relsize(InfoFromSMgrRel(reln), forkNum, &n_blocks))
+	if (get_cached_relexists(InfoFromSMgrRel(reln), forkNum, &exists))
 	{
-		return true;
+		return exists;
 	}
 
 	/*
@@ -2475,6 +2833,16 @@ neon_exists(SMgrRelation reln, ForkNumber forkNum)
 		}
 		pfree(resp);
 	}
+
+	/*
+	 * Remember forks that don't exist, so that we don't need to ask again.
+	 * Only on a primary: all forks are created by this node, and the
+	 * negative entry is replaced when that happens. On a replica, the fork
+	 * could be created by the primary without our noticing.
+	 */
+	if (!exists && !RecoveryInProgress())
+		set_cached_relsize_absent(InfoFromSMgrRel(reln), forkNum);
+
 	return exists;
 }
 
@@ -2570,6 +2938,12 @@ neon_unlink(NRelFileInfoBackend rinfo, ForkNumber forkNum, bool isRedo)
 	mdunlink(rinfo, forkNum, isRedo);
 	if (!NRelFileInfoBackendIsTemp(rinfo))
 	{
+		BlockNumber nblocks;
+
+		if (!get_cached_relsize(InfoFromNInfoB(rinfo), forkNum, &nblocks))
+			nblocks = InvalidBlockNumber;
+		lfc_invalidate(InfoFromNInfoB(rinfo), forkNum, 0, nblocks);
+
 		forget_cached_relsize(InfoFromNInfoB(rinfo), forkNum);
 	}
 }
@@ -2808,7 +3182,7 @@ static bool
 neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			  int nblocks)
 {
-	uint64		ring_index PG_USED_FOR_ASSERTS_ONLY;
+	PrefetchRequest *slot PG_USED_FOR_ASSERTS_ONLY;
 	BufferTag	tag;
 
 	switch (reln->smgr_relpersistence)
@@ -2836,8 +3210,12 @@ neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		bits8		lfc_present[PG_IOV_MAX / 8];
 		memset(lfc_present, 0, sizeof(lfc_present));
 
-		if (lfc_cache_containsv(InfoFromSMgrRel(reln), forknum, blocknum,
-								iterblocks, lfc_present) == iterblocks)
+		/*
+		 * Blocks that are in the LFC don't need to be requested from the
+		 * pageserver, but lfc_prefetchv() starts reading them from disk.
+		 */
+		if (lfc_prefetchv(InfoFromSMgrRel(reln), forknum, blocknum,
+						  iterblocks, lfc_present) == iterblocks)
 		{
 			nblocks -= iterblocks;
 			blocknum += iterblocks;
@@ -2849,13 +3227,12 @@ neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		for (int i = 0; i < PG_IOV_MAX / 8; i++)
 			lfc_present[i] = ~(lfc_present[i]);
 
-		ring_index = prefetch_register_bufferv(tag, NULL, iterblocks,
-											   lfc_present, true);
+		slot = prefetch_register_bufferv(tag, NULL, iterblocks,
+										 lfc_present, true);
 		nblocks -= iterblocks;
 		blocknum += iterblocks;
 
-		Assert(ring_index < MyPState->ring_unused &&
-			   MyPState->ring_last <= ring_index);
+		Assert(slot == NULL || slot->status != PRFS_UNUSED);
 	}
 
 	prefetch_pump_state();
@@ -2871,7 +3248,7 @@ neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 static bool
 neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum)
 {
-	uint64		ring_index PG_USED_FOR_ASSERTS_ONLY;
+	PrefetchRequest *slot PG_USED_FOR_ASSERTS_ONLY;
 	BufferTag	tag;
 
 	switch (reln->smgr_relpersistence)
@@ -2888,18 +3265,23 @@ neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum)
 			neon_log(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
-	if (lfc_cache_contains(InfoFromSMgrRel(reln), forknum, blocknum))
-		return false;
+	{
+		bits8		lfc_present = 0;
+
+		/* If the block is in the LFC, this starts reading it from disk */
+		if (lfc_prefetchv(InfoFromSMgrRel(reln), forknum, blocknum,
+						  1, &lfc_present) == 1)
+			return false;
+	}
 
 	tag.forkNum = forknum;
 	tag.blockNum = blocknum;
 
 	CopyNRelFileInfoToBufTag(tag, InfoFromSMgrRel(reln));
 
-	ring_index = prefetch_register_bufferv(tag, NULL, 1, NULL, true);
+	slot = prefetch_register_bufferv(tag, NULL, 1, NULL, true);
 
-	Assert(ring_index < MyPState->ring_unused &&
-		   MyPState->ring_last <= ring_index);
+	Assert(slot == NULL || slot->status != PRFS_UNUSED);
 
 	prefetch_pump_state();
 
@@ -2956,14 +3338,13 @@ neon_writeback(SMgrRelation reln, ForkNumber forknum,
 static void
 #if PG_MAJORVERSION_NUM < 16
 neon_read_at_lsnv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber base_blockno, neon_request_lsns *request_lsns,
-				  char **buffers, BlockNumber nblocks, const bits8 *mask)
+				  char **buffers, BlockNumber nblocks, const bits8 *mask, bool write_lfc)
 #else
 neon_read_at_lsnv(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber base_blockno, neon_request_lsns *request_lsns,
-				  void **buffers, BlockNumber nblocks, const bits8 *mask)
+				  void **buffers, BlockNumber nblocks, const bits8 *mask, bool write_lfc)
 #endif
 {
 	NeonResponse *resp;
-	uint64		ring_index;
 	PrfHashEntry *entry;
 	PrefetchRequest *slot;
 	PrefetchRequest hashkey;
@@ -3023,11 +3404,7 @@ Retry:
 		if (entry != NULL)
 		{
 			slot = entry->slot;
-			if (neon_prefetch_response_usable(reqlsns, slot))
-			{
-				ring_index = slot->my_ring_index;
-			}
-			else
+			if (!neon_prefetch_response_usable(reqlsns, slot))
 			{
 				/*
 				 * Cannot use this prefetch, discard it
@@ -3043,9 +3420,9 @@ Retry:
 						goto Retry;
 				}
 				/* drop caches */
-				prefetch_set_unused(slot->my_ring_index);
+				prefetch_set_unused(slot);
 				pgBufferUsage.prefetch.expired += 1;
-				MyNeonCounters->getpage_prefetch_discards_total++;
+				NEON_PERF_COUNTER_INC(getpage_prefetch_discards_total);
 				/* make it look like a prefetch cache miss */
 				entry = NULL;
 			}
@@ -3055,9 +3432,8 @@ Retry:
 		{
 			if (entry == NULL)
 			{
-				ring_index = prefetch_register_bufferv(hashkey.buftag, reqlsns, 1, NULL, false);
-				Assert(ring_index != UINT64_MAX);
-				slot = GetPrfSlot(ring_index);
+				slot = prefetch_register_bufferv(hashkey.buftag, reqlsns, 1, NULL, false);
+				Assert(slot != NULL);
 			}
 			else
 			{
@@ -3071,13 +3447,10 @@ Retry:
 				entry = NULL;
 			}
 
-			Assert(slot->my_ring_index == ring_index);
-			Assert(MyPState->ring_last <= ring_index &&
-				   MyPState->ring_unused > ring_index);
 			Assert(slot->status != PRFS_UNUSED);
-			Assert(GetPrfSlot(ring_index) == slot);
+			Assert(MyPState->ring_unused > slot->my_ring_index);
 
-		} while (!prefetch_wait_for(ring_index));
+		} while (!prefetch_wait_for(slot->my_ring_index));
 
 		Assert(slot->status == PRFS_RECEIVED);
 		Assert(memcmp(&hashkey.buftag, &slot->buftag, sizeof(BufferTag)) == 0);
@@ -3106,7 +3479,9 @@ Retry:
 					}
 				}
 				memcpy(buffer, getpage_resp->page, BLCKSZ);
-				lfc_write(rinfo, forkNum, blockno, buffer);
+				if (write_lfc)
+					lfc_write(rinfo, forkNum, blockno, buffer);
+				flight_record_consumed(slot->flight_record_id);
 				break;
 			}
 			case T_NeonErrorResponse:
@@ -3136,11 +3511,10 @@ Retry:
 		}
 
 		/* buffer was used, clean up for later reuse */
-		prefetch_set_unused(ring_index);
-		prefetch_cleanup_trailing_unused();
+		prefetch_set_unused(slot);
 
 		end_ts = GetCurrentTimestamp();
-		inc_getpage_wait(end_ts >= start_ts ? (end_ts - start_ts) : 0);
+		inc_getpage_wait(rinfo, forkNum, end_ts >= start_ts ? (end_ts - start_ts) : 0);
 	}
 }
 
@@ -3157,7 +3531,113 @@ neon_read_at_lsn(NRelFileInfo rinfo, ForkNumber forkNum, BlockNumber blkno,
 				 neon_request_lsns request_lsns, void *buffer)
 #endif
 {
-	neon_read_at_lsnv(rinfo, forkNum, blkno, &request_lsns, &buffer, 1, NULL);
+	neon_read_at_lsnv(rinfo, forkNum, blkno, &request_lsns, &buffer, 1, NULL, true);
+}
+
+/*
+ * neon_prewarm_fork() -- Load a relation fork into the LFC.
+ *
+ * The pages that aren't in the LFC yet are fetched from the pageserver and
+ * written to the LFC with lfc_prewarmv(), without going through shared
+ * buffers. The requests are sent ahead through the prefetch buffer, up to
+ * neon.readahead_buffer_size pages, so that the pageserver is kept busy
+ * while we write. The progress is reported in the backend's
+ * file_cache_prewarm_* perf counters.
+ *
+ * Returns the number of pages loaded.
+ */
+BlockNumber
+neon_prewarm_fork(SMgrRelation reln, ForkNumber forknum)
+{
+	NRelFileInfo rinfo = InfoFromSMgrRel(reln);
+	BlockNumber nblocks;
+	BlockNumber prefetch_blkno = 0;
+	BlockNumber loaded = 0;
+	BufferTag	tag;
+	char	   *chunk;
+#if PG_MAJORVERSION_NUM < 16
+	char	   *buffers[PG_IOV_MAX];
+#else
+	void	   *buffers[PG_IOV_MAX];
+#endif
+
+	if (lfc_maybe_disabled())
+		return 0;
+
+	nblocks = neon_nblocks(reln, forknum);
+	if (nblocks == 0)
+		return 0;
+
+	memset(&tag, 0, sizeof(BufferTag));
+	CopyNRelFileInfoToBufTag(tag, rinfo);
+	tag.forkNum = forknum;
+
+#if PG_MAJORVERSION_NUM >= 16
+	chunk = palloc_aligned(PG_IOV_MAX * BLCKSZ, PG_IO_ALIGN_SIZE, 0);
+#else
+	chunk = palloc(PG_IOV_MAX * BLCKSZ);
+#endif
+	for (int i = 0; i < PG_IOV_MAX; i++)
+		buffers[i] = chunk + i * BLCKSZ;
+
+	NEON_PERF_COUNTER_SET(file_cache_prewarm_pages_remaining, nblocks);
+
+	for (BlockNumber blkno = 0; blkno < nblocks; blkno += PG_IOV_MAX)
+	{
+		BlockNumber n = Min(nblocks - blkno, PG_IOV_MAX);
+		BlockNumber prefetch_end = Min(nblocks, blkno + Max(readahead_buffer_size, n));
+		bits8		mask[PG_IOV_MAX / 8];
+		neon_request_lsns request_lsns[PG_IOV_MAX];
+		XLogRecPtr	lsns[PG_IOV_MAX];
+		int			written;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Keep the prefetch buffer filled with requests for the next pages */
+		while (prefetch_blkno < prefetch_end)
+		{
+			BlockNumber k = Min(prefetch_end - prefetch_blkno, PG_IOV_MAX);
+
+			memset(mask, 0, sizeof(mask));
+			if (lfc_cache_containsv(rinfo, forknum, prefetch_blkno, k, mask) < k)
+			{
+				for (int i = 0; i < PG_IOV_MAX / 8; i++)
+					mask[i] = ~(mask[i]);
+				tag.blockNum = prefetch_blkno;
+				prefetch_register_bufferv(tag, NULL, k, mask, true);
+			}
+			prefetch_blkno += k;
+		}
+
+		memset(mask, 0, sizeof(mask));
+		if (lfc_cache_containsv(rinfo, forknum, blkno, n, mask) < n)
+		{
+			for (int i = 0; i < PG_IOV_MAX / 8; i++)
+				mask[i] = ~(mask[i]);
+
+			neon_get_request_lsns(rinfo, forknum, blkno, request_lsns, n, mask);
+			neon_read_at_lsnv(rinfo, forknum, blkno, request_lsns, buffers, n,
+							  mask, false);
+
+			/* Pages we didn't fetch are left alone by lfc_prewarmv() */
+			for (int i = 0; i < n; i++)
+				lsns[i] = BITMAP_ISSET(mask, i) ?
+					request_lsns[i].not_modified_since : InvalidXLogRecPtr;
+
+			written = lfc_prewarmv(rinfo, forknum, blkno,
+								   (const void *const *) buffers, n, lsns);
+			loaded += written;
+			NEON_PERF_COUNTER_ADD(file_cache_prewarm_pages_total, written);
+		}
+
+		NEON_PERF_COUNTER_SET(file_cache_prewarm_pages_remaining,
+							  nblocks - (blkno + n));
+	}
+
+	prefetch_pump_state();
+	pfree(chunk);
+
+	return loaded;
 }
 
 #if PG_MAJORVERSION_NUM < 17
@@ -3173,6 +3653,7 @@ neon_read(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno, void *buffer
 #endif
 {
 	neon_request_lsns request_lsns;
+	uint64		lfc_start_us;
 
 	switch (reln->smgr_relpersistence)
 	{
@@ -3192,15 +3673,24 @@ neon_read(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno, void *buffer
 	}
 
 	/* Try to read from local file cache */
+	lfc_start_us = flight_recorder_enabled ? flight_recorder_now_us() : 0;
 	if (lfc_read(InfoFromSMgrRel(reln), forkNum, blkno, buffer))
 	{
-		MyNeonCounters->file_cache_hits_total++;
+		NEON_PERF_COUNTER_INC(file_cache_hits_total);
+		flight_record_lfc_reads(InfoFromSMgrRel(reln), forkNum, blkno, 1,
+								NULL, lfc_start_us);
 		return;
 	}
 
+	if (neon_use_local_fsm(forkNum) && neon_local_fsm_read(reln, blkno, buffer))
+		return;
+
 	neon_get_request_lsns(InfoFromSMgrRel(reln), forkNum, blkno, &request_lsns, 1, NULL);
 	neon_read_at_lsn(InfoFromSMgrRel(reln), forkNum, blkno, request_lsns, buffer);
 
+	if (neon_use_local_fsm(forkNum))
+		neon_local_fsm_write(reln, blkno, buffer);
+
 	prefetch_pump_state();
 
 #ifdef DEBUG_COMPARE_LOCAL
@@ -3279,13 +3769,25 @@ neon_read(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno, void *buffer
 #endif /* PG_MAJORVERSION_NUM <= 16 */
 
 #if PG_MAJORVERSION_NUM >= 17
+/*
+ *	neon_readv() -- Read the specified blocks from a relation.
+ *
+ * Blocks that are in the LFC are read from it, the rest are requested from
+ * the pageserver. The pageserver requests are sent and flushed before the
+ * LFC is read, so that they are in flight while we do the local I/O, and
+ * lfc_prefetchv() has hinted the kernel to start reading the LFC blocks by
+ * then. Blocks that are evicted from the LFC in the meantime are requested
+ * from the pageserver afterwards.
+ */
 static void
 neon_readv(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		void **buffers, BlockNumber nblocks)
 {
+	bits8		lfc_present[PG_IOV_MAX / 8];	/* blocks to read from the LFC */
+	bits8		pending[PG_IOV_MAX / 8];	/* blocks requested from the PS */
 	bits8		read[PG_IOV_MAX / 8];
 	neon_request_lsns request_lsns[PG_IOV_MAX];
-	int			lfc_result;
+	bool		any_pending = false;
 
 	switch (reln->smgr_relpersistence)
 	{
@@ -3308,37 +3810,152 @@ neon_readv(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		neon_log(ERROR, "Read request too large: %d is larger than max %d",
 				 nblocks, PG_IOV_MAX);
 
-	memset(read, 0, sizeof(read));
+	memset(lfc_present, 0, sizeof(lfc_present));
+	memset(pending, 0, sizeof(pending));
+	memset(read, 0, sizeof(read));
+
+	/*
+	 * Request the blocks that are not in the LFC from the pageserver first.
+	 * Local FSM pages are read from the local file below instead.
+	 */
+	if (lfc_prefetchv(InfoFromSMgrRel(reln), forknum, blocknum, nblocks,
+					  lfc_present) < nblocks &&
+		!neon_use_local_fsm(forknum))
+	{
+		for (int i = 0; i < nblocks; i++)
+		{
+			if (!BITMAP_ISSET(lfc_present, i))
+			{
+				BITMAP_SET(pending, i);
+				any_pending = true;
+			}
+		}
+	}
+
+	if (any_pending)
+	{
+		BufferTag	tag;
+
+		neon_get_request_lsns(InfoFromSMgrRel(reln), forknum, blocknum,
+							  request_lsns, nblocks, pending);
+
+		memset(&tag, 0, sizeof(BufferTag));
+		CopyNRelFileInfoToBufTag(tag, InfoFromSMgrRel(reln));
+		tag.forkNum = forknum;
+		tag.blockNum = blocknum;
+
+		prefetch_register_bufferv(tag, request_lsns, nblocks, pending, false);
+
+		/*
+		 * Make sure the requests are on their way. If that fails, the
+		 * prefetch state has been reset, and neon_read_at_lsnv() will send
+		 * them again.
+		 */
+		if (MyPState->ring_flush < MyPState->ring_unused &&
+			prefetch_flush_requests())
+			MyPState->ring_flush = MyPState->ring_unused;
+	}
+
+	/* Read the LFC blocks while the pageserver requests are in flight */
+	for (int i = 0; i < nblocks; i++)
+	{
+		if (BITMAP_ISSET(lfc_present, i))
+		{
+			int			lfc_result;
+			uint64		lfc_start_us;
 
-	/* Try to read from local file cache */
-	lfc_result = lfc_readv_select(InfoFromSMgrRel(reln), forknum, blocknum, buffers,
-								  nblocks, read);
+			lfc_start_us = flight_recorder_enabled ? flight_recorder_now_us() : 0;
+			lfc_result = lfc_readv_select(InfoFromSMgrRel(reln), forknum,
+										  blocknum, buffers, nblocks, read);
+			if (lfc_result > 0)
+			{
+				NEON_PERF_COUNTER_ADD(file_cache_hits_total, lfc_result);
+				flight_record_lfc_reads(InfoFromSMgrRel(reln), forknum, blocknum,
+										nblocks, read, lfc_start_us);
+			}
+			else if (lfc_result == -1)
+			{
+				/* can't use the LFC result */
+				memset(read, 0, sizeof(read));
+			}
+			break;
+		}
+	}
 
-	if (lfc_result > 0)
-		MyNeonCounters->file_cache_hits_total += lfc_result;
+	/*
+	 * Invert the result: whatever wasn't read from the LFC, we need from the
+	 * pageserver. lfc_readv_select() may have scribbled over the other
+	 * buffers, so they must be filled in after it.
+	 */
+	any_pending = false;
+	for (int i = 0; i < nblocks; i++)
+	{
+		if (BITMAP_ISSET(read, i))
+			BITMAP_CLR(read, i);
+		else
+		{
+			BITMAP_SET(read, i);
+			any_pending = true;
+		}
+	}
 
-	/* Read all blocks from LFC, so we're done */
-	if (lfc_result == nblocks)
+	if (!any_pending)
 		return;
 
-	if (lfc_result == -1)
+	if (neon_use_local_fsm(forknum))
 	{
-		/* can't use the LFC result, so read all blocks from PS */
-		for (int i = 0; i < PG_IOV_MAX / 8; i++)
-			read[i] = 0xFF;
+		bool		all_local = true;
+
+		for (int i = 0; i < nblocks; i++)
+		{
+			if (!BITMAP_ISSET(read, i))
+				continue;
+			if (neon_local_fsm_read(reln, blocknum + i, buffers[i]))
+				BITMAP_CLR(read, i);
+			else
+				all_local = false;
+		}
+		if (all_local)
+		{
+			prefetch_pump_state();
+			return;
+		}
 	}
-	else
+
+	/*
+	 * The blocks that were requested above have their request LSNs already.
+	 * Blocks that dropped out of the LFC since then, or that weren't
+	 * requested because of the local FSM, need them now.
+	 */
 	{
-		/* invert the result: exclude blocks read from lfc */
-		for (int i = 0; i < PG_IOV_MAX / 8; i++)
-			read[i] = ~(read[i]);
+		bits8		late[PG_IOV_MAX / 8];
+		bool		any_late = false;
+
+		memset(late, 0, sizeof(late));
+		for (int i = 0; i < nblocks; i++)
+		{
+			if (BITMAP_ISSET(read, i) && !BITMAP_ISSET(pending, i))
+			{
+				BITMAP_SET(late, i);
+				any_late = true;
+			}
+		}
+		if (any_late)
+			neon_get_request_lsns(InfoFromSMgrRel(reln), forknum, blocknum,
+								  request_lsns, nblocks, late);
 	}
 
-	neon_get_request_lsns(InfoFromSMgrRel(reln), forknum, blocknum,
-						  request_lsns, nblocks, read);
+	neon_read_at_lsnv(InfoFromSMgrRel(reln), forknum, blocknum,
+					  request_lsns, buffers, nblocks, read, true);
 
-	neon_read_at_lsnv(InfoFromSMgrRel(reln), forknum, blocknum, request_lsns,
-					  buffers, nblocks, read);
+	if (neon_use_local_fsm(forknum))
+	{
+		for (int i = 0; i < nblocks; i++)
+		{
+			if (BITMAP_ISSET(read, i))
+				neon_local_fsm_write(reln, blocknum + i, buffers[i]);
+		}
+	}
 
 	prefetch_pump_state();
 
@@ -3461,12 +4078,18 @@ neon_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, const vo
 #endif
 {
 	XLogRecPtr	lsn;
+	XLogRecPtr	synced_lsn;
+	PGAlignedBlock synced_copy;
 
 	switch (reln->smgr_relpersistence)
 	{
 		case 0:
-			/* This is a bit tricky. Check if the relation exists locally */
-			if (mdexists(reln, forknum))
+			/*
+			 * This is a bit tricky. Check if the relation exists locally.
+			 * With neon.local_fsm, the FSM of permanent relations is kept
+			 * locally too, so look at the main fork instead.
+			 */
+			if (mdexists(reln, neon_use_local_fsm(forknum) ? MAIN_FORKNUM : forknum))
 			{
 				/* It exists locally. Guess it's unlogged then. */
 #if PG_MAJORVERSION_NUM >= 17
@@ -3500,7 +4123,25 @@ neon_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum, const vo
 			neon_log(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
-	neon_wallog_page(reln, forknum, blocknum, buffer, false);
+	synced_lsn = neon_wallog_page(reln, forknum, blocknum, buffer, false);
+
+	if (neon_use_local_fsm(forknum))
+	{
+		/*
+		 * Remember when the page was synced, for neon_fsm_sync_due(). The
+		 * caller's buffer has already been checksummed and may be shared, so
+		 * stamp the LSN on a copy, and write that to the local file and the
+		 * LFC instead.
+		 */
+		if (synced_lsn != InvalidXLogRecPtr)
+		{
+			memcpy(synced_copy.data, buffer, BLCKSZ);
+			PageSetLSN((Page) synced_copy.data, synced_lsn);
+			PageSetChecksumInplace((Page) synced_copy.data, blocknum);
+			buffer = synced_copy.data;
+		}
+		neon_local_fsm_write(reln, blocknum, buffer);
+	}
 
 	lsn = PageGetLSN((Page) buffer);
 	neon_log(SmgrTrace, "smgrwrite called for %u/%u/%u.%u blk %u, page LSN: %X/%08X",
@@ -3533,8 +4174,12 @@ neon_writev(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno,
 	switch (reln->smgr_relpersistence)
 	{
 		case 0:
-			/* This is a bit tricky. Check if the relation exists locally */
-			if (mdexists(reln, forknum))
+			/*
+			 * This is a bit tricky. Check if the relation exists locally.
+			 * With neon.local_fsm, the FSM of permanent relations is kept
+			 * locally too, so look at the main fork instead.
+			 */
+			if (mdexists(reln, neon_use_local_fsm(forknum) ? MAIN_FORKNUM : forknum))
 			{
 				/* It exists locally. Guess it's unlogged then. */
 				mdwritev(reln, forknum, blkno, buffers, nblocks, skipFsync);
@@ -3563,6 +4208,12 @@ neon_writev(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno,
 
 	neon_wallog_pagev(reln, forknum, blkno, nblocks, (const char **) buffers, false);
 
+	if (neon_use_local_fsm(forknum))
+	{
+		for (int i = 0; i < nblocks; i++)
+			neon_local_fsm_write(reln, blkno + i, buffers[i]);
+	}
+
 	lfc_writev(InfoFromSMgrRel(reln), forknum, blkno, buffers, nblocks);
 
 	prefetch_pump_state();
@@ -3768,6 +4419,7 @@ static void
 neon_truncate(SMgrRelation reln, ForkNumber forknum, BlockNumber nblocks)
 {
 	XLogRecPtr	lsn;
+	BlockNumber old_nblocks;
 
 	switch (reln->smgr_relpersistence)
 	{
@@ -3787,8 +4439,17 @@ neon_truncate(SMgrRelation reln, ForkNumber forknum, BlockNumber nblocks)
 			neon_log(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
+	if (!get_cached_relsize(InfoFromSMgrRel(reln), forknum, &old_nblocks))
+		old_nblocks = InvalidBlockNumber;
 	set_cached_relsize(InfoFromSMgrRel(reln), forknum, nblocks);
 
+	/* Don't let the truncated pages take up space in the LFC until they age out */
+	lfc_invalidate(InfoFromSMgrRel(reln), forknum, nblocks, old_nblocks);
+
+	if (neon_use_local_fsm(forknum) && neon_local_fsm_exists(reln) &&
+		mdnblocks(reln, forknum) > nblocks)
+		mdtruncate(reln, forknum, nblocks);
+
 	/*
 	 * Truncating a relation drops all its buffers from the buffer cache
 	 * without calling smgrwrite() on them. But we must account for that in
@@ -3993,6 +4654,61 @@ neon_finish_unlogged_build_phase_1(SMgrRelation reln)
 		unlogged_build_phase = UNLOGGED_BUILD_PHASE_2;
 }
 
+/*
+ * Copy the local copy of a relation built in unlogged mode to the LFC, in
+ * chunks of PG_IOV_MAX blocks. The pages will typically be read right after
+ * the build, and the local copy is about to be removed.
+ *
+ * The relation's dirty buffers are flushed to the local file first, while
+ * the relation still looks unlogged. Otherwise a page could be written by
+ * the checkpointer or the bgwriter between reading it from the local file
+ * and copying it to the LFC, and the LFC would keep the older version.
+ * Nobody else can modify the pages of the relation while it is being built.
+ */
+static void
+unlogged_build_populate_lfc_from_local(SMgrRelation reln)
+{
+	NRelFileInfo rinfo = InfoFromSMgrRel(reln);
+	BlockNumber nblocks;
+	char	   *chunk;
+	void	   *buffers[PG_IOV_MAX];
+
+	if (!unlogged_build_populate_lfc || lfc_maybe_disabled())
+		return;
+
+	Assert(reln->smgr_relpersistence == RELPERSISTENCE_UNLOGGED);
+	FlushRelationsAllBuffers(&reln, 1);
+
+	nblocks = mdnblocks(reln, MAIN_FORKNUM);
+	if (nblocks == 0)
+		return;
+
+#if PG_MAJORVERSION_NUM >= 16
+	chunk = palloc_aligned(PG_IOV_MAX * BLCKSZ, PG_IO_ALIGN_SIZE, 0);
+#else
+	chunk = palloc(PG_IOV_MAX * BLCKSZ);
+#endif
+	for (int i = 0; i < PG_IOV_MAX; i++)
+		buffers[i] = chunk + i * BLCKSZ;
+
+	for (BlockNumber blkno = 0; blkno < nblocks; blkno += PG_IOV_MAX)
+	{
+		BlockNumber n = Min(nblocks - blkno, PG_IOV_MAX);
+
+		CHECK_FOR_INTERRUPTS();
+
+#if PG_MAJORVERSION_NUM >= 17
+		mdreadv(reln, MAIN_FORKNUM, blkno, buffers, n);
+#else
+		for (BlockNumber i = 0; i < n; i++)
+			mdread(reln, MAIN_FORKNUM, blkno + i, buffers[i]);
+#endif
+		lfc_writev(rinfo, MAIN_FORKNUM, blkno, (const void *const *) buffers, n);
+	}
+
+	pfree(chunk);
+}
+
 /*
  * neon_end_unlogged_build() -- Finish an unlogged rel build.
  *
@@ -4018,6 +4734,8 @@ neon_end_unlogged_build(SMgrRelation reln)
 		Assert(unlogged_build_phase == UNLOGGED_BUILD_PHASE_2);
 		Assert(reln->smgr_relpersistence == RELPERSISTENCE_UNLOGGED);
 
+		unlogged_build_populate_lfc_from_local(reln);
+
 		/* Make the relation look permanent again */
 		reln->smgr_relpersistence = RELPERSISTENCE_PERMANENT;
 
@@ -4042,36 +4760,28 @@ neon_end_unlogged_build(SMgrRelation reln)
 
 #define STRPREFIX(str, prefix) (strncmp(str, prefix, strlen(prefix)) == 0)
 
-static int
-neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buffer)
+/*
+ * Compute the request LSNs to use for fetching SLRU segments, similar to
+ * neon_get_request_lsns() but the logic is a bit simpler.
+ */
+static void
+neon_get_slru_request_lsns(XLogRecPtr *request_lsn, XLogRecPtr *not_modified_since)
 {
-	XLogRecPtr	request_lsn,
-				not_modified_since;
-	SlruKind	kind;
-	int			n_blocks;
-	shardno_t	shard_no = 0; /* All SLRUs are at shard 0 */
-	NeonResponse *resp;
-	NeonGetSlruSegmentRequest request;
-
-	/*
-	 * Compute a request LSN to use, similar to neon_get_request_lsns() but the
-	 * logic is a bit simpler.
-	 */
 	if (RecoveryInProgress())
 	{
-		request_lsn = GetXLogReplayRecPtr(NULL);
-		if (request_lsn == InvalidXLogRecPtr)
+		*request_lsn = GetXLogReplayRecPtr(NULL);
+		if (*request_lsn == InvalidXLogRecPtr)
 		{
 			/*
 			 * This happens in neon startup, we start up without replaying any
 			 * records.
 			 */
-			request_lsn = GetRedoStartLsn();
+			*request_lsn = GetRedoStartLsn();
 		}
-		request_lsn = nm_adjust_lsn(request_lsn);
+		*request_lsn = nm_adjust_lsn(*request_lsn);
 	}
 	else
-		request_lsn = UINT64_MAX;
+		*request_lsn = UINT64_MAX;
 
 	/*
 	 * GetRedoStartLsn() returns LSN of the basebackup. We know that the SLRU
@@ -4079,34 +4789,18 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 	 * modify it, we would have had to download it already. And once
 	 * downloaded, we never evict SLRU segments from local disk.
 	 */
-	not_modified_since = nm_adjust_lsn(GetRedoStartLsn());
-
-	if (STRPREFIX(path, "pg_xact"))
-		kind = SLRU_CLOG;
-	else if (STRPREFIX(path, "pg_multixact/members"))
-		kind = SLRU_MULTIXACT_MEMBERS;
-	else if (STRPREFIX(path, "pg_multixact/offsets"))
-		kind = SLRU_MULTIXACT_OFFSETS;
-	else
-		return -1;
-
-	request = (NeonGetSlruSegmentRequest) {
-		.hdr.tag = T_NeonGetSlruSegmentRequest,
-		.hdr.reqid = GENERATE_REQUEST_ID(),
-		.hdr.lsn = request_lsn,
-		.hdr.not_modified_since = not_modified_since,
-		.kind = kind,
-		.segno = segno
-	};
-
-	do
-	{
-		while (!page_server->send(shard_no, &request.hdr) || !page_server->flush(shard_no));
-
-		consume_prefetch_responses();
+	*not_modified_since = nm_adjust_lsn(GetRedoStartLsn());
+}
 
-		resp = page_server->receive(shard_no);
-	} while (resp == NULL);
+/*
+ * Check the response to a GetSlruSegment request, and copy the segment
+ * contents to 'buffer'. Returns the number of blocks in the segment.
+ */
+static int
+neon_slru_segment_response(NeonResponse *resp, NeonGetSlruSegmentRequest *request,
+						   void *buffer)
+{
+	int			n_blocks = 0;
 
 	switch (resp->tag)
 	{
@@ -4115,14 +4809,14 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 			NeonGetSlruSegmentResponse* slru_resp = (NeonGetSlruSegmentResponse *) resp;
 			if (neon_protocol_version >= 3)
 			{
-				if (!equal_requests(resp, &request.hdr) ||
-					slru_resp->req.kind != kind ||
-					slru_resp->req.segno != segno)
+				if (!equal_requests(resp, &request->hdr) ||
+					slru_resp->req.kind != request->kind ||
+					slru_resp->req.segno != request->segno)
 				{
 					NEON_PANIC_CONNECTION_STATE(-1, PANIC,
 												"Unexpect response {reqid=%lx,lsn=%X/%08X, since=%X/%08X, kind=%u, segno=%u} to get SLRU segment request {reqid=%lx,lsn=%X/%08X, since=%X/%08X, kind=%u, segno=%u}",
 												resp->reqid, LSN_FORMAT_ARGS(resp->lsn), LSN_FORMAT_ARGS(resp->not_modified_since), slru_resp->req.kind, slru_resp->req.segno,
-												request.hdr.reqid, LSN_FORMAT_ARGS(request.hdr.lsn), LSN_FORMAT_ARGS(request.hdr.not_modified_since), kind, segno);
+												request->hdr.reqid, LSN_FORMAT_ARGS(request->hdr.lsn), LSN_FORMAT_ARGS(request->hdr.not_modified_since), request->kind, request->segno);
 				}
 			}
 			n_blocks = slru_resp->n_blocks;
@@ -4132,20 +4826,20 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 		case T_NeonErrorResponse:
 			if (neon_protocol_version >= 3)
 			{
-				if (!equal_requests(resp, &request.hdr))
+				if (!equal_requests(resp, &request->hdr))
 				{
 					elog(WARNING, NEON_TAG "Error message {reqid=%lx,lsn=%X/%08X, since=%X/%08X} doesn't match get SLRU segment request {reqid=%lx,lsn=%X/%08X, since=%X/%08X}",
 						 resp->reqid, LSN_FORMAT_ARGS(resp->lsn), LSN_FORMAT_ARGS(resp->not_modified_since),
-						 request.hdr.reqid, LSN_FORMAT_ARGS(request.hdr.lsn), LSN_FORMAT_ARGS(request.hdr.not_modified_since));
+						 request->hdr.reqid, LSN_FORMAT_ARGS(request->hdr.lsn), LSN_FORMAT_ARGS(request->hdr.not_modified_since));
 				}
 			}
 			ereport(ERROR,
 					(errcode(ERRCODE_IO_ERROR),
 					 errmsg(NEON_TAG "[reqid %lx] could not read SLRU %d segment %d at lsn %X/%08X",
 							resp->reqid,
-							kind,
-							segno,
-							LSN_FORMAT_ARGS(request_lsn)),
+							request->kind,
+							request->segno,
+							LSN_FORMAT_ARGS(request->hdr.lsn)),
 					 errdetail("page server returned error: %s",
 							   ((NeonErrorResponse *) resp)->message)));
 			break;
@@ -4155,11 +4849,171 @@ neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buf
 										"Expected GetSlruSegment (0x%02x) or Error (0x%02x) response to GetSlruSegmentRequest, but got 0x%02x",
 										T_NeonGetSlruSegmentResponse, T_NeonErrorResponse, resp->tag);
 	}
+
+	return n_blocks;
+}
+
+static int
+neon_read_slru_segment(SMgrRelation reln, const char* path, int segno, void* buffer)
+{
+	XLogRecPtr	request_lsn,
+				not_modified_since;
+	SlruKind	kind;
+	int			n_blocks;
+	shardno_t	shard_no = 0; /* All SLRUs are at shard 0 */
+	NeonResponse *resp;
+	NeonGetSlruSegmentRequest request;
+	BufferTag	buftag = {0};
+	uint64		flight_record_id;
+
+	neon_get_slru_request_lsns(&request_lsn, &not_modified_since);
+
+	if (STRPREFIX(path, "pg_xact"))
+		kind = SLRU_CLOG;
+	else if (STRPREFIX(path, "pg_multixact/members"))
+		kind = SLRU_MULTIXACT_MEMBERS;
+	else if (STRPREFIX(path, "pg_multixact/offsets"))
+		kind = SLRU_MULTIXACT_OFFSETS;
+	else
+		return -1;
+
+	request = (NeonGetSlruSegmentRequest) {
+		.hdr.tag = T_NeonGetSlruSegmentRequest,
+		.hdr.reqid = GENERATE_REQUEST_ID(),
+		.hdr.lsn = request_lsn,
+		.hdr.not_modified_since = not_modified_since,
+		.kind = kind,
+		.segno = segno
+	};
+
+	buftag.forkNum = kind;
+	buftag.blockNum = segno;
+	flight_record_id = flight_record_request(T_NeonGetSlruSegmentRequest, shard_no,
+											 &buftag, request_lsn, not_modified_since,
+											 NFR_SOURCE_SYNC);
+
+	do
+	{
+		while (!page_server->send(shard_no, &request.hdr) || !page_server->flush(shard_no));
+
+		consume_prefetch_responses();
+
+		resp = page_server->receive(shard_no);
+	} while (resp == NULL);
+
+	flight_record_response(flight_record_id);
+
+	n_blocks = neon_slru_segment_response(resp, &request, buffer);
 	pfree(resp);
 
 	return n_blocks;
 }
 
+/*
+ * Fetch several SLRU segments from the pageserver at once.
+ *
+ * This is like neon_read_slru_segment(), but all the requests are sent before
+ * waiting for the first response, so that the round trips overlap. Segment
+ * segnos[i] is stored at buffers[i], which must have room for a whole
+ * segment, and its length in blocks is returned in n_blocks[i].
+ */
+void
+neon_read_slru_segments(SlruKind kind, int nsegs, const int *segnos,
+						char **buffers, int *n_blocks)
+{
+	XLogRecPtr	request_lsn,
+				not_modified_since;
+	shardno_t	shard_no = 0; /* All SLRUs are at shard 0 */
+	NeonGetSlruSegmentRequest *requests;
+	NeonResponse **responses;
+	uint64	   *flight_record_ids;
+	volatile int done = 0;
+
+	neon_get_slru_request_lsns(&request_lsn, &not_modified_since);
+
+	requests = palloc(nsegs * sizeof(NeonGetSlruSegmentRequest));
+	responses = palloc0(nsegs * sizeof(NeonResponse *));
+	flight_record_ids = palloc(nsegs * sizeof(uint64));
+
+	for (int i = 0; i < nsegs; i++)
+	{
+		BufferTag	buftag = {0};
+
+		buftag.forkNum = kind;
+		buftag.blockNum = segnos[i];
+		flight_record_ids[i] = flight_record_request(T_NeonGetSlruSegmentRequest, shard_no,
+													 &buftag, request_lsn, not_modified_since,
+													 NFR_SOURCE_PREFETCH);
+	}
+
+	/*
+	 * If the connection is lost, all the requests that haven't been answered
+	 * yet are lost with it, so resend everything from the first unanswered
+	 * one.
+	 */
+	PG_TRY();
+	{
+		while (done < nsegs)
+		{
+			int			sent;
+
+			for (sent = done; sent < nsegs; sent++)
+			{
+				requests[sent] = (NeonGetSlruSegmentRequest) {
+					.hdr.tag = T_NeonGetSlruSegmentRequest,
+					.hdr.reqid = GENERATE_REQUEST_ID(),
+					.hdr.lsn = request_lsn,
+					.hdr.not_modified_since = not_modified_since,
+					.kind = kind,
+					.segno = segnos[sent]
+				};
+				if (!page_server->send(shard_no, &requests[sent].hdr))
+					break;
+			}
+			if (sent < nsegs || !page_server->flush(shard_no))
+				continue;
+
+			consume_prefetch_responses();
+
+			for (; done < nsegs; done++)
+			{
+				responses[done] = page_server->receive(shard_no);
+				if (responses[done] == NULL)
+					break;
+				flight_record_response(flight_record_ids[done]);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		/*
+		 * Unlike a single request, the unanswered requests can't be abandoned
+		 * one by one, as their responses would arrive interleaved with those
+		 * of later requests. Reset the connection, so that they don't get
+		 * mistaken for the responses to the next requests.
+		 */
+		if (done < nsegs)
+			page_server->disconnect(shard_no);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/*
+	 * Only look at the responses once they have all been received, so that
+	 * an error response doesn't leave the others unread on the connection.
+	 */
+	for (int i = 0; i < nsegs; i++)
+	{
+		n_blocks[i] = neon_slru_segment_response(responses[i], &requests[i], buffers[i]);
+		pfree(responses[i]);
+	}
+
+	pfree(flight_record_ids);
+	pfree(responses);
+	pfree(requests);
+}
+
 static void
 AtEOXact_neon(XactEvent event, void *arg)
 {
@@ -4336,6 +5190,54 @@ get_fsm_physical_block(BlockNumber heapblk)
 }
 
 
+/*
+ * Is the change to the given block cheap enough to apply to the copy of the
+ * page in the LFC, instead of evicting it?
+ */
+static bool
+neon_redo_in_lfc_worthwhile(XLogReaderState *record, uint8 block_id)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+	/* Restoring a full-page image doesn't even need to read the old page */
+	if (XLogRecHasBlockImage(record, block_id) &&
+		XLogRecBlockImageApply(record, block_id))
+		return true;
+
+	switch (XLogRecGetRmid(record))
+	{
+		case RM_HEAP_ID:
+			switch (info & XLOG_HEAP_OPMASK)
+			{
+				case XLOG_HEAP_INSERT:
+				case XLOG_HEAP_DELETE:
+				case XLOG_HEAP_UPDATE:
+				case XLOG_HEAP_HOT_UPDATE:
+				case XLOG_HEAP_LOCK:
+				case XLOG_HEAP_INPLACE:
+					return true;
+			}
+			break;
+		case RM_HEAP2_ID:
+			switch (info & XLOG_HEAP_OPMASK)
+			{
+				case XLOG_HEAP2_MULTI_INSERT:
+				case XLOG_HEAP2_LOCK_UPDATED:
+					return true;
+			}
+			break;
+		case RM_BTREE_ID:
+			switch (info)
+			{
+				case XLOG_BTREE_INSERT_LEAF:
+				case XLOG_BTREE_INSERT_UPPER:
+					return true;
+			}
+			break;
+	}
+	return false;
+}
+
 /*
  * Return whether we can skip the redo for this block.
  *
@@ -4345,11 +5247,19 @@ get_fsm_physical_block(BlockNumber heapblk)
  * - The block is not in the local file cache
  *
  * ... because any subsequent read of the page requires us to read
- * the new version of the page from the PageServer. We do not
+ * the new version of the page from the PageServer. By default, we do not
  * check the local file cache; we instead evict the page from LFC: it
  * is cheaper than going through the FS calls to read the page, and
  * limits the number of lock operations used in the REDO process.
  *
+ * With neon.replica_lfc_redo, records that are cheap to apply are replayed
+ * on pages that are in the LFC instead. The redo function then reads the
+ * page from the LFC into shared buffers, and the modified page is written
+ * back to the LFC when it's evicted. That keeps the LFC of a replica warm
+ * under a write-heavy primary, instead of sending the next read of each
+ * modified page to the pageserver, which may not have caught up with the
+ * replay LSN yet.
+ *
  * We have one exception to the rules for skipping IO: We always apply
  * changes to shared catalogs' pages. Although this is mostly out of caution,
  * catalog updates usually result in backends rebuilding their catalog snapshot,
@@ -4422,6 +5332,18 @@ neon_redo_read_buffer_filter(XLogReaderState *record, uint8 block_id)
 		buf_id = BufTableLookup(&tag, hash);
 
 		no_redo_needed = buf_id < 0;
+
+		if (no_redo_needed && replica_lfc_redo &&
+			neon_redo_in_lfc_worthwhile(record, block_id) &&
+			lfc_cache_contains(rinfo, forknum, blkno))
+		{
+			/*
+			 * Let the redo function read the page from the LFC. If it's
+			 * evicted from the LFC before that, it's read from the pageserver
+			 * instead, like for shared catalogs.
+			 */
+			no_redo_needed = false;
+		}
 	}
 
 	/*
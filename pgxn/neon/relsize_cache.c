@@ -39,10 +39,18 @@ typedef struct
 typedef struct
 {
 	RelTag		tag;
-	BlockNumber size;
+	BlockNumber size;			/* or RELSIZE_ABSENT */
 	dlist_node	lru_node;		/* LRU list node */
 } RelSizeEntry;
 
+/*
+ * 'size' of a negative entry, for a fork that is known not to exist. Probing
+ * for forks that don't exist is common: every backend checks whether the FSM
+ * and VM forks of the relations it inserts into exist. A negative entry is
+ * replaced when the fork is created or extended.
+ */
+#define RELSIZE_ABSENT InvalidBlockNumber
+
 typedef struct
 {
 	size_t      size;
@@ -113,7 +121,7 @@ get_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber *size)
 		/* We need exclusive lock here because of LRU list manipulation */
 		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
 		entry = hash_search(relsize_hash, &tag, HASH_FIND, NULL);
-		if (entry != NULL)
+		if (entry != NULL && entry->size != RELSIZE_ABSENT)
 		{
 			*size = entry->size;
 			relsize_ctl->hits += 1;
@@ -192,7 +200,7 @@ update_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber size)
 		tag.forknum = forknum;
 		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
 		entry = hash_search(relsize_hash, &tag, HASH_ENTER, &found);
-		if (!found || entry->size < size)
+		if (!found || entry->size == RELSIZE_ABSENT || entry->size < size)
 			entry->size = size;
 		if (!found)
 		{
@@ -213,6 +221,78 @@ update_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum, BlockNumber size)
 	}
 }
 
+/*
+ * Does the relation fork exist? Returns false if that's not known, otherwise
+ * true and sets *exists.
+ */
+bool
+get_cached_relexists(NRelFileInfo rinfo, ForkNumber forknum, bool *exists)
+{
+	bool		found = false;
+
+	if (relsize_hash_size > 0)
+	{
+		RelTag		tag;
+		RelSizeEntry *entry;
+
+		tag.rinfo = rinfo;
+		tag.forknum = forknum;
+		/* We need exclusive lock here because of LRU list manipulation */
+		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
+		entry = hash_search(relsize_hash, &tag, HASH_FIND, NULL);
+		if (entry != NULL)
+		{
+			*exists = entry->size != RELSIZE_ABSENT;
+			relsize_ctl->hits += 1;
+			found = true;
+			/* Move entry to the LRU list tail */
+			dlist_delete(&entry->lru_node);
+			dlist_push_tail(&relsize_ctl->lru, &entry->lru_node);
+		}
+		else
+		{
+			relsize_ctl->misses += 1;
+		}
+		LWLockRelease(relsize_lock);
+	}
+	return found;
+}
+
+/*
+ * Remember that the relation fork doesn't exist.
+ *
+ * If there's an entry already, the fork was created or extended while we
+ * were asking the pageserver, so the entry is left alone.
+ */
+void
+set_cached_relsize_absent(NRelFileInfo rinfo, ForkNumber forknum)
+{
+	if (relsize_hash_size > 0)
+	{
+		RelTag		tag;
+		RelSizeEntry *entry;
+		bool		found;
+
+		tag.rinfo = rinfo;
+		tag.forknum = forknum;
+		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
+		entry = hash_search(relsize_hash, &tag, HASH_ENTER, &found);
+		if (!found)
+		{
+			entry->size = RELSIZE_ABSENT;
+			if (++relsize_ctl->size == relsize_hash_size)
+			{
+				RelSizeEntry *victim = dlist_container(RelSizeEntry, lru_node, dlist_pop_head_node(&relsize_ctl->lru));
+				hash_search(relsize_hash, &victim->tag, HASH_REMOVE, NULL);
+				relsize_ctl->size -= 1;
+			}
+			relsize_ctl->writes += 1;
+			dlist_push_tail(&relsize_ctl->lru, &entry->lru_node);
+		}
+		LWLockRelease(relsize_lock);
+	}
+}
+
 void
 forget_cached_relsize(NRelFileInfo rinfo, ForkNumber forknum)
 {
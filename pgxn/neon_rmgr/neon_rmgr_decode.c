@@ -20,7 +20,9 @@ static void DecodeNeonUpdate(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 static void DecodeNeonDelete(LogicalDecodingContext *ctx, XLogRecordBuffer *buf);
 static void DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf);
 
-/* common function to decode tuples */
+/* common functions to decode tuples */
+static inline void DecodeNeonTupleData(ReorderBufferTupleBuf *tuple, const char *data, Size datalen,
+									   uint16 t_infomask, uint16 t_infomask2, uint8 t_hoff);
 static void DecodeXLogTuple(char *data, Size len, ReorderBufferTupleBuf *tuple);
 
 
@@ -173,7 +175,7 @@ DecodeNeonDelete(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 	/* old primary key stored */
 	if (xlrec->flags & XLH_DELETE_CONTAINS_OLD)
 	{
-		Size		datalen = XLogRecGetDataLen(r) - SizeOfNeonHeapHeader;
+		Size		datalen = XLogRecGetDataLen(r) - SizeOfNeonHeapDelete;
 		Size		tuplelen = datalen - SizeOfNeonHeapHeader;
 
 		Assert(XLogRecGetDataLen(r) > (SizeOfNeonHeapDelete + SizeOfNeonHeapHeader));
@@ -268,12 +270,16 @@ static void
 DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 {
 	XLogReaderState *r = buf->record;
+	ReorderBuffer *rb = ctx->reorder;
 	xl_neon_heap_multi_insert *xlrec;
 	int			i;
 	char	   *data;
 	char	   *tupledata;
 	Size		tuplelen;
 	RelFileLocator rlocator;
+	TransactionId xid;
+	RepOriginId origin_id;
+	bool		last_in_multi;
 
 	xlrec = (xl_neon_heap_multi_insert *) XLogRecGetData(r);
 
@@ -290,7 +296,8 @@ DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 		return;
 
 	/* output plugin doesn't look for this origin, no need to queue */
-	if (FilterByOrigin(ctx, XLogRecGetOrigin(r)))
+	origin_id = XLogRecGetOrigin(r);
+	if (FilterByOrigin(ctx, origin_id))
 		return;
 
 	/*
@@ -300,63 +307,43 @@ DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 	tupledata = XLogRecGetBlockData(r, 0, &tuplelen);
 	Assert(tupledata != NULL);
 
+	/*
+	 * Everything except the tuple itself is shared by all the changes of the
+	 * record, so work it out once for the whole batch.
+	 */
+	xid = XLogRecGetXid(r);
+	last_in_multi = (xlrec->flags & XLH_INSERT_LAST_IN_MULTI) != 0;
+
 	data = tupledata;
 	for (i = 0; i < xlrec->ntuples; i++)
 	{
 		ReorderBufferChange *change;
 		xl_neon_multi_insert_tuple *xlhdr;
 		int			datalen;
-		ReorderBufferTupleBuf *tuple;
-		HeapTupleHeader header;
-
-		change = ReorderBufferGetChange(ctx->reorder);
-		change->action = REORDER_BUFFER_CHANGE_INSERT;
-		change->origin_id = XLogRecGetOrigin(r);
-
-		memcpy(&change->data.tp.rlocator, &rlocator, sizeof(RelFileLocator));
 
 		xlhdr = (xl_neon_multi_insert_tuple *) SHORTALIGN(data);
 		data = ((char *) xlhdr) + SizeOfNeonMultiInsertTuple;
 		datalen = xlhdr->datalen;
 
-		change->data.tp.newtuple =
-			ReorderBufferGetTupleBuf(ctx->reorder, datalen);
-
-		tuple = change->data.tp.newtuple;
-		header = tuple->tuple.t_data;
-
-		/* not a disk based tuple */
-		ItemPointerSetInvalid(&tuple->tuple.t_self);
-
-		/*
-		 * We can only figure this out after reassembling the transactions.
-		 */
-		tuple->tuple.t_tableOid = InvalidOid;
-
-		tuple->tuple.t_len = datalen + SizeofHeapTupleHeader;
-
-		memset(header, 0, SizeofHeapTupleHeader);
+		change = ReorderBufferGetChange(rb);
+		change->action = REORDER_BUFFER_CHANGE_INSERT;
+		change->origin_id = origin_id;
+		change->data.tp.rlocator = rlocator;
 
-		memcpy((char *) tuple->tuple.t_data + SizeofHeapTupleHeader,
-			   (char *) data,
-			   datalen);
-		header->t_infomask = xlhdr->t_infomask;
-		header->t_infomask2 = xlhdr->t_infomask2;
-		header->t_hoff = xlhdr->t_hoff;
+		change->data.tp.newtuple = ReorderBufferGetTupleBuf(rb, datalen);
+		DecodeNeonTupleData(change->data.tp.newtuple, data, datalen,
+							xlhdr->t_infomask, xlhdr->t_infomask2,
+							xlhdr->t_hoff);
 
 		/*
 		 * Reset toast reassembly state only after the last row in the last
 		 * xl_multi_insert_tuple record emitted by one heap_multi_insert()
 		 * call.
 		 */
-		if (xlrec->flags & XLH_INSERT_LAST_IN_MULTI &&
-			(i + 1) == xlrec->ntuples)
-			change->data.tp.clear_toast_afterwards = true;
-		else
-			change->data.tp.clear_toast_afterwards = false;
+		change->data.tp.clear_toast_afterwards =
+			last_in_multi && (i + 1) == xlrec->ntuples;
 
-		ReorderBufferQueueChange(ctx->reorder, XLogRecGetXid(r),
-								 buf->origptr, change, false);
+		ReorderBufferQueueChange(rb, xid, buf->origptr, change, false);
 
 		/* move to the next xl_neon_multi_insert_tuple entry */
 		data += datalen;
@@ -365,23 +352,20 @@ DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 }
 
 /*
- * Read a HeapTuple as WAL logged by heap_insert, heap_update and heap_delete
- * (but not by heap_multi_insert) into a tuplebuf.
+ * Fill in a tuplebuf from the header fields and the data of a tuple as
+ * stored in the WAL record.
  *
- * The size 'len' and the pointer 'data' in the record need to be
- * computed outside as they are record specific.
+ * The data is not necessarily aligned in the record and the record buffer is
+ * recycled by the WAL reader, so it is copied into the tuplebuf with a
+ * single memcpy.
  */
-static void
-DecodeXLogTuple(char *data, Size len, ReorderBufferTupleBuf *tuple)
+static inline void
+DecodeNeonTupleData(ReorderBufferTupleBuf *tuple, const char *data, Size datalen,
+					uint16 t_infomask, uint16 t_infomask2, uint8 t_hoff)
 {
-	xl_neon_heap_header xlhdr;
-	int			datalen = len - SizeOfNeonHeapHeader;
-	HeapTupleHeader header;
-
-	Assert(datalen >= 0);
+	HeapTupleHeader header = tuple->tuple.t_data;
 
 	tuple->tuple.t_len = datalen + SizeofHeapTupleHeader;
-	header = tuple->tuple.t_data;
 
 	/* not a disk based tuple */
 	ItemPointerSetInvalid(&tuple->tuple.t_self);
@@ -389,20 +373,34 @@ DecodeXLogTuple(char *data, Size len, ReorderBufferTupleBuf *tuple)
 	/* we can only figure this out after reassembling the transactions */
 	tuple->tuple.t_tableOid = InvalidOid;
 
-	/* data is not stored aligned, copy to aligned storage */
-	memcpy((char *) &xlhdr,
-		   data,
-		   SizeOfNeonHeapHeader);
-
 	memset(header, 0, SizeofHeapTupleHeader);
+	memcpy((char *) header + SizeofHeapTupleHeader, data, datalen);
+
+	header->t_infomask = t_infomask;
+	header->t_infomask2 = t_infomask2;
+	header->t_hoff = t_hoff;
+}
+
+/*
+ * Read a HeapTuple as WAL logged by heap_insert, heap_update and heap_delete
+ * (but not by heap_multi_insert) into a tuplebuf.
+ *
+ * The size 'len' and the pointer 'data' in the record need to be
+ * computed outside as they are record specific.
+ */
+static void
+DecodeXLogTuple(char *data, Size len, ReorderBufferTupleBuf *tuple)
+{
+	xl_neon_heap_header xlhdr;
 
-	memcpy(((char *) tuple->tuple.t_data) + SizeofHeapTupleHeader,
-		   data + SizeOfNeonHeapHeader,
-		   datalen);
+	Assert(len >= SizeOfNeonHeapHeader);
 
-	header->t_infomask = xlhdr.t_infomask;
-	header->t_infomask2 = xlhdr.t_infomask2;
-	header->t_hoff = xlhdr.t_hoff;
+	/* the header is not stored aligned, copy it to aligned storage */
+	memcpy((char *) &xlhdr, data, SizeOfNeonHeapHeader);
+
+	DecodeNeonTupleData(tuple, data + SizeOfNeonHeapHeader,
+						len - SizeOfNeonHeapHeader,
+						xlhdr.t_infomask, xlhdr.t_infomask2, xlhdr.t_hoff);
 }
 #endif
 
@@ -414,7 +412,9 @@ static void DecodeNeonUpdate(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 static void DecodeNeonDelete(LogicalDecodingContext *ctx, XLogRecordBuffer *buf);
 static void DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf);
 
-/* common function to decode tuples */
+/* common functions to decode tuples */
+static inline void DecodeNeonTupleData(HeapTuple tuple, const char *data, Size datalen,
+									   uint16 t_infomask, uint16 t_infomask2, uint8 t_hoff);
 static void DecodeXLogTuple(char *data, Size len, HeapTuple tuple);
 
 
@@ -515,7 +515,7 @@ DecodeNeonInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 	memcpy(&change->data.tp.rlocator, &target_locator, sizeof(RelFileLocator));
 
 	tupledata = XLogRecGetBlockData(r, 0, &datalen);
-	tuplelen = datalen - SizeOfHeapHeader;
+	tuplelen = datalen - SizeOfNeonHeapHeader;
 
 	change->data.tp.newtuple =
 		ReorderBufferGetTupleBuf(ctx->reorder, tuplelen);
@@ -567,7 +567,7 @@ DecodeNeonDelete(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 	/* old primary key stored */
 	if (xlrec->flags & XLH_DELETE_CONTAINS_OLD)
 	{
-		Size		datalen = XLogRecGetDataLen(r) - SizeOfNeonHeapHeader;
+		Size		datalen = XLogRecGetDataLen(r) - SizeOfNeonHeapDelete;
 		Size		tuplelen = datalen - SizeOfNeonHeapHeader;
 
 		Assert(XLogRecGetDataLen(r) > (SizeOfNeonHeapDelete + SizeOfNeonHeapHeader));
@@ -662,12 +662,16 @@ static void
 DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 {
 	XLogReaderState *r = buf->record;
+	ReorderBuffer *rb = ctx->reorder;
 	xl_neon_heap_multi_insert *xlrec;
 	int			i;
 	char	   *data;
 	char	   *tupledata;
 	Size		tuplelen;
 	RelFileLocator rlocator;
+	TransactionId xid;
+	RepOriginId origin_id;
+	bool		last_in_multi;
 
 	xlrec = (xl_neon_heap_multi_insert *) XLogRecGetData(r);
 
@@ -684,7 +688,8 @@ DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 		return;
 
 	/* output plugin doesn't look for this origin, no need to queue */
-	if (FilterByOrigin(ctx, XLogRecGetOrigin(r)))
+	origin_id = XLogRecGetOrigin(r);
+	if (FilterByOrigin(ctx, origin_id))
 		return;
 
 	/*
@@ -694,63 +699,43 @@ DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 	tupledata = XLogRecGetBlockData(r, 0, &tuplelen);
 	Assert(tupledata != NULL);
 
+	/*
+	 * Everything except the tuple itself is shared by all the changes of the
+	 * record, so work it out once for the whole batch.
+	 */
+	xid = XLogRecGetXid(r);
+	last_in_multi = (xlrec->flags & XLH_INSERT_LAST_IN_MULTI) != 0;
+
 	data = tupledata;
 	for (i = 0; i < xlrec->ntuples; i++)
 	{
 		ReorderBufferChange *change;
 		xl_neon_multi_insert_tuple *xlhdr;
 		int			datalen;
-		HeapTuple	tuple;
-		HeapTupleHeader header;
-
-		change = ReorderBufferGetChange(ctx->reorder);
-		change->action = REORDER_BUFFER_CHANGE_INSERT;
-		change->origin_id = XLogRecGetOrigin(r);
-
-		memcpy(&change->data.tp.rlocator, &rlocator, sizeof(RelFileLocator));
 
 		xlhdr = (xl_neon_multi_insert_tuple *) SHORTALIGN(data);
 		data = ((char *) xlhdr) + SizeOfNeonMultiInsertTuple;
 		datalen = xlhdr->datalen;
 
-		change->data.tp.newtuple =
-			ReorderBufferGetTupleBuf(ctx->reorder, datalen);
-
-		tuple = change->data.tp.newtuple;
-		header = tuple->t_data;
-
-		/* not a disk based tuple */
-		ItemPointerSetInvalid(&tuple->t_self);
-
-		/*
-		 * We can only figure this out after reassembling the transactions.
-		 */
-		tuple->t_tableOid = InvalidOid;
-
-		tuple->t_len = datalen + SizeofHeapTupleHeader;
-
-		memset(header, 0, SizeofHeapTupleHeader);
+		change = ReorderBufferGetChange(rb);
+		change->action = REORDER_BUFFER_CHANGE_INSERT;
+		change->origin_id = origin_id;
+		change->data.tp.rlocator = rlocator;
 
-		memcpy((char *) tuple->t_data + SizeofHeapTupleHeader,
-			   (char *) data,
-			   datalen);
-		header->t_infomask = xlhdr->t_infomask;
-		header->t_infomask2 = xlhdr->t_infomask2;
-		header->t_hoff = xlhdr->t_hoff;
+		change->data.tp.newtuple = ReorderBufferGetTupleBuf(rb, datalen);
+		DecodeNeonTupleData(change->data.tp.newtuple, data, datalen,
+							xlhdr->t_infomask, xlhdr->t_infomask2,
+							xlhdr->t_hoff);
 
 		/*
 		 * Reset toast reassembly state only after the last row in the last
 		 * xl_multi_insert_tuple record emitted by one heap_multi_insert()
 		 * call.
 		 */
-		if (xlrec->flags & XLH_INSERT_LAST_IN_MULTI &&
-			(i + 1) == xlrec->ntuples)
-			change->data.tp.clear_toast_afterwards = true;
-		else
-			change->data.tp.clear_toast_afterwards = false;
+		change->data.tp.clear_toast_afterwards =
+			last_in_multi && (i + 1) == xlrec->ntuples;
 
-		ReorderBufferQueueChange(ctx->reorder, XLogRecGetXid(r),
-								 buf->origptr, change, false);
+		ReorderBufferQueueChange(rb, xid, buf->origptr, change, false);
 
 		/* move to the next xl_neon_multi_insert_tuple entry */
 		data += datalen;
@@ -759,23 +744,20 @@ DecodeNeonMultiInsert(LogicalDecodingContext *ctx, XLogRecordBuffer *buf)
 }
 
 /*
- * Read a HeapTuple as WAL logged by heap_insert, heap_update and heap_delete
- * (but not by heap_multi_insert) into a tuplebuf.
+ * Fill in a tuplebuf from the header fields and the data of a tuple as
+ * stored in the WAL record.
  *
- * The size 'len' and the pointer 'data' in the record need to be
- * computed outside as they are record specific.
+ * The data is not necessarily aligned in the record and the record buffer is
+ * recycled by the WAL reader, so it is copied into the tuplebuf with a
+ * single memcpy.
  */
-static void
-DecodeXLogTuple(char *data, Size len, HeapTuple tuple)
+static inline void
+DecodeNeonTupleData(HeapTuple tuple, const char *data, Size datalen,
+					uint16 t_infomask, uint16 t_infomask2, uint8 t_hoff)
 {
-	xl_neon_heap_header xlhdr;
-	int			datalen = len - SizeOfNeonHeapHeader;
-	HeapTupleHeader header;
-
-	Assert(datalen >= 0);
+	HeapTupleHeader header = tuple->t_data;
 
 	tuple->t_len = datalen + SizeofHeapTupleHeader;
-	header = tuple->t_data;
 
 	/* not a disk based tuple */
 	ItemPointerSetInvalid(&tuple->t_self);
@@ -783,19 +765,33 @@ DecodeXLogTuple(char *data, Size len, HeapTuple tuple)
 	/* we can only figure this out after reassembling the transactions */
 	tuple->t_tableOid = InvalidOid;
 
-	/* data is not stored aligned, copy to aligned storage */
-	memcpy((char *) &xlhdr,
-		   data,
-		   SizeOfNeonHeapHeader);
-
 	memset(header, 0, SizeofHeapTupleHeader);
+	memcpy((char *) header + SizeofHeapTupleHeader, data, datalen);
+
+	header->t_infomask = t_infomask;
+	header->t_infomask2 = t_infomask2;
+	header->t_hoff = t_hoff;
+}
+
+/*
+ * Read a HeapTuple as WAL logged by heap_insert, heap_update and heap_delete
+ * (but not by heap_multi_insert) into a tuplebuf.
+ *
+ * The size 'len' and the pointer 'data' in the record need to be
+ * computed outside as they are record specific.
+ */
+static void
+DecodeXLogTuple(char *data, Size len, HeapTuple tuple)
+{
+	xl_neon_heap_header xlhdr;
+
+	Assert(len >= SizeOfNeonHeapHeader);
 
-	memcpy(((char *) tuple->t_data) + SizeofHeapTupleHeader,
-		   data + SizeOfNeonHeapHeader,
-		   datalen);
+	/* the header is not stored aligned, copy it to aligned storage */
+	memcpy((char *) &xlhdr, data, SizeOfNeonHeapHeader);
 
-	header->t_infomask = xlhdr.t_infomask;
-	header->t_infomask2 = xlhdr.t_infomask2;
-	header->t_hoff = xlhdr.t_hoff;
+	DecodeNeonTupleData(tuple, data + SizeOfNeonHeapHeader,
+						len - SizeOfNeonHeapHeader,
+						xlhdr.t_infomask, xlhdr.t_infomask2, xlhdr.t_hoff);
 }
 #endif
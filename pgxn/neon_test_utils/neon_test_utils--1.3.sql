@@ -62,6 +62,12 @@ RETURNS VOID
 AS 'MODULE_PATHNAME', 'trigger_segfault'
 LANGUAGE C PARALLEL UNSAFE;
 
+CREATE FUNCTION test_io_histogram_percentile(latencies_us int8[], percentile float8)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'test_io_histogram_percentile'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+
 -- Alias for `trigger_segfault`, just because `SELECT 💣()` looks fun
 CREATE OR REPLACE FUNCTION 💣() RETURNS void
 LANGUAGE plpgsql AS $$
@@ -17,18 +17,21 @@
 #include "access/xlog.h"
 #include "access/xlog_internal.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_type.h"
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "storage/buf_internals.h"
 #include "storage/bufmgr.h"
 #include "storage/fd.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/pg_lsn.h"
 #include "utils/rel.h"
 #include "utils/varlena.h"
 #include "utils/wait_event.h"
 #include "../neon/pagestore_client.h"
+#include "../neon/neon_perf_counters.h"
 
 PG_MODULE_MAGIC;
 
@@ -45,6 +48,7 @@ PG_FUNCTION_INFO_V1(get_raw_page_at_lsn_ex);
 PG_FUNCTION_INFO_V1(neon_xlogflush);
 PG_FUNCTION_INFO_V1(trigger_panic);
 PG_FUNCTION_INFO_V1(trigger_segfault);
+PG_FUNCTION_INFO_V1(test_io_histogram_percentile);
 
 /*
  * Linkage to functions in neon module.
@@ -60,6 +64,11 @@ typedef void (*neon_read_at_lsn_type) (NRelFileInfo rinfo, ForkNumber forkNum, B
 
 static neon_read_at_lsn_type neon_read_at_lsn_ptr;
 
+typedef bool (*io_histogram_percentile_type) (IOHistogram hist, double percentile,
+											  double *result);
+
+static io_histogram_percentile_type io_histogram_percentile_ptr;
+
 /*
  * Module initialize function: fetch function pointers for cross-module calls.
  */
@@ -71,9 +80,15 @@ _PG_init(void)
 	neon_read_at_lsn_ptr = (neon_read_at_lsn_type)
 		load_external_function("$libdir/neon", "neon_read_at_lsn",
 							   true, NULL);
+
+	AssertVariableIsOfType(&io_histogram_percentile, io_histogram_percentile_type);
+	io_histogram_percentile_ptr = (io_histogram_percentile_type)
+		load_external_function("$libdir/neon", "io_histogram_percentile",
+							   true, NULL);
 }
 
 #define neon_read_at_lsn neon_read_at_lsn_ptr
+#define io_histogram_percentile io_histogram_percentile_ptr
 
 /*
  * test_consume_oids(int4), for rapidly consuming OIDs, to test wraparound.
@@ -528,3 +543,47 @@ trigger_segfault(PG_FUNCTION_ARGS)
     *ptr = 42;
     PG_RETURN_VOID();
 }
+
+/*
+ * test_io_histogram_percentile(latencies_us int8[], percentile float8)
+ *
+ * Count the given wait times in an I/O wait histogram, and return the given
+ * percentile of it, in seconds, as neon_perf_counter_percentiles would.
+ */
+Datum
+test_io_histogram_percentile(PG_FUNCTION_ARGS)
+{
+	ArrayType  *latencies = PG_GETARG_ARRAYTYPE_P(0);
+	float8		percentile = PG_GETARG_FLOAT8(1);
+	IOHistogram hist;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	double		result;
+
+	if (percentile < 0 || percentile > 100)
+		elog(ERROR, "percentile must be between 0 and 100");
+
+	deconstruct_array(latencies, INT8OID, sizeof(int64), FLOAT8PASSBYVAL,
+					  TYPALIGN_DOUBLE, &elems, &nulls, &nelems);
+
+	hist = palloc0(sizeof(IOHistogramData));
+	for (int i = 0; i < nelems; i++)
+	{
+		int64		latency_us;
+
+		if (nulls[i])
+			continue;
+		latency_us = DatumGetInt64(elems[i]);
+		if (latency_us < 0)
+			elog(ERROR, "wait times must not be negative");
+
+		hist->wait_us_bucket[io_hist_bucket((uint64) latency_us)]++;
+		hist->wait_us_sum += latency_us;
+		hist->wait_us_count++;
+	}
+
+	if (!io_histogram_percentile(hist, percentile, &result))
+		PG_RETURN_NULL();
+	PG_RETURN_FLOAT8(result);
+}
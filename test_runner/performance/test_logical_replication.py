@@ -1,5 +1,6 @@
 from __future__ import annotations
 
+import io
 import time
 from collections.abc import Iterator
 from contextlib import contextmanager
@@ -60,6 +61,57 @@ def test_logical_replication(neon_simple_env: NeonEnv, pg_bin: PgBin, vanilla_pg
     assert sum_master == sum_replica
 
 
+@pytest.mark.timeout(1000)
+@pytest.mark.parametrize("workload", ["copy", "insert", "update", "delete"])
+def test_logical_decoding_throughput(
+    neon_simple_env: NeonEnv, zenbenchmark: NeonBenchmarker, workload: str
+):
+    """
+    Measures how long it takes to decode the neon_rmgr heap records produced by
+    a bulk COPY (multi-insert records) and by single-row inserts, updates and
+    deletes, without the network or the subscriber getting in the way.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start("main")
+
+    rows = 1_000_000
+
+    with endpoint.cursor() as cur:
+        cur.execute("set statement_timeout = 0")
+        cur.execute("create table decodetest (i int primary key, t text)")
+        cur.execute("alter table decodetest replica identity full")
+        if workload in ("update", "delete"):
+            cur.execute(
+                f"insert into decodetest select g, 'row ' || g from generate_series(1, {rows}) g"
+            )
+
+        cur.execute("SELECT pg_create_logical_replication_slot('decode_slot', 'test_decoding')")
+
+        if workload == "copy":
+            data = "".join(f"{i}\trow {i}\n" for i in range(1, rows + 1))
+            cur.copy_expert("copy decodetest from stdin", io.StringIO(data))
+        elif workload == "insert":
+            cur.execute(
+                f"do $$ begin for i in 1..{rows} loop "
+                "insert into decodetest values (i, 'row ' || i); end loop; end $$"
+            )
+        elif workload == "update":
+            cur.execute("update decodetest set t = t || ' updated'")
+        else:
+            cur.execute("delete from decodetest")
+
+        with zenbenchmark.record_duration(f"{workload}_decode"):
+            cur.execute(
+                "SELECT count(*) FROM pg_logical_slot_get_changes('decode_slot', NULL, NULL)"
+            )
+            changes = cast("int", cur.fetchall()[0][0])
+
+        log.info(f"Decoded {changes} changes")
+        zenbenchmark.record("decoded_changes", changes, "", MetricReport.TEST_PARAM)
+
+        cur.execute("SELECT pg_drop_replication_slot('decode_slot')")
+
+
 def check_pgbench_still_running(pgbench: Popen[AnyStr], label: str = ""):
     rc = pgbench.poll()
     if rc is not None:
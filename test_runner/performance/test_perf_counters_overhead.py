@@ -0,0 +1,70 @@
+from __future__ import annotations
+
+import os
+import time
+import timeit
+from pathlib import Path
+
+import pytest
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker, PgBenchRunResult
+from fixtures.neon_fixtures import NeonEnvBuilder
+from fixtures.utils import USE_LFC
+
+
+#
+# Benchmark the overhead of updating the per-backend perf counters at high
+# client counts.
+#
+# With shared_buffers much smaller than the data set and an LFC that holds all
+# of it, every pgbench select-only transaction reads a few pages from the LFC,
+# and each read updates the reading backend's perf counters. If the counter
+# slots of neighbouring backends shared cache lines, the TPS per client would
+# drop as the number of clients grows, because of false sharing.
+#
+@pytest.mark.timeout(1200)
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+@pytest.mark.parametrize("clients", [1, 4, os.cpu_count() or 1, 4 * (os.cpu_count() or 1)])
+def test_perf_counters_overhead(
+    neon_env_builder: NeonEnvBuilder, zenbenchmark: NeonBenchmarker, clients: int
+):
+    env = neon_env_builder.init_start()
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='16MB'",
+            "neon.max_file_cache_size='1GB'",
+            "neon.file_cache_size_limit='1GB'",
+            f"max_connections={clients + 10}",
+        ],
+    )
+    connstr = endpoint.connstr()
+    duration = 30
+
+    env.pg_bin.run_capture(["pgbench", "-i", "-I", "dtGvp", "-s", "20", connstr])
+
+    # Warm up the LFC
+    env.pg_bin.run_capture(
+        ["pgbench", "-S", "-T", "10", "-c", str(clients), "-j", str(clients), connstr]
+    )
+
+    run_start_timestamp = int(time.time())
+    t0 = timeit.default_timer()
+    out = env.pg_bin.run_capture(
+        ["pgbench", "-S", "-T", str(duration), "-c", str(clients), "-j", str(clients), connstr]
+    )
+    run_duration = timeit.default_timer() - t0
+    run_end_timestamp = int(time.time())
+
+    res = PgBenchRunResult.parse_from_stdout(
+        stdout=Path(f"{out}.stdout").read_text(),
+        run_duration=run_duration,
+        run_start_timestamp=run_start_timestamp,
+        run_end_timestamp=run_end_timestamp,
+    )
+    zenbenchmark.record_pg_bench_result("select-only", res)
+    zenbenchmark.record(
+        "tps_per_client",
+        res.number_of_transactions_actually_processed / run_duration / clients,
+        "",
+        MetricReport.HIGHER_IS_BETTER,
+    )
@@ -0,0 +1,72 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker
+from fixtures.neon_fixtures import NeonEnvBuilder
+
+
+#
+# Benchmark the per-backend prefetch buffer at different sizes.
+#
+# The full scans register, receive and look up a prefetch request for every
+# block. The short scans stop early and leave most of their prefetched
+# responses unused, so they have to be discarded when the next scan needs
+# room.
+#
+@pytest.mark.timeout(900)
+@pytest.mark.parametrize("readahead_buffer_size", [16, 64, 256, 1024, 4096])
+def test_prefetch_ring(
+    neon_env_builder: NeonEnvBuilder,
+    zenbenchmark: NeonBenchmarker,
+    readahead_buffer_size: int,
+):
+    env = neon_env_builder.init_start()
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=["shared_buffers=1MB"],
+    )
+    n_rec = 500000
+    n_short_scans = 500
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE t(pk integer, filler text default repeat('?', 200))")
+    cur.execute(f"INSERT INTO t (pk) SELECT generate_series(1, {n_rec})")
+    cur.execute("CREATE INDEX ON t (pk)")
+
+    cur.execute("SET statement_timeout=0")
+    cur.execute("SET max_parallel_workers_per_gather=0")
+    cur.execute(f"SET effective_io_concurrency={min(readahead_buffer_size, 1000)}")
+    cur.execute(f"SET neon.readahead_buffer_size={readahead_buffer_size}")
+
+    def perf_counter(metric: str) -> int:
+        cur.execute(
+            "SELECT value FROM neon_backend_perf_counters "
+            f"WHERE pid = pg_backend_pid() AND metric = '{metric}'"
+        )
+        row = cur.fetchone()
+        assert row is not None
+        return int(row[0])
+
+    with zenbenchmark.record_duration("full_scans"):
+        for _ in range(3):
+            endpoint.clear_buffers(cursor=cur)
+            cur.execute("SELECT sum(pk) FROM t")
+
+    cur.execute("SET enable_seqscan=off")
+    cur.execute("SET enable_indexscan=off")
+    endpoint.clear_buffers(cursor=cur)
+    discards = perf_counter("getpage_prefetch_discards_total")
+    with zenbenchmark.record_duration("short_scans"):
+        for i in range(n_short_scans):
+            lo = (i * 7919) % n_rec
+            cur.execute(
+                f"SELECT pk FROM t WHERE pk BETWEEN {lo} AND {lo + 20000} LIMIT 10"
+            )
+    zenbenchmark.record(
+        "discards",
+        perf_counter("getpage_prefetch_discards_total") - discards,
+        "",
+        MetricReport.TEST_PARAM,
+    )
@@ -9,6 +9,8 @@ import pytest
 from fixtures.benchmark_fixture import MetricReport
 from fixtures.compare_fixtures import PgCompare
 from fixtures.log_helper import log
+from fixtures.neon_fixtures import NeonEnvBuilder
+from fixtures.utils import USE_LFC
 from pytest_lazyfixture import lazy_fixture
 
 
@@ -66,3 +68,33 @@ def test_seqscans(env: PgCompare, scale: int, rows: int, iters: int, workers: in
             with env.record_duration("run"):
                 for _ in range(iters):
                     cur.execute("select count(*) from t;")
+
+
+#
+# Benchmark sequential scans over a table that is fully in the local file
+# cache, with and without readahead of the LFC-resident blocks.
+#
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled")
+@pytest.mark.parametrize("readahead", [True, False], ids=["readahead", "no-readahead"])
+def test_seqscans_lfc(neon_env_builder: NeonEnvBuilder, zenbenchmark, readahead: bool):
+    env = neon_env_builder.init_start()
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='1GB'",
+            "neon.file_cache_size_limit='1GB'",
+        ],
+    )
+    cur = endpoint.connect().cursor()
+    cur.execute("set statement_timeout=0")
+    cur.execute("create table t (i integer)")
+    cur.execute("insert into t values (generate_series(1, 3000000))")
+
+    # Load the whole table into the LFC
+    cur.execute("select count(*) from t")
+
+    cur.execute(f"set neon.file_cache_readahead = {'on' if readahead else 'off'}")
+    with zenbenchmark.record_duration("run"):
+        for _ in range(10):
+            cur.execute("select count(*) from t")
@@ -0,0 +1,53 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.benchmark_fixture import MetricReport, NeonBenchmarker
+from fixtures.neon_fixtures import NeonEnvBuilder
+
+
+#
+# Count the Exists requests that the pageserver receives when many new
+# connections insert into many small tables.
+#
+# A small table has no FSM or VM fork, and every backend checks for them the
+# first time it inserts into the table. With negative entries in the relsize
+# cache, only the first backend has to ask the pageserver.
+#
+@pytest.mark.timeout(600)
+def test_small_tables_exists_requests(
+    neon_env_builder: NeonEnvBuilder, zenbenchmark: NeonBenchmarker
+):
+    env = neon_env_builder.init_start()
+    endpoint = env.endpoints.create_start("main")
+    n_tables = 200
+    n_connections = 10
+
+    cur = endpoint.connect().cursor()
+    for i in range(n_tables):
+        cur.execute(f"CREATE TABLE t{i} (x int)")
+
+    ps_http = env.pageserver.http_client()
+    exists_query = {
+        "tenant_id": str(env.initial_tenant),
+        "timeline_id": str(env.initial_timeline),
+        "smgr_query_type": "get_rel_exists",
+    }
+
+    def exists_requests() -> float:
+        return ps_http.get_metric_value("pageserver_smgr_query_seconds_count", exists_query) or 0
+
+    before = exists_requests()
+    with zenbenchmark.record_duration("run"):
+        for _ in range(n_connections):
+            with endpoint.connect() as conn:
+                with conn.cursor() as c:
+                    for i in range(n_tables):
+                        c.execute(f"INSERT INTO t{i} VALUES (1)")
+    after = exists_requests()
+
+    zenbenchmark.record(
+        "exists_requests_per_query",
+        (after - before) / (n_tables * n_connections),
+        "",
+        MetricReport.LOWER_IS_BETTER,
+    )
@@ -1,6 +1,7 @@
 from __future__ import annotations
 
 import enum
+import math
 import os
 import shutil
 import sys
@@ -16,7 +17,8 @@ from fixtures.endpoint.http import EndpointHttpClient
 from fixtures.log_helper import log
 from fixtures.metrics import parse_metrics
 from fixtures.paths import BASE_DIR, COMPUTE_CONFIG_DIR
-from fixtures.utils import wait_until
+from fixtures.pg_version import PgVersion
+from fixtures.utils import USE_LFC, query_scalar, wait_until
 from prometheus_client.samples import Sample
 
 if TYPE_CHECKING:
@@ -24,9 +26,9 @@ if TYPE_CHECKING:
     from types import TracebackType
     from typing import Self, TypedDict
 
-    from fixtures.neon_fixtures import NeonEnv
-    from fixtures.pg_version import PgVersion
+    from fixtures.neon_fixtures import Endpoint, NeonEnv
     from fixtures.port_distributor import PortDistributor
+    from psycopg2.extensions import cursor
 
     class Metric(TypedDict):
         metric_name: str
@@ -475,6 +477,287 @@ def test_perf_counters(neon_simple_env: NeonEnv):
     cur.execute("SELECT * FROM neon_backend_perf_counters")
 
 
+def start_endpoint_with_table(
+    env: NeonEnv, neon_version: str, config_lines: list[str] | None = None
+) -> tuple[Endpoint, cursor]:
+    """
+    Start an endpoint with the given version of the neon extension, and a
+    table 't' that is much larger than shared_buffers.
+    """
+    endpoint = env.endpoints.create_start(
+        "main", config_lines=["shared_buffers='1MB'"] + (config_lines or [])
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute(f"CREATE EXTENSION neon VERSION '{neon_version}'")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE t (i int, t text) WITH (fillfactor = 10)")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 10000) g")
+    return endpoint, cur
+
+
+def scan_from_pageserver(endpoint: Endpoint, cur: cursor) -> None:
+    """
+    Evict table 't' from the buffers and the LFC, and scan it, so that the
+    scan has to go to the pageserver.
+    """
+    endpoint.clear_buffers(cursor=cur)
+    cur.execute("SELECT count(*) FROM t")
+
+
+def test_flight_recorder(neon_simple_env: NeonEnv):
+    """
+    Test the per-backend record of recent pageserver requests, exposed in the
+    neon_flight_recorder view
+    """
+    env = neon_simple_env
+
+    # 1.6 is the minimum version to contain the view.
+    endpoint, cur = start_endpoint_with_table(env, "1.6")
+    cur.execute("SELECT pg_relation_filenode('t')")
+    filenode = cur.fetchone()[0]
+
+    scan_from_pageserver(endpoint, cur)
+
+    # The scan made far more requests than fit in the ring, which now holds
+    # the last 64 records of this backend
+    cur.execute(
+        """
+        SELECT count(*), max(id) - min(id) + 1 FROM neon_flight_recorder
+        WHERE pid = pg_backend_pid()
+        """
+    )
+    assert cur.fetchone() == (64, 64)
+
+    cur.execute(
+        """
+        SELECT source, nblocks, consumed, request_lsn IS NOT NULL,
+               receive_time IS NULL OR receive_time >= send_time
+        FROM neon_flight_recorder
+        WHERE pid = pg_backend_pid() AND request = 'GetPage' AND relnumber = %s
+        """,
+        (filenode,),
+    )
+    rows = cur.fetchall()
+    log.info(f"flight recorder: {rows}")
+    assert len(rows) > 0
+    assert all(source in ("sync", "prefetch") for source, _, _, _, _ in rows)
+    assert all(nblocks == 1 and has_lsn and ordered for _, nblocks, _, has_lsn, ordered in rows)
+    assert any(consumed for _, _, consumed, _, _ in rows)
+
+    if USE_LFC:
+        # The table doesn't fit in shared buffers, so a second scan reads it
+        # back from the LFC. Each read gets one record, however many blocks it
+        # covered.
+        cur.execute("SELECT count(*) FROM t")
+        cur.execute(
+            """
+            SELECT request, nblocks, request_lsn, receive_time >= send_time
+            FROM neon_flight_recorder
+            WHERE pid = pg_backend_pid() AND source = 'lfc' AND relnumber = %s
+            """,
+            (filenode,),
+        )
+        rows = cur.fetchall()
+        log.info(f"flight recorder LFC reads: {rows}")
+        assert len(rows) > 0
+        assert all(
+            request == "GetPage" and nblocks >= 1 and lsn is None and ordered
+            for request, nblocks, lsn, ordered in rows
+        )
+        if env.pg_version >= PgVersion.V17:
+            # Sequential scans read several blocks at a time
+            assert any(nblocks > 1 for _, nblocks, _, _ in rows)
+
+    # Can be switched off
+    cur.execute("SET neon.flight_recorder = off")
+    cur.execute("SELECT max(id) FROM neon_flight_recorder WHERE pid = pg_backend_pid()")
+    last_id = cur.fetchone()[0]
+    cur.execute("SELECT count(*) FROM t")
+    cur.execute("SELECT max(id) FROM neon_flight_recorder WHERE pid = pg_backend_pid()")
+    assert cur.fetchone()[0] == last_id
+
+
+def test_query_io(neon_simple_env: NeonEnv):
+    """
+    Test the per-query pageserver I/O accounting, exposed in the
+    neon_stat_statements_io view
+    """
+    env = neon_simple_env
+
+    # 1.7 is the minimum version to contain the view.
+    endpoint, cur = start_endpoint_with_table(env, "1.7", ["compute_query_id=on"])
+    cur.execute("SELECT pg_relation_size('t') / current_setting('block_size')::int")
+    n_pages = cur.fetchone()[0]
+
+    # The I/O is accounted to the query ID that EXPLAIN VERBOSE shows
+    cur.execute("EXPLAIN (VERBOSE) SELECT count(*) FROM t")
+    queryid = next(
+        int(line.split(":")[1]) for (line,) in cur.fetchall() if "Query Identifier" in line
+    )
+
+    def query_io():
+        cur.execute(
+            """
+            SELECT pageserver_requests, pageserver_received_bytes,
+                   getpage_sync_requests + getpage_prefetch_requests,
+                   getpage_wait_seconds, file_cache_hits
+            FROM neon_stat_statements_io
+            WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+              AND queryid = %s
+            """,
+            (queryid,),
+        )
+        return cur.fetchone()
+
+    cur.execute("SELECT reset_query_io()")
+
+    # Every page of the table has to be fetched from the pageserver
+    scan_from_pageserver(endpoint, cur)
+
+    row = query_io()
+    log.info(f"scan I/O: {row}")
+    assert row is not None
+    requests, received_bytes, getpages, wait_seconds, file_cache_hits = row
+    assert getpages >= n_pages
+    assert requests >= getpages
+    # Every page of the table came in a GetPage response
+    assert received_bytes >= 8192 * n_pages
+    assert wait_seconds > 0
+
+    if USE_LFC:
+        # The table doesn't fit in shared buffers, so running the same query
+        # again reads it from the LFC, and adds to the same entry
+        cur.execute("SELECT count(*) FROM t")
+        row = query_io()
+        log.info(f"scan I/O after second run: {row}")
+        assert row[4] > file_cache_hits
+
+    cur.execute("SELECT reset_query_io()")
+    cur.execute("SELECT count(*) FROM neon_stat_statements_io")
+    assert cur.fetchone()[0] == 0
+
+
+def test_relation_perf_counters(neon_simple_env: NeonEnv):
+    """
+    Test the per-relation GetPage wait histograms, exposed in the
+    neon_relation_perf_counters view
+    """
+    env = neon_simple_env
+
+    # 1.8 is the minimum version to contain the view.
+    endpoint, cur = start_endpoint_with_table(env, "1.8")
+
+    def getpage_waits():
+        cur.execute(
+            """
+            SELECT (SELECT coalesce(sum(value), 0) FROM neon_relation_perf_counters
+                    WHERE relation = 't'::regclass AND forknum = 0
+                      AND metric = 'getpage_wait_seconds_count'),
+                   (SELECT sum(value) FROM neon_relation_perf_counters
+                    WHERE metric = 'getpage_wait_seconds_count'),
+                   (SELECT value FROM neon_backend_perf_counters
+                    WHERE pid = pg_backend_pid() AND metric = 'getpage_wait_seconds_count')
+            """
+        )
+        return cur.fetchone()
+
+    t_before, all_before, backend_before = getpage_waits()
+    scan_from_pageserver(endpoint, cur)
+    t_after, all_after, backend_after = getpage_waits()
+    log.info(
+        f"getpage waits: {t_after - t_before} for t, {all_after - all_before} for all relations, "
+        f"{backend_after - backend_before} in this backend"
+    )
+
+    # Every wait of this backend is counted for some relation, or in the
+    # overflow row. Other backends might have added to the other relations
+    # concurrently.
+    assert t_after - t_before > 0
+    assert t_after - t_before <= backend_after - backend_before
+    assert all_after - all_before >= backend_after - backend_before
+
+
+def test_perf_counter_percentiles(neon_simple_env: NeonEnv):
+    """
+    Test the wait time percentiles, exposed in the
+    neon_perf_counter_percentiles view
+    """
+    env = neon_simple_env
+
+    # 1.10 is the minimum version to contain the view.
+    endpoint, cur = start_endpoint_with_table(env, "1.10")
+    scan_from_pageserver(endpoint, cur)
+
+    cur.execute(
+        """
+        SELECT count, p50, p90, p99, p999 FROM neon_perf_counter_percentiles
+        WHERE metric = 'getpage_wait_seconds'
+        """
+    )
+    row = cur.fetchone()
+    log.info(f"getpage wait percentiles: {row}")
+    assert row is not None
+    count, p50, p90, p99, p999 = row
+    assert count > 0
+    assert 0 <= p50 <= p90 <= p99 <= p999
+
+    # The count matches the Prometheus histogram
+    cur.execute(
+        """
+        SELECT value FROM neon_perf_counters
+        WHERE metric = 'getpage_wait_seconds_count'
+        """
+    )
+    assert cur.fetchone()[0] >= count
+
+
+def test_io_histogram_percentile(neon_simple_env: NeonEnv):
+    """
+    Feed known wait times to an I/O wait histogram, and check that the
+    percentiles are within the bucket error of the exact ones.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start("main")
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon_test_utils")
+
+    def percentile(latencies_us: str, p: float) -> float | None:
+        return query_scalar(cur, f"SELECT test_io_histogram_percentile({latencies_us}, {p})")
+
+    # Below 16 us, every value has a bucket of its own
+    small = "ARRAY(SELECT g FROM generate_series(1, 15) g)"
+    assert percentile(small, 0) == 1 / 1e6
+    assert percentile(small, 20) == 3 / 1e6
+    assert percentile(small, 100) == 15 / 1e6
+
+    # Above that, the highest value of the bucket is returned, which is less
+    # than 1/16 above the exact value
+    uniform = "ARRAY(SELECT g FROM generate_series(1, 1000000) g)"
+    for p in [50, 90, 99, 99.9]:
+        exact = p / 100 * 1000000
+        value = percentile(uniform, p) * 1e6
+        assert exact <= value <= exact * (1 + 1 / 16), f"p{p} = {value}, expected {exact}"
+
+    # A single wait is reported exactly as the upper end of its bucket
+    assert percentile("ARRAY[100000]::int8[]", 50) == 102399 / 1e6
+
+    # Waits of 2^24 us or more go to the overflow bucket, and don't skew the
+    # percentiles below them
+    overflow = """
+        ARRAY(SELECT CASE WHEN g <= 90 THEN 1000 ELSE 20000000 END FROM generate_series(1, 100) g)
+    """
+    assert percentile(overflow, 90) == 1023 / 1e6
+    assert percentile(overflow, 99) == math.inf
+    # The top regular bucket doesn't contain them
+    assert percentile("ARRAY[(1 << 24) - 1]::int8[]", 50) == ((1 << 24) - 1) / 1e6
+    assert percentile("ARRAY[1 << 24]::int8[]", 50) == math.inf
+
+    # An empty histogram has no percentiles
+    assert percentile("ARRAY[]::int8[]", 50) is None
+
+
 def collect_metric(
     client: EndpointHttpClient,
     name: str,
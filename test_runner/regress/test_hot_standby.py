@@ -16,7 +16,7 @@ from fixtures.neon_fixtures import (
     tenant_get_shards,
     wait_replica_caughtup,
 )
-from fixtures.utils import wait_until
+from fixtures.utils import USE_LFC, query_scalar, wait_until
 
 
 def test_hot_standby(neon_simple_env: NeonEnv):
@@ -347,3 +347,55 @@ def test_replica_query_race(neon_simple_env: NeonEnv):
         )
 
     asyncio.run(both())
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+@pytest.mark.parametrize("lfc_redo", [True, False])
+def test_replica_lfc_redo(neon_simple_env: NeonEnv, lfc_redo: bool):
+    """
+    Check that with neon.replica_lfc_redo, WAL replay on a replica updates the
+    pages in the LFC instead of evicting them.
+    """
+    env = neon_simple_env
+
+    primary = env.endpoints.create_start(branch_name="main", endpoint_id="primary")
+    p_cur = primary.connect().cursor()
+    p_cur.execute("CREATE EXTENSION neon")
+    p_cur.execute("CREATE TABLE t (id int, counter int)")
+    p_cur.execute("INSERT INTO t SELECT g, 0 FROM generate_series(1, 50000) g")
+
+    secondary = env.endpoints.new_replica_start(
+        origin=primary,
+        endpoint_id="secondary",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='128MB'",
+            "neon.file_cache_size_limit='64MB'",
+            f"neon.replica_lfc_redo={'on' if lfc_redo else 'off'}",
+        ],
+    )
+    wait_replica_caughtup(primary, secondary)
+
+    s_cur = secondary.connect().cursor()
+    s_cur.execute("SELECT sum(counter) FROM t")
+    relfilenode = query_scalar(s_cur, "SELECT pg_relation_filenode('t')")
+    cached_query = (
+        f"SELECT count(*) FROM local_cache WHERE relfilenode = {relfilenode} AND relforknumber = 0"
+    )
+    cached_before = query_scalar(s_cur, cached_query)
+    assert cached_before > 0
+
+    # Update every row, so that every page of the table is modified
+    p_cur.execute("UPDATE t SET counter = counter + 1")
+    wait_replica_caughtup(primary, secondary)
+
+    cached_after = query_scalar(s_cur, cached_query)
+    log.info(f"cached pages before {cached_before}, after {cached_after}")
+    if lfc_redo:
+        assert cached_after >= cached_before
+    else:
+        assert cached_after < cached_before
+
+    assert query_scalar(s_cur, "SELECT sum(counter) FROM t") == 50000
+    secondary.stop()
+    primary.stop()
@@ -0,0 +1,123 @@
+from __future__ import annotations
+
+from contextlib import closing
+
+import pytest
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.utils import USE_LFC, query_scalar
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+def test_lfc_db_shares(neon_simple_env: NeonEnv):
+    """
+    Check that with neon.file_cache_db_min_share, a database that scans a lot
+    of data doesn't evict the cached pages of another database below its
+    guaranteed share.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='256MB'",
+            "neon.file_cache_size_limit='128MB'",
+            "neon.file_cache_db_min_share=40",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE DATABASE small")
+
+    small_cur = endpoint.connect(dbname="small").cursor()
+    small_cur.execute("CREATE TABLE t (i int, filler text) WITH (fillfactor = 10)")
+    small_cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 2000) g")
+    small_cur.execute("SELECT count(*) FROM t")
+    small_size = query_scalar(small_cur, "SELECT pg_relation_size('t')")
+
+    def small_used() -> int:
+        return query_scalar(
+            cur,
+            """
+            SELECT file_cache_used FROM neon_lfc_db_stats WHERE datname = 'small'
+            """,
+        )
+
+    used_before = small_used()
+    assert used_before * 1024 * 1024 >= small_size
+
+    # Scan more data than fits in the LFC in the other database. Each relation
+    # takes at least one 1MB chunk, so the small database, with its catalogs,
+    # uses a few dozen chunks, below its share of 51 chunks.
+    cur.execute("CREATE TABLE big (i int, filler text) WITH (fillfactor = 10)")
+    cur.execute("INSERT INTO big SELECT g, repeat('x', 100) FROM generate_series(1, 200000) g")
+    for _ in range(2):
+        cur.execute("SELECT count(*) FROM big")
+
+    # Other activity in the small database, like autovacuum, can change its
+    # usage a little, but it keeps at least its table and stays within its
+    # share
+    small_share = 128 * 40 // 100
+    used_after = small_used()
+    assert used_after * 1024 * 1024 >= small_size
+    assert used_after <= small_share
+
+    # Reading the small table again is served from the LFC
+    small_cur.execute("SELECT count(*) FROM t")
+    assert (
+        query_scalar(
+            cur,
+            "SELECT file_cache_hit_ratio FROM neon_lfc_db_stats WHERE datname = 'small'",
+        )
+        > 0
+    )
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+def test_lfc_db_shares_drop_database(neon_simple_env: NeonEnv):
+    """
+    Check that a dropped database loses its share of the LFC, and that its
+    statistics slot is released once its chunks have been evicted.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='256MB'",
+            "neon.file_cache_size_limit='128MB'",
+            "neon.file_cache_db_min_share=40",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE DATABASE dropme")
+    dboid = query_scalar(cur, "SELECT oid FROM pg_database WHERE datname = 'dropme'")
+
+    with closing(endpoint.connect(dbname="dropme")) as conn:
+        dropme_cur = conn.cursor()
+        dropme_cur.execute("CREATE TABLE t (i int, filler text) WITH (fillfactor = 10)")
+        dropme_cur.execute(
+            "INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 2000) g"
+        )
+        dropme_cur.execute("SELECT count(*) FROM t")
+
+    def dropme_used() -> int:
+        return query_scalar(
+            cur, f"SELECT file_cache_used FROM neon_lfc_db_stats WHERE dboid = {dboid}"
+        )
+
+    assert dropme_used() > 0
+
+    cur.execute("DROP DATABASE dropme")
+
+    # Fill the LFC from the other database. The chunks of the dropped database
+    # are no longer protected, so they are evicted, and the slot goes away.
+    cur.execute("CREATE TABLE big (i int, filler text) WITH (fillfactor = 10)")
+    cur.execute("INSERT INTO big SELECT g, repeat('x', 100) FROM generate_series(1, 200000) g")
+    for _ in range(2):
+        cur.execute("SELECT count(*) FROM big")
+
+    cur.execute(f"SELECT count(*) FROM neon_lfc_db_stats WHERE dboid = {dboid}")
+    assert cur.fetchone() == (0,)
@@ -0,0 +1,116 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.utils import USE_LFC, query_scalar, wait_until
+
+
+def lfc_stat(cur, key: str) -> int:
+    return query_scalar(cur, f"SELECT lfc_value FROM neon_lfc_stats WHERE lfc_key = '{key}'")
+
+
+def cached_blocks(cur, relfilenode: int) -> int:
+    return query_scalar(cur, f"SELECT count(*) FROM local_cache WHERE relfilenode = {relfilenode}")
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+def test_lfc_invalidation(neon_simple_env: NeonEnv):
+    """
+    Check that the LFC chunks of dropped and truncated relations are freed
+    right away, and reused for other relations.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='128MB'",
+            "neon.file_cache_size_limit='64MB'",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+
+    # Truncation: the remaining pages stay in the cache
+    cur.execute("CREATE TABLE t (id int, payload text) WITH (fillfactor = 10)")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 20000) g")
+    t_node = query_scalar(cur, "SELECT pg_relation_filenode('t')")
+    assert cached_blocks(cur, t_node) > 0
+
+    cur.execute("DELETE FROM t WHERE id > 1000")
+    cur.execute("VACUUM t")
+    nblocks = query_scalar(cur, "SELECT pg_relation_size('t') / 8192")
+    truncated_blocks = query_scalar(
+        cur,
+        f"SELECT count(*) FROM local_cache WHERE relfilenode = {t_node} "
+        f"AND relforknumber = 0 AND relblocknumber >= {nblocks}",
+    )
+    assert truncated_blocks == 0
+
+    # Drop: the relation size is cached, so the chunks are freed right away
+    cur.execute(
+        "CREATE TABLE d AS SELECT g AS id, repeat('x', 100) AS payload FROM generate_series(1, 100000) g"
+    )
+    d_node = query_scalar(cur, "SELECT pg_relation_filenode('d')")
+    assert cached_blocks(cur, d_node) > 0
+    invalidated = lfc_stat(cur, "file_cache_invalidated")
+
+    cur.execute("DROP TABLE d")
+    assert cached_blocks(cur, d_node) == 0
+    assert lfc_stat(cur, "file_cache_invalidated") > invalidated
+    free_chunks = lfc_stat(cur, "file_cache_free_chunks")
+    assert free_chunks > 0
+
+    # The free chunks are reused before the file is extended
+    used = lfc_stat(cur, "file_cache_used")
+    cur.execute("CREATE TABLE n AS SELECT g AS id FROM generate_series(1, 10000) g")
+    assert lfc_stat(cur, "file_cache_free_chunks") < free_chunks
+    assert lfc_stat(cur, "file_cache_used") > used
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+def test_lfc_invalidation_worker(neon_simple_env: NeonEnv):
+    """
+    Check that the LFC invalidator worker frees the chunks of dropped
+    relations whose size isn't known. With the relsize cache disabled, every
+    invalidation is queued for the worker.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='128MB'",
+            "neon.file_cache_size_limit='64MB'",
+            "neon.relsize_hash_size=0",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+
+    # Enough relations to take several batches of the hash table scan
+    for i in range(10):
+        cur.execute(
+            f"CREATE TABLE d{i} AS SELECT g AS id, repeat('x', 100) AS payload "
+            "FROM generate_series(1, 20000) g"
+        )
+    d_nodes = [query_scalar(cur, f"SELECT pg_relation_filenode('d{i}')") for i in range(10)]
+    cur.execute("CREATE TABLE k AS SELECT g AS id FROM generate_series(1, 100000) g")
+    k_node = query_scalar(cur, "SELECT pg_relation_filenode('k')")
+    k_blocks = cached_blocks(cur, k_node)
+    assert all(cached_blocks(cur, node) > 0 for node in d_nodes)
+    invalidated = lfc_stat(cur, "file_cache_invalidated")
+
+    cur.execute(f"DROP TABLE {', '.join(f'd{i}' for i in range(10))}")
+
+    def all_freed():
+        assert all(cached_blocks(cur, node) == 0 for node in d_nodes)
+
+    wait_until(all_freed)
+    assert lfc_stat(cur, "file_cache_invalidated") > invalidated
+    assert lfc_stat(cur, "file_cache_free_chunks") > 0
+
+    # Other relations are left alone
+    assert cached_blocks(cur, k_node) >= k_blocks
@@ -0,0 +1,67 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.utils import USE_LFC, query_scalar
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+def test_lfc_prewarm(neon_simple_env: NeonEnv):
+    """
+    Check that neon_prewarm_lfc() loads a relation into the LFC without
+    going through shared buffers, so that a scan of it is served from the LFC.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='128MB'",
+            "neon.file_cache_size_limit='64MB'",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE TABLE t (i int, filler text) WITH (fillfactor = 10)")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 20000) g")
+    n_pages = query_scalar(cur, "SELECT pg_relation_size('t') / current_setting('block_size')::int")
+
+    # The LFC is emptied on restart
+    endpoint.stop()
+    endpoint.start()
+    cur = endpoint.connect().cursor()
+
+    def cached_pages() -> int:
+        return query_scalar(
+            cur,
+            """
+            SELECT count(*) FROM local_cache
+            WHERE relfilenode = pg_relation_filenode('t') AND relforknumber = 0
+            """,
+        )
+
+    def perf_counter(metric: str) -> int:
+        return int(
+            query_scalar(
+                cur,
+                "SELECT value FROM neon_backend_perf_counters "
+                f"WHERE pid = pg_backend_pid() AND metric = '{metric}'",
+            )
+        )
+
+    assert cached_pages() == 0
+
+    loaded = query_scalar(cur, "SELECT neon_prewarm_lfc('t')")
+    assert loaded == n_pages
+    assert cached_pages() == n_pages
+    assert perf_counter("file_cache_prewarm_pages_total") == n_pages
+    assert perf_counter("file_cache_prewarm_pages_remaining") == 0
+
+    # Pages that are already cached are not loaded again
+    assert query_scalar(cur, "SELECT neon_prewarm_lfc('t', 'main')") == 0
+
+    # The scan is served from the LFC
+    hits = perf_counter("file_cache_hits_total")
+    assert query_scalar(cur, "SELECT count(*) FROM t") == 20000
+    assert perf_counter("file_cache_hits_total") - hits >= n_pages
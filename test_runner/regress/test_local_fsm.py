@@ -0,0 +1,91 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.utils import query_scalar
+
+
+def test_local_fsm(neon_simple_env: NeonEnv):
+    """
+    Check that with neon.local_fsm, the FSM of a relation is kept in a local
+    file, and that the free space it records is found and reused.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "neon.local_fsm=on",
+            "shared_buffers='1MB'",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE TABLE t (id int, payload text)")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 100000) g")
+    cur.execute("VACUUM t")
+    cur.execute("CHECKPOINT")
+
+    relpath = query_scalar(cur, "SELECT pg_relation_filepath('t')")
+    assert (endpoint.pg_data_dir_path() / f"{relpath}_fsm").exists()
+
+    # The space freed by the delete is found through the local FSM
+    cur.execute("DELETE FROM t WHERE id % 2 = 0")
+    cur.execute("VACUUM t")
+    cur.execute("CHECKPOINT")
+    size = query_scalar(cur, "SELECT pg_relation_size('t')")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 40000) g")
+    assert query_scalar(cur, "SELECT pg_relation_size('t')") == size
+
+    # The local file is removed along with the relation
+    cur.execute("DROP TABLE t")
+    assert not (endpoint.pg_data_dir_path() / f"{relpath}_fsm").exists()
+
+
+@pytest.mark.parametrize("local_fsm", [True, False])
+def test_local_fsm_getpage(neon_simple_env: NeonEnv, local_fsm: bool):
+    """
+    Check that with neon.local_fsm, FSM pages are read from the local file,
+    including the ones written out by the checkpointer, instead of being
+    requested from the pageserver.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            f"neon.local_fsm={'on' if local_fsm else 'off'}",
+            "shared_buffers='1MB'",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE t (id int, payload text)")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 100000) g")
+    cur.execute("DELETE FROM t WHERE id % 2 = 0")
+    cur.execute("VACUUM t")
+    cur.execute("CHECKPOINT")
+
+    def fsm_getpage_waits() -> int:
+        return int(
+            query_scalar(
+                cur,
+                """
+                SELECT coalesce(sum(value), 0) FROM neon_relation_perf_counters
+                WHERE relation = 't'::regclass AND forknum = 1
+                  AND metric = 'getpage_wait_seconds_count'
+                """,
+            )
+        )
+
+    # Evict the FSM from the buffers and the LFC, so that it's read either
+    # from the local file or from the pageserver
+    endpoint.clear_buffers(cursor=cur)
+    before = fsm_getpage_waits()
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 40000) g")
+    after = fsm_getpage_waits()
+
+    if local_fsm:
+        assert after == before
+    else:
+        assert after > before
@@ -150,6 +150,47 @@ def test_pageserver_restart(neon_env_builder: NeonEnvBuilder):
     )
 
 
+def test_pageserver_restart_idle_reconnect(neon_env_builder: NeonEnvBuilder):
+    """
+    Check that a backend whose pageserver connection broke while it was idle
+    notices that before sending its next request, and reconnects right away.
+    """
+    env = neon_env_builder.init_start()
+    endpoint = env.endpoints.create_start(
+        "main", config_lines=["neon.pageserver_idle_check_interval = '1s'"]
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE foo (t text)")
+    cur.execute("INSERT INTO foo SELECT 'row' || g FROM generate_series(1, 1000) g")
+
+    cur.execute("SELECT pg_backend_pid()")
+    backend_pid = cur.fetchone()[0]
+
+    env.pageserver.stop()
+    env.pageserver.start()
+
+    # Let the connection be idle for longer than the check interval
+    def backend_idle():
+        with closing(endpoint.connect()) as conn:
+            with conn.cursor() as other_cur:
+                other_cur.execute(
+                    "SELECT now() - state_change > interval '1s' FROM pg_stat_activity WHERE pid = %s",
+                    (backend_pid,),
+                )
+                assert other_cur.fetchone() == (True,)
+
+    wait_until(backend_idle)
+
+    endpoint.clear_buffers(cursor=cur)
+    cur.execute("SELECT count(*) FROM foo")
+    assert cur.fetchone() == (1000,)
+
+    assert endpoint.log_contains("idle pageserver connection was lost, reconnecting")
+    assert not endpoint.log_contains("pageserver_send disconnected")
+
+
 # Test that repeatedly kills and restarts the page server, while the
 # safekeeper and compute node keep running.
 @pytest.mark.timeout(540)
@@ -279,3 +279,43 @@ def connect_works_correctly(
             assert cur.fetchone() == (1024, 1024, 1, 1024, 524800)
 
     ep.stop()
+
+
+def test_cancellation_keeps_connection(neon_simple_env: NeonEnv):
+    """
+    Check that a query cancelled while waiting for the pageserver doesn't
+    drop the connection, and that the late response is discarded.
+    """
+    env = neon_simple_env
+    ps_http = env.pageserver.http_client()
+    ps_http.is_testing_enabled_or_skip()
+
+    ep = env.endpoints.create_start("main", config_lines=["autovacuum = off"])
+
+    with closing(ep.connect(options="-cstatement_timeout=500ms", autocommit=True)) as conn:
+        with conn.cursor() as cur:
+            cur.execute("CREATE EXTENSION neon")
+
+            def disconnects() -> float:
+                cur.execute(
+                    """
+                    SELECT value FROM neon_backend_perf_counters
+                    WHERE pid = pg_backend_pid() AND metric = 'pageserver_disconnects_total'
+                    """
+                )
+                return cur.fetchone()[0]
+
+            cur.execute("SELECT 0 < pg_database_size(current_database())")
+            assert cur.fetchone() == (True,)
+            disconnects_before = disconnects()
+
+            ps_http.configure_failpoints([(SMGR_DBSIZE, "pause")])
+            with pytest.raises(QueryCanceled):
+                cur.execute("SELECT 0 < pg_database_size(current_database())")
+            ps_http.configure_failpoints([(SMGR_DBSIZE, "off")])
+
+            # The next request reads and throws away the abandoned response
+            # before its own
+            cur.execute("SELECT 0 < pg_database_size(current_database())")
+            assert cur.fetchone() == (True,)
+            assert disconnects() == disconnects_before
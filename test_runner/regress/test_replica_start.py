@@ -28,7 +28,12 @@ from contextlib import closing
 import psycopg2
 import pytest
 from fixtures.log_helper import log
-from fixtures.neon_fixtures import NeonEnv, wait_for_last_flush_lsn, wait_replica_caughtup
+from fixtures.neon_fixtures import (
+    NeonEnv,
+    NeonEnvBuilder,
+    wait_for_last_flush_lsn,
+    wait_replica_caughtup,
+)
 from fixtures.pg_version import PgVersion
 from fixtures.utils import query_scalar, skip_on_postgres, wait_until
 
@@ -137,6 +142,62 @@ def test_replica_start_scan_clog_crashed_xids(neon_simple_env: NeonEnv):
     assert secondary_cur.fetchone() == (1,)
 
 
+def test_replica_start_scan_clog_download(neon_env_builder: NeonEnvBuilder):
+    """
+    Test the CLOG-scanning mechanism at hot standby startup, when the CLOG
+    segments are not included in the basebackup. The range of XIDs to scan
+    crosses a segment boundary, so that several segments are downloaded from
+    the pageserver at once.
+
+    See the module docstring for background.
+    """
+    clog_xacts_per_segment = 32 * 8192 * 4
+
+    env = neon_env_builder.init_start(initial_tenant_conf={"lazy_slru_download": "true"})
+    primary = env.endpoints.create_start(branch_name="main", endpoint_id="primary")
+    primary_conn = primary.connect()
+    primary_cur = primary_conn.cursor()
+    primary_cur.execute("CREATE EXTENSION neon_test_utils")
+    primary_cur.execute("create table t(pk serial primary key, payload integer)")
+
+    # Advance nextXid to just before the end of the first CLOG segment. The
+    # checkpoint moves oldestActiveXid past the consumed XIDs, so that the scan
+    # at replica startup only covers the ones consumed below.
+    next_xid = int(query_scalar(primary_cur, "select txid_current()")) + 1
+    primary_cur.execute(f"select test_consume_xids({clog_xacts_per_segment - 100 - next_xid})")
+    primary_cur.execute("checkpoint")
+
+    # Leave a transaction open just before the segment boundary
+    primary_cur.execute("begin")
+    primary_cur.execute("insert into t (payload) values (0)")
+    open_xid = int(query_scalar(primary_cur, "select txid_current()"))
+    assert clog_xacts_per_segment - 1000 < open_xid < clog_xacts_per_segment
+
+    # Move past the segment boundary in another connection
+    other_cur = primary.connect().cursor()
+    other_cur.execute("select test_consume_xids(200)")
+    other_cur.execute("insert into t (payload) values (1)")
+    assert int(query_scalar(other_cur, "select txid_current()")) > clog_xacts_per_segment
+
+    # Kill the primary before it has a chance to write a running-xacts record
+    primary_cur.execute("select neon_xlogflush()")
+    wait_for_last_flush_lsn(env, primary, env.initial_tenant, env.initial_timeline)
+    primary.stop(mode="immediate")
+
+    # Create a replica. With the 'wait' policy, it would wait for a running-xacts
+    # record that never comes if the CLOG scan failed.
+    secondary = env.endpoints.new_replica_start(
+        origin=primary,
+        endpoint_id="secondary",
+        config_lines=["neon.running_xacts_overflow_policy='wait'"],
+    )
+
+    # Only the committed row is visible in the secondary
+    secondary_cur = secondary.connect().cursor()
+    secondary_cur.execute("select payload from t")
+    assert secondary_cur.fetchall() == [(1,)]
+
+
 @skip_on_postgres(
     PgVersion.V14, reason="pg_log_standby_snapshot() function is available since Postgres 16"
 )
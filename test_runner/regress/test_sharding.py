@@ -1662,6 +1662,62 @@ def test_sharding_unlogged_relation(neon_env_builder: NeonEnvBuilder):
         wait_for_last_flush_lsn(env, ep, tenant_id, timeline_id)
 
 
+def test_sharding_migrate_keeps_connections(neon_env_builder: NeonEnvBuilder):
+    """
+    Check that when one shard of a tenant is migrated to another pageserver,
+    backends only reconnect to that shard, and keep their connections to the
+    other shards.
+    """
+    shard_count = 2
+    neon_env_builder.num_pageservers = 3
+    env = neon_env_builder.init_start(
+        initial_tenant_shard_count=shard_count, initial_tenant_shard_stripe_size=128
+    )
+    tenant_id = env.initial_tenant
+
+    endpoint = env.endpoints.create_start("main", config_lines=["shared_buffers='1MB'"])
+    conn = endpoint.connect()
+    cur = conn.cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE t (i int, t text) WITH (fillfactor = 10)")
+    cur.execute("INSERT INTO t SELECT g, repeat('x', 100) FROM generate_series(1, 10000) g")
+
+    def scan():
+        # Make sure that the scan goes to the pageservers, on both shards
+        endpoint.clear_buffers(cursor=cur)
+        cur.execute("SELECT count(*) FROM t")
+        assert cur.fetchone() == (10000,)
+
+    def disconnects() -> float:
+        cur.execute(
+            """
+            SELECT value FROM neon_backend_perf_counters
+            WHERE pid = pg_backend_pid() AND metric = 'pageserver_disconnects_total'
+            """
+        )
+        return cur.fetchone()[0]
+
+    scan()
+    disconnects_before = disconnects()
+
+    # Move shard 1 to the pageserver that doesn't have any shards yet
+    used = set(int(s["node_id"]) for s in env.storage_controller.locate(tenant_id))
+    dest = next(ps.id for ps in env.pageservers if ps.id not in used)
+    env.storage_controller.tenant_shard_migrate(
+        TenantShardId(tenant_id, shard_number=1, shard_count=shard_count), dest
+    )
+
+    def reconnected_to_moved_shard():
+        scan()
+        assert disconnects() > disconnects_before
+
+    wait_until(reconnected_to_moved_shard)
+
+    # Only the connection to the migrated shard was dropped
+    assert disconnects() == disconnects_before + 1
+
+
 def test_top_tenants(neon_env_builder: NeonEnvBuilder):
     """
     The top_tenants API is used in shard auto-splitting to find candidates.
@@ -0,0 +1,95 @@
+from __future__ import annotations
+
+import pytest
+from fixtures.neon_fixtures import NeonEnv
+from fixtures.utils import USE_LFC, query_scalar
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+@pytest.mark.parametrize("populate", [True, False])
+def test_unlogged_build_lfc(neon_simple_env: NeonEnv, populate: bool):
+    """
+    Check that at the end of an unlogged index build, the pages of the new
+    index are copied to the LFC, unless neon.unlogged_build_populate_lfc is off.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='1MB'",
+            "neon.max_file_cache_size='128MB'",
+            "neon.file_cache_size_limit='64MB'",
+            f"neon.unlogged_build_populate_lfc={'on' if populate else 'off'}",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE TABLE t (p point)")
+    cur.execute("INSERT INTO t SELECT point(g, g) FROM generate_series(1, 100000) g")
+    # GiST indexes are built in unlogged mode
+    cur.execute("CREATE INDEX t_gist ON t USING gist (p)")
+
+    index_blocks = query_scalar(cur, "SELECT pg_relation_size('t_gist') / 8192")
+    cached_blocks = query_scalar(
+        cur,
+        """
+        SELECT count(*) FROM local_cache
+        WHERE relfilenode = pg_relation_filenode('t_gist') AND relforknumber = 0
+        """,
+    )
+    if populate:
+        assert cached_blocks == index_blocks
+    else:
+        # only the pages evicted from shared buffers after the build
+        assert cached_blocks < index_blocks
+
+    # The index is still correct
+    cur.execute("SET enable_seqscan = off")
+    assert query_scalar(cur, "SELECT count(*) FROM t WHERE p <@ box '((1,1),(1000,1000))'") == 1000
+
+
+@pytest.mark.skipif(not USE_LFC, reason="LFC is disabled, skipping")
+def test_unlogged_build_lfc_dirty_buffers(neon_simple_env: NeonEnv):
+    """
+    Check that the pages copied to the LFC at the end of an unlogged build are
+    the latest versions, when the index is still in dirty shared buffers at the
+    end of the build and is written out by a checkpoint afterwards.
+    """
+    env = neon_simple_env
+    endpoint = env.endpoints.create_start(
+        "main",
+        config_lines=[
+            "shared_buffers='64MB'",
+            "neon.max_file_cache_size='128MB'",
+            "neon.file_cache_size_limit='64MB'",
+            "neon.unlogged_build_populate_lfc=on",
+        ],
+    )
+
+    cur = endpoint.connect().cursor()
+    cur.execute("CREATE EXTENSION neon")
+    cur.execute("CREATE EXTENSION neon_test_utils")
+    cur.execute("CREATE TABLE t (p point)")
+    cur.execute("INSERT INTO t SELECT point(g, g) FROM generate_series(1, 100000) g")
+    cur.execute("CREATE INDEX t_gist ON t USING gist (p)")
+    cur.execute("CHECKPOINT")
+
+    # Evict the index from shared buffers, but keep it in the LFC
+    cur.execute("SELECT clear_buffer_cache()")
+
+    cur.execute("SET enable_seqscan = off")
+    hits = query_scalar(
+        cur,
+        "SELECT value FROM neon_backend_perf_counters "
+        "WHERE pid = pg_backend_pid() AND metric = 'file_cache_hits_total'",
+    )
+    assert query_scalar(cur, "SELECT count(*) FROM t WHERE p <@ box '((1,1),(1000,1000))'") == 1000
+    assert (
+        query_scalar(
+            cur,
+            "SELECT value FROM neon_backend_perf_counters "
+            "WHERE pid = pg_backend_pid() AND metric = 'file_cache_hits_total'",
+        )
+        > hits
+    )